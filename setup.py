@@ -1,9 +1,27 @@
+import os
 from distutils.core import setup, Extension
+from distutils.ccompiler import new_compiler
+
+# zstd and lz4 are optional, built in when their headers are installed
+libraries = ['hdfs', 'pthread', 'z']
+define_macros = []
+for header, lib, macro in [('zstd.h', 'zstd', 'HAVE_ZSTD'),
+                           ('lz4frame.h', 'lz4', 'HAVE_LZ4')]:
+    if any(os.path.exists(os.path.join(d, header))
+           for d in ['/usr/include', '/usr/local/include']):
+        libraries.append(lib)
+        define_macros.append((macro, None))
+
+# the libhdfs of Hadoop 2 has hdfsHFlush, 0.20 only a client-side hdfsFlush
+if new_compiler().has_function('hdfsHFlush', libraries=['hdfs'],
+                               library_dirs=['lib']):
+    define_macros.append(('HAVE_HDFS_HFLUSH', None))
 
 pyhdfs = Extension('pyhdfs',
                    sources = ['src/pyhdfs.c'],
                    include_dirs = ['/usr/lib/jvm/java-6-sun/include/'],
-                   libraries = ['hdfs'],
+                   libraries = libraries,
+                   define_macros = define_macros,
                    library_dirs = ['lib'],
                    runtime_library_dirs = ['/usr/local/lib/pyhdfs', '/usr/lib/jvm/java-6-sun/jre/lib/i386/server'],
                    )
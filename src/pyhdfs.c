@@ -21,36 +21,91 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 #include "hdfs.h"
 
+#ifdef HAVE_HDFS_HFLUSH
+/* newer than the bundled hdfs.h, found in libhdfs by setup.py */
+int hdfsHFlush(hdfsFS fs, hdfsFile file);
+#endif
+
 #define NO_JAVA_EXCEPTION_OUTPUT 1
+#define DEFAULT_READ_SIZE (2 * 1024 * 1024)
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define PROGRESS_INTERVAL_MS 200
+#define DEFAULT_THREADS 4
+#define DEFAULT_POOL_SIZE 8
+#define DEFAULT_META_THREADS 16
+#define STAT_BATCH 16
+#define WALK_PENDING 1024
+#define DEFAULT_IDLE_TIMEOUT 60.0
+#define DEFAULT_CACHE_ENTRIES 10000
+#define PAGE_SHARDS 16
+#define DEFAULT_PREADV_GAP (64 * 1024)
+#define CODEC_BUFFER_SIZE (256 * 1024)
+#define PREADV_PIECE (4 * 1024 * 1024)
+
+/**
+ * All libhdfs calls below are made with the GIL released, so several
+ * threads may be inside libhdfs at once. libhdfs attaches each calling
+ * thread to the JVM on its own (AttachCurrentThread in getJNIEnv), the
+ * only process-wide thing we touch is stderr, which is serialized here.
+ */
+static pthread_mutex_t stderr_lock = PTHREAD_MUTEX_INITIALIZER;
 
 FILE *
 disable_stderr(void)
 {
+	pthread_mutex_lock(&stderr_lock);
 	if (NO_JAVA_EXCEPTION_OUTPUT) {
 		return freopen("/dev/null", "w", stderr);
 	}
+	return stderr;
 }
 
 
 FILE *
 renable_stderr(void)
 {
+	FILE *res = stderr;
+
 	if (NO_JAVA_EXCEPTION_OUTPUT) {
-		return freopen("/dev/tty", "w", stderr);
+		res = freopen("/dev/tty", "w", stderr);
 	}
+	pthread_mutex_unlock(&stderr_lock);
+	return res;
 }
 
 
 /**
  * hdfs://hostname:port/path/foo/bar
  *           keep this ~~~~~~~~~~~~~
+ * file:/path/foo/bar (the local file system)
+ * keep ~~~~~~~~~~~~~
  */
 char *remove_host_prefix(char *path) 
 {
-	if (strncmp(path, "hdfs://", 7) == 0) {
-		char *start = rawmemchr(path + 7, '/');
+	char *start = NULL;
+
+	if (strncmp(path, "hdfs://", 7) == 0)
+		start = rawmemchr(path + 7, '/');
+	else if (strncmp(path, "file://", 7) == 0)
+		start = rawmemchr(path + 7, '/');
+	else if (strncmp(path, "file:", 5) == 0)
+		start = path + 5;
+	if (start != NULL) {
 		char *end = rawmemchr(path, '\0');
 		memmove(path, start, end - start + 1);
 	}
@@ -149,592 +204,9569 @@ error:
 
 
 /**
- * Connect to the hdfs file system.
- * @param host A string containing either a host name, or an ip address
- * of the namenode of a hdfs cluster. 
- * @param port The port on which the server is listening.
- * @return Returns a handle to the filesystem or NULL on error.
+ * The local file system handle used by get/put, connected on first use
+ * and then shared by all threads. Users lease it with local_fs_acquire and
+ * give it back with local_fs_release; local_fs_teardown disconnects it as
+ * soon as the last lease is returned.
  */
-static PyObject *
-hdfs_connect(PyObject *self, PyObject *args)
+static hdfsFS local_fs = NULL;
+static int local_fs_users = 0;
+static int local_fs_stale = 0;
+static pthread_mutex_t local_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static hdfsFS
+local_fs_acquire(void)
 {
-	const char *host;
-	tPort port;
-	
-	if (!PyArg_ParseTuple(args, "sH", &host, &port))
-		return NULL;
-	
-	hdfsFS fs = hdfsConnect(host, port);
-	if(!fs) {
-		PyErr_Format(PyExc_SystemError, "Failed to conncect to %s:%d", host, port);
-		return NULL;
-	} 	
-	
-	return PyLong_FromVoidPtr((void *)fs);
+	hdfsFS fs;
+
+	pthread_mutex_lock(&local_fs_lock);
+	if (local_fs == NULL) {
+		local_fs = hdfsConnect(NULL, 0);
+		local_fs_stale = 0;
+	}
+	fs = local_fs;
+	if (fs != NULL)
+		local_fs_users++;
+	pthread_mutex_unlock(&local_fs_lock);
+	return fs;
 }
 
 
-/**
- * Open a hdfs file in given mode.
- * @param fs The configured filesystem handle.
- * @param path The full path to the file.
- * @param flags - an | of bits/fcntl.h file flags - supported flags are O_RDONLY, O_WRONLY (meaning create or overwrite i.e., implies O_TRUNCAT), 
- * O_WRONLY|O_APPEND. Other flags are generally ignored other than (O_RDWR || (O_EXCL & O_CREAT)) which return NULL and set errno equal ENOTSUP.
- * @param bufferSize Size of buffer for read/write - pass 0 if you want
- * to use the default configured values. (optional)
- * @param replication Block replication - pass 0 if you want to use
- * the default configured values. (optional)
- * @param blocksize Size of block - pass 0 if you want to use the
- * default configured values. (optional)
- * @return Returns the handle to the open file or NULL on error.
- */
-static PyObject *
-hdfs_open(PyObject *self, PyObject *args)
+static void
+local_fs_release(hdfsFS fs)
 {
-	PyObject *pyfs;
-	hdfsFS fs;
-	const char *path;
-	const char *mode = "r";
-	int bufsiz = 0;
-	short rep = 0;
-	tSize blksiz = 0;
-	int flags = O_RDONLY;
+	if (fs == NULL)
+		return;
+	pthread_mutex_lock(&local_fs_lock);
+	if (--local_fs_users == 0 && local_fs_stale) {
+		hdfsDisconnect(local_fs);
+		local_fs = NULL;
+		local_fs_stale = 0;
+	}
+	pthread_mutex_unlock(&local_fs_lock);
+}
 
-	if (!PyArg_ParseTuple(args, "Os|sihi", &pyfs, &path, &mode, &bufsiz, &rep, &blksiz))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
 
-	if (!strcmp(mode, "r")) {
-		flags = O_RDONLY;
-	} else if (!strcmp(mode, "w")) {
-		flags = O_WRONLY;
-	} else if (!strcmp(mode, "a")) {
-		/* append is disabled by default 
-		   flags = O_WRONLY | O_APPEND; */
-		PyErr_SetString(PyExc_ValueError, "File append is not supported yet");
-		return NULL;
-	} else {
-		/* bad open mode */
-		PyErr_SetString(PyExc_ValueError, "Unknown file open mode");
-		return NULL;
+static void
+local_fs_teardown(void)
+{
+	pthread_mutex_lock(&local_fs_lock);
+	if (local_fs != NULL) {
+		if (local_fs_users == 0) {
+			hdfsDisconnect(local_fs);
+			local_fs = NULL;
+		} else {
+			local_fs_stale = 1;
+		}
 	}
-	
-	hdfsFile file = hdfsOpenFile(fs, path, flags, bufsiz, rep, blksiz);
-	if(!file) {
-		PyErr_SetString(PyExc_IOError, "Failed to open file");
-		return NULL;
-        }
-	return PyLong_FromVoidPtr(file);
+	pthread_mutex_unlock(&local_fs_lock);
 }
 
 
 /**
- * Read data from an open file
- * @param fs The configured filesystem handle.
- * @param file The file handle.
- * @param size read at most size bytes .
- * @return Returns the number of bytes read, NULL on error.
+ * Start n threads running fn(arg).
+ * @return Returns the number of threads started, which is less than n
+ * if the system ran out of threads.
  */
-static PyObject *
-hdfs_read(PyObject *self, PyObject *args)
+static int
+start_threads(pthread_t *tids, int n, void *(*fn)(void *), void *arg)
 {
-	PyObject *pyfs;
-	PyObject *pyfile;
-	hdfsFS fs;
-	hdfsFile file;
-	void *buf;
-	int size;
-	PyObject *res = NULL;
+	int i;
 
-	
-	if (!PyArg_ParseTuple(args, "OO|i", &pyfs, &pyfile, &size))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	
-	if (size > 2 * 1024 * 1024 || size <= 0)
-		size = 2 * 1024 * 1024;
-			
-	buf = PyMem_Malloc(size);
-	if (buf == NULL) 
-		return PyErr_NoMemory();
-	
-	tSize bytesread = hdfsRead(fs, file, buf, size);
-	if (bytesread == -1) {
-		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
-	} else {
-		res = Py_BuildValue("s#", buf, bytesread);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&tids[i], NULL, fn, arg) != 0)
+			break;
 	}
-	
-	PyMem_Free(buf); 
-	return res;
+	return i;
 }
 
 
-static PyObject *
-hdfs_pread(PyObject *self, PyObject *args)
+static void
+join_threads(pthread_t *tids, int n)
 {
-	PyObject *pyfs;
-	PyObject *pyfile;
-	hdfsFS fs;
-	hdfsFile file;
-	void *buf;
-	tOffset offset;
-	int size;
-	PyObject *res = NULL;
+	int i;
 
-	
-	if (!PyArg_ParseTuple(args, "OOL|i", &pyfs, &pyfile, &offset, &size))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	
-	if (size > 2 * 1024 * 1024 || size <= 0)
-		size = 2 * 1024 * 1024;
-			
-	buf = PyMem_Malloc(size);
-	if (buf == NULL) 
-		return PyErr_NoMemory();
-	
-	tSize bytesread = hdfsPread(fs, file, offset, buf, size);
-	if (bytesread == -1) {
-		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
-	} else {
-		res = Py_BuildValue("s#", buf, bytesread);
-	}
-	
-	PyMem_Free(buf); 
-	return res;
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
 }
 
 
 /**
- * Write data into an open file.
- * @param fs The configured filesystem handle.
- * @param file The file handle.
- * @param buffer The data.
- * @param length The no. of bytes to write. 
- * @return Returns the number of bytes written, NULL on error.
+ * Write all of buf at offset of a local file.
+ * @return Returns 0 on success, -1 on error with errno set.
  */
-static PyObject *
-hdfs_write(PyObject *self, PyObject *args)
+static int
+pwrite_all(int fd, const char *buf, size_t size, off_t offset)
 {
-	PyObject *pyfs;
-	PyObject *pyfile;
-	hdfsFS fs;
-	hdfsFile file;
-	const char *buf;
-	int siz;
-	
-	if (!PyArg_ParseTuple(args, "OOs#", &pyfs, &pyfile, &buf, &siz))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	tSize written = hdfsWrite(fs, file, (void *)buf, siz);
-	
-	if (written == -1) {
-		PyErr_SetString(PyExc_IOError, "Failed to write data to file");
-		return NULL;
-	} else {
-		return Py_BuildValue("i", written);
+	ssize_t n;
+
+	while (size > 0) {
+		n = pwrite(fd, buf, size, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		size -= n;
+		offset += n;
 	}
+	return 0;
 }
 
 
-static PyObject *
-hdfs_flush(PyObject *self, PyObject *args)
+static double
+now_seconds(void)
 {
-	PyObject *pyfs;
-	PyObject *pyfile;
-	hdfsFS fs;
-	hdfsFile file;
-	
-	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pyfile))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	if (hdfsFlush(fs, file) != -1) {
-		Py_RETURN_NONE;
-	} else {
-		PyErr_SetString(PyExc_IOError, "Failed to close file");
-		return NULL;
-	}
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
 
-static PyObject *
-hdfs_seek(PyObject *self, PyObject *args)
-{
-	PyObject *pyfs;
-	PyObject *pyfile;
+/**
+ * Metadata cache, enabled per connection by cache(). stat(), exists()
+ * and listdir() are answered from it for ttl seconds. Entries live in a
+ * hash table and a LRU list of at most max entries. Changes made through
+ * this module drop the entries of the path, of the paths below it and
+ * of its parent directories, and bump the generation so that lookups
+ * started before the change do not store what they fetched. Readers
+ * hold a reference on the cache and on the entry they use, so either
+ * may be dropped while they are busy.
+ */
+enum meta_kind {
+	META_STAT,
+	META_LIST
+};
+
+struct meta_entry {
+	char *path;
+	enum meta_kind kind;
+	hdfsFileInfo *infos;	/* NULL for a missing path or an empty dir */
+	int ninfos;
+	int error;		/* errno of a failed listing */
+	double expires;
+	int refs;		/* the cache and the readers */
+	struct meta_entry *hnext;	/* hash chain */
+	struct meta_entry *prev;	/* LRU list, most recent first */
+	struct meta_entry *next;
+};
+
+struct meta_cache {
 	hdfsFS fs;
-	hdfsFile file;
-	tOffset offset;
-	
-	if (!PyArg_ParseTuple(args, "OOL", &pyfs, &pyfile, &offset))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	if (hdfsSeek(fs, file, offset) != -1) {
-		Py_RETURN_TRUE;
-	} else {
-		Py_RETURN_FALSE;
-	}
-}
+	double ttl;
+	int max;
+	int count;
+	struct meta_entry **buckets;
+	unsigned int nbuckets;
+	struct meta_entry *head;
+	struct meta_entry *tail;
+	unsigned long gen;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long invalidations;
+	int users;		/* changed with meta_caches_lock held */
+	int dropped;
+	pthread_mutex_t lock;
+	struct meta_cache *next;
+};
 
+static struct meta_cache *meta_caches = NULL;
+static pthread_mutex_t meta_caches_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static PyObject *
-hdfs_tell(PyObject *self, PyObject *args)
+
+static unsigned int
+meta_hash(const char *path, enum meta_kind kind)
 {
-	PyObject *pyfs;
-	PyObject *pyfile;
-	hdfsFS fs;
-	hdfsFile file;
-	
-	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pyfile))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	tOffset offset = hdfsTell(fs, file);
-	
-	if (offset != -1) {
-		return Py_BuildValue("L", offset);
-	} else {
-		return Py_BuildValue("L", -1);
-	}
+	unsigned int h = 5381 + kind;
+
+	while (*path != '\0')
+		h = h * 33 + (unsigned char)*path++;
+	return h;
 }
 
 
-static PyObject *
-hdfs_close(PyObject *self, PyObject *args)
+static void
+meta_entry_unref(struct meta_entry *e)
 {
-	PyObject *pyfs;
-	PyObject *pyfile;
-	hdfsFS fs;
-	hdfsFile file;
-	
-	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pyfile))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
-	
-	if (hdfsCloseFile(fs, file) != -1) {
-		Py_RETURN_TRUE;
-	} else {
-		Py_RETURN_FALSE;
+	if (--e->refs == 0) {
+		if (e->infos != NULL)
+			hdfsFreeFileInfo(e->infos, e->ninfos);
+		free(e->path);
+		free(e);
 	}
 }
 
 
 /**
- * Disconnect from hdfs file system.
- * @param fs The configured filesystem handle.
- * @return Returns 0 on success, -1 on error.  
+ * Take an entry out of the cache, with the cache lock held.
  */
-static PyObject *
-hdfs_disconnect(PyObject *self, PyObject *args)
+static void
+meta_unlink(struct meta_cache *c, struct meta_entry *e)
 {
-	PyObject *pyfs;
-	hdfsFS fs;
-	
-	if (!PyArg_ParseTuple(args, "O", &pyfs))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	if (hdfsDisconnect(fs) != -1) {
-		Py_RETURN_TRUE;
-	} else {
-		Py_RETURN_FALSE;
-	}
+	struct meta_entry **p;
+
+	p = &c->buckets[meta_hash(e->path, e->kind) & (c->nbuckets - 1)];
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	c->count--;
+	meta_entry_unref(e);
+}
+
+
+static struct meta_entry *
+meta_find(struct meta_cache *c, const char *path, enum meta_kind kind)
+{
+	struct meta_entry *e;
+
+	e = c->buckets[meta_hash(path, kind) & (c->nbuckets - 1)];
+	while (e != NULL && (e->kind != kind || strcmp(e->path, path)))
+		e = e->hnext;
+	return e;
+}
+
+
+static void
+meta_cache_free(struct meta_cache *c)
+{
+	while (c->head != NULL)
+		meta_unlink(c, c->head);
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c);
+}
+
+
+/**
+ * @return Returns the cache of fs with a reference, NULL if fs has none.
+ */
+static struct meta_cache *
+meta_cache_get(hdfsFS fs)
+{
+	struct meta_cache *c;
+
+	pthread_mutex_lock(&meta_caches_lock);
+	for (c = meta_caches; c != NULL && c->fs != fs; c = c->next)
+		;
+	if (c != NULL)
+		c->users++;
+	pthread_mutex_unlock(&meta_caches_lock);
+	return c;
+}
+
+
+static void
+meta_cache_put(struct meta_cache *c)
+{
+	if (c == NULL)
+		return;
+	pthread_mutex_lock(&meta_caches_lock);
+	if (--c->users == 0 && c->dropped)
+		meta_cache_free(c);
+	pthread_mutex_unlock(&meta_caches_lock);
+}
+
+
+/**
+ * Unlink the cache of fs, if any, and put new in its place, new may be
+ * NULL. The old cache is freed once its last reader is done. Done under
+ * one hold of meta_caches_lock, so that fs never has two caches.
+ */
+static void
+meta_cache_replace(hdfsFS fs, struct meta_cache *new)
+{
+	struct meta_cache **p, *c;
+
+	pthread_mutex_lock(&meta_caches_lock);
+	for (p = &meta_caches; *p != NULL && (*p)->fs != fs; p = &(*p)->next)
+		;
+	c = *p;
+	if (c != NULL) {
+		*p = c->next;
+		c->dropped = 1;
+		if (c->users == 0)
+			meta_cache_free(c);
+	}
+	if (new != NULL) {
+		new->next = meta_caches;
+		meta_caches = new;
+	}
+	pthread_mutex_unlock(&meta_caches_lock);
+}
+
+
+/**
+ * Disable the cache of fs, it is freed once its last reader is done.
+ */
+static void
+meta_cache_drop(hdfsFS fs)
+{
+	meta_cache_replace(fs, NULL);
+}
+
+
+/**
+ * Look up the stat or the listing of path, fetching it from the namenode
+ * on a miss. Called with the GIL released.
+ * @return Returns the entry with a reference, to give back with
+ * meta_release, NULL on error with errno set.
+ */
+static struct meta_entry *
+meta_fetch(struct meta_cache *c, const char *path, enum meta_kind kind)
+{
+	struct meta_entry *e, *old, **bucket;
+	unsigned long gen;
+	char *realpath;
+	int i;
+
+	realpath = hdfs_realpath(c->fs, path);
+	if (realpath == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	pthread_mutex_lock(&c->lock);
+	e = meta_find(c, realpath, kind);
+	if (e != NULL && e->expires > now_seconds()) {
+		c->hits++;
+		if (e->prev != NULL) {
+			e->prev->next = e->next;
+			if (e->next != NULL)
+				e->next->prev = e->prev;
+			else
+				c->tail = e->prev;
+			e->prev = NULL;
+			e->next = c->head;
+			c->head->prev = e;
+			c->head = e;
+		}
+		e->refs++;
+		pthread_mutex_unlock(&c->lock);
+		free(realpath);
+		return e;
+	}
+	c->misses++;
+	gen = c->gen;
+	pthread_mutex_unlock(&c->lock);
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL) {
+		free(realpath);
+		errno = ENOMEM;
+		return NULL;
+	}
+	e->path = realpath;
+	e->kind = kind;
+	e->refs = 1;
+	errno = 0;
+	if (kind == META_STAT) {
+		e->infos = hdfsGetPathInfo(c->fs, realpath);
+		e->ninfos = e->infos != NULL;
+	} else {
+		e->infos = hdfsListDirectory(c->fs, realpath, &e->ninfos);
+		if (e->infos == NULL) {
+			e->ninfos = 0;
+			e->error = errno;
+		}
+		/* readers share the names, strip them once here */
+		for (i = 0; i < e->ninfos; i++)
+			remove_host_prefix(e->infos[i].mName);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	if (gen == c->gen) {
+		old = meta_find(c, realpath, kind);
+		if (old != NULL)
+			meta_unlink(c, old);
+		bucket = &c->buckets[meta_hash(realpath, kind) & (c->nbuckets - 1)];
+		e->hnext = *bucket;
+		*bucket = e;
+		e->prev = NULL;
+		e->next = c->head;
+		if (c->head != NULL)
+			c->head->prev = e;
+		else
+			c->tail = e;
+		c->head = e;
+		c->count++;
+		e->refs++;
+		e->expires = now_seconds() + c->ttl;
+		while (c->count > c->max) {
+			meta_unlink(c, c->tail);
+			c->evictions++;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return e;
+}
+
+
+static void
+meta_release(struct meta_cache *c, struct meta_entry *e)
+{
+	pthread_mutex_lock(&c->lock);
+	meta_entry_unref(e);
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/**
+ * Tell if one path is the other or one of its parent directories.
+ */
+static int
+meta_related(const char *a, const char *b)
+{
+	size_t la = strlen(a), lb = strlen(b);
+	size_t n = la < lb ? la : lb;
+
+	if (strncmp(a, b, n))
+		return 0;
+	if (la == lb)
+		return 1;
+	return (la < lb ? b : a)[n] == '/' || (n > 0 && a[n - 1] == '/');
+}
+
+
+/**
+ * Drop the cached entries of a path changed through fs, of the paths
+ * below it and of its parent directories, or all of them if path is
+ * NULL. Called with the GIL released.
+ */
+static void
+meta_invalidate(hdfsFS fs, const char *path)
+{
+	struct meta_cache *c;
+	struct meta_entry *e, *next;
+	char *realpath = NULL;
+
+	c = meta_cache_get(fs);
+	if (c == NULL)
+		return;
+	if (path != NULL)
+		realpath = hdfs_realpath(fs, path);
+	pthread_mutex_lock(&c->lock);
+	c->gen++;
+	for (e = c->head; e != NULL; e = next) {
+		next = e->next;
+		if (realpath == NULL || meta_related(e->path, realpath)) {
+			meta_unlink(c, e);
+			c->invalidations++;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	free(realpath);
+	meta_cache_put(c);
+}
+
+
+/**
+ * Read-ahead of a File opened with readahead=N: a thread keeps up to N
+ * chunks of the stream in a ring, filled with hdfsRead, so reads are
+ * served from memory while the network works on the next chunks. The
+ * thread owns the stream while it runs; it is paused (parked between
+ * two reads) before anybody else seeks or uses the raw handle. The ring
+ * can be filled by other functions than hdfsRead, a decompressor reads
+ * from another read-ahead this way. It is freed with the GIL released,
+ * so it is allocated with malloc.
+ */
+typedef tSize (*fill_func)(void *arg, char *dst, Py_ssize_t size);
+
+struct ra_slot {
+	char *data;
+	Py_ssize_t pos;
+	Py_ssize_t len;
+};
+
+struct readahead {
+	fill_func fill;		/* hdfsRead-like */
+	void *arg;
+	struct ra_slot *slots;
+	int nslots;
+	Py_ssize_t chunk;
+	int head;		/* next slot to consume */
+	int count;		/* filled slots */
+	int busy;		/* thread is in hdfsRead */
+	int paused;
+	int eof;
+	int error;
+	int stop;
+	unsigned long chunks;	/* stats */
+	unsigned long long bytes;
+	unsigned long stalls;	/* reader waited for the network */
+	double stall_time;
+	unsigned long full;	/* network waited for the reader */
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+static void *
+readahead_worker(void *arg)
+{
+	struct readahead *ra = arg;
+	struct ra_slot *slot;
+	tSize n;
+
+	pthread_mutex_lock(&ra->lock);
+	for (;;) {
+		if (!ra->stop && !ra->paused && !ra->eof && !ra->error &&
+		    ra->count == ra->nslots)
+			ra->full++;
+		while (!ra->stop && (ra->paused || ra->eof || ra->error ||
+				     ra->count == ra->nslots))
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->stop)
+			break;
+
+		/* not visible to the reader until count is bumped */
+		slot = &ra->slots[(ra->head + ra->count) % ra->nslots];
+		ra->busy = 1;
+		pthread_mutex_unlock(&ra->lock);
+		n = ra->fill(ra->arg, slot->data, ra->chunk);
+		pthread_mutex_lock(&ra->lock);
+		ra->busy = 0;
+		if (n < 0) {
+			ra->error = 1;
+		} else if (n == 0) {
+			ra->eof = 1;
+		} else {
+			slot->pos = 0;
+			slot->len = n;
+			ra->count++;
+			ra->chunks++;
+			ra->bytes += n;
+		}
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+
+/**
+ * Make the thread and readers waiting for it give up.
+ */
+static void
+readahead_cancel(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+
+static void
+readahead_free(struct readahead *ra)
+{
+	int i;
+
+	if (ra == NULL)
+		return;
+	readahead_cancel(ra);
+	pthread_join(ra->tid, NULL);
+
+	for (i = 0; i < ra->nslots; i++)
+		free(ra->slots[i].data);
+	free(ra->slots);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+
+/**
+ * Start reading ahead nslots chunks of chunk bytes with fill(arg, ...).
+ * @return Returns the read-ahead, NULL if out of memory or threads.
+ */
+static struct readahead *
+readahead_new(fill_func fill, void *arg, int nslots, Py_ssize_t chunk)
+{
+	struct readahead *ra;
+	int i;
+
+	ra = malloc(sizeof(*ra));
+	if (ra == NULL)
+		return NULL;
+	memset(ra, 0, sizeof(*ra));
+	ra->fill = fill;
+	ra->arg = arg;
+	ra->nslots = nslots;
+	ra->chunk = chunk > INT32_MAX ? INT32_MAX : chunk;
+	ra->slots = malloc(nslots * sizeof(*ra->slots));
+	if (ra->slots == NULL) {
+		free(ra);
+		return NULL;
+	}
+	memset(ra->slots, 0, nslots * sizeof(*ra->slots));
+	for (i = 0; i < nslots; i++) {
+		ra->slots[i].data = malloc(ra->chunk);
+		if (ra->slots[i].data == NULL)
+			break;
+	}
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	if (i < nslots || pthread_create(&ra->tid, NULL, readahead_worker,
+					 ra) != 0) {
+		while (i-- > 0)
+			free(ra->slots[i].data);
+		free(ra->slots);
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->lock);
+		free(ra);
+		return NULL;
+	}
+	return ra;
+}
+
+
+/**
+ * Park the thread and drop what it has read, the stream is then free to
+ * be used by the caller until readahead_resume().
+ */
+static void
+readahead_pause(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->paused = 1;
+	while (ra->busy)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	ra->head = ra->count = 0;
+	ra->eof = ra->error = 0;
+	pthread_mutex_unlock(&ra->lock);
+}
+
+
+/**
+ * Read ahead again from the current position of the stream.
+ */
+static void
+readahead_resume(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->paused = 0;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+
+/**
+ * Copy up to size bytes from the oldest chunk, waiting for the thread
+ * if none is ready yet. Called with the GIL released.
+ * @return Returns the number of bytes copied, 0 on EOF, -1 on error.
+ */
+static tSize
+readahead_read(struct readahead *ra, char *dst, Py_ssize_t size)
+{
+	struct ra_slot *slot;
+	double start;
+	tSize n;
+
+	pthread_mutex_lock(&ra->lock);
+	if (ra->count == 0 && !ra->eof && !ra->error && !ra->stop) {
+		ra->stalls++;
+		start = now_seconds();
+		while (ra->count == 0 && !ra->eof && !ra->error && !ra->stop)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		ra->stall_time += now_seconds() - start;
+	}
+	if (ra->count == 0) {
+		n = ra->error || ra->stop ? -1 : 0;
+		pthread_mutex_unlock(&ra->lock);
+		return n;
+	}
+	slot = &ra->slots[ra->head];
+	pthread_mutex_unlock(&ra->lock);
+
+	/* the slot stays ours until it is handed back below */
+	n = slot->len - slot->pos < size ? slot->len - slot->pos : size;
+	memcpy(dst, slot->data + slot->pos, n);
+	slot->pos += n;
+
+	if (slot->pos == slot->len) {
+		pthread_mutex_lock(&ra->lock);
+		ra->head = (ra->head + 1) % ra->nslots;
+		ra->count--;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+	}
+	return n;
+}
+
+
+/**
+ * Write all of data to a raw handle.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int
+write_full(hdfsFS fs, hdfsFile file, const char *data, Py_ssize_t size)
+{
+	tSize n;
+
+	while (size > 0) {
+		n = hdfsWrite(fs, file, (void *)data,
+			      size > INT32_MAX ? INT32_MAX : size);
+		if (n <= 0)
+			return -1;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Write-behind of a File opened with async_writes=N: full buffers are
+ * queued to a thread that hands them to hdfsWrite, and the File goes on
+ * with a free one from a pool of N. When all N are queued the writer
+ * waits, so at most N buffers are in flight. A failed hdfsWrite is
+ * remembered and reported by the next write, flush or close. The
+ * buffers are swapped with the File's and freed with the GIL released,
+ * both are allocated with malloc.
+ */
+struct writebehind {
+	hdfsFS fs;
+	hdfsFile file;
+	Py_ssize_t bufsize;
+	char **queue;		/* ring of nbufs buffers to write */
+	Py_ssize_t *lens;
+	int head;
+	int count;
+	char **free;		/* stack of free buffers */
+	int nfree;
+	int nbufs;
+	int busy;		/* thread is in hdfsWrite */
+	int error;
+	int stop;
+	Py_ssize_t in_flight;	/* queued and being written, in bytes */
+	unsigned long writes;	/* stats */
+	unsigned long long bytes;
+	unsigned long waits;	/* writer found every buffer in flight */
+	double wait_time;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+static void *
+writebehind_worker(void *arg)
+{
+	struct writebehind *wb = arg;
+	const char *data;
+	char *buf;
+	Py_ssize_t len, left;
+	tSize n = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	for (;;) {
+		while (!wb->stop && wb->count == 0)
+			pthread_cond_wait(&wb->cond, &wb->lock);
+		if (wb->count == 0)
+			break;
+		buf = wb->queue[wb->head];
+		len = wb->lens[wb->head];
+		wb->head = (wb->head + 1) % wb->nbufs;
+		wb->count--;
+		wb->busy = 1;
+		/* after an error the rest is dropped, the stream is broken */
+		left = wb->error ? 0 : len;
+		pthread_mutex_unlock(&wb->lock);
+
+		for (data = buf; left > 0; data += n, left -= n) {
+			n = hdfsWrite(wb->fs, wb->file, (void *)data,
+				      left > INT32_MAX ? INT32_MAX : left);
+			if (n <= 0)
+				break;
+		}
+
+		pthread_mutex_lock(&wb->lock);
+		wb->busy = 0;
+		if (left > 0)
+			wb->error = 1;
+		wb->writes++;
+		wb->bytes += len - left;
+		wb->in_flight -= len;
+		wb->free[wb->nfree++] = buf;
+		pthread_cond_broadcast(&wb->cond);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return NULL;
+}
+
+
+/**
+ * Wait until every queued buffer is written.
+ * @return Returns 0 on success, -1 if a write failed.
+ */
+static int
+writebehind_drain(struct writebehind *wb)
+{
+	int ret;
+
+	pthread_mutex_lock(&wb->lock);
+	while (wb->count > 0 || wb->busy)
+		pthread_cond_wait(&wb->cond, &wb->lock);
+	ret = wb->error ? -1 : 0;
+	pthread_mutex_unlock(&wb->lock);
+	return ret;
+}
+
+
+static void
+writebehind_free(struct writebehind *wb)
+{
+	int i;
+
+	if (wb == NULL)
+		return;
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = 1;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->tid, NULL);
+
+	for (i = 0; i < wb->nfree; i++)
+		free(wb->free[i]);
+	free(wb->free);
+	free(wb->queue);
+	free(wb->lens);
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+}
+
+
+/**
+ * Start a writer thread with a pool of nbufs buffers of bufsize bytes.
+ * @return Returns the write-behind, NULL if out of memory or threads.
+ */
+static struct writebehind *
+writebehind_new(hdfsFS fs, hdfsFile file, int nbufs, Py_ssize_t bufsize)
+{
+	struct writebehind *wb;
+
+	wb = malloc(sizeof(*wb));
+	if (wb == NULL)
+		return NULL;
+	memset(wb, 0, sizeof(*wb));
+	wb->fs = fs;
+	wb->file = file;
+	wb->bufsize = bufsize;
+	wb->nbufs = nbufs;
+	wb->queue = malloc(nbufs * sizeof(*wb->queue));
+	wb->lens = malloc(nbufs * sizeof(*wb->lens));
+	wb->free = malloc(nbufs * sizeof(*wb->free));
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->cond, NULL);
+	if (wb->queue == NULL || wb->lens == NULL || wb->free == NULL)
+		goto fail;
+	while (wb->nfree < nbufs) {
+		wb->free[wb->nfree] = malloc(bufsize);
+		if (wb->free[wb->nfree] == NULL)
+			goto fail;
+		wb->nfree++;
+	}
+	if (pthread_create(&wb->tid, NULL, writebehind_worker, wb) != 0)
+		goto fail;
+	return wb;
+
+fail:
+	while (wb->nfree > 0)
+		free(wb->free[--wb->nfree]);
+	free(wb->free);
+	free(wb->queue);
+	free(wb->lens);
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+	return NULL;
+}
+
+
+/**
+ * Queue the first len bytes of *buf, a bufsize buffer, and replace it
+ * with a free one, waiting for the thread if there is none.
+ * @return Returns 0 on success, -1 if an earlier write failed.
+ */
+static int
+writebehind_submit(struct writebehind *wb, char **buf, Py_ssize_t len)
+{
+	double start;
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->nfree == 0 && !wb->error) {
+		wb->waits++;
+		start = now_seconds();
+		while (wb->nfree == 0 && !wb->error)
+			pthread_cond_wait(&wb->cond, &wb->lock);
+		wb->wait_time += now_seconds() - start;
+	}
+	if (wb->error) {
+		pthread_mutex_unlock(&wb->lock);
+		return -1;
+	}
+	wb->queue[(wb->head + wb->count) % wb->nbufs] = *buf;
+	wb->lens[(wb->head + wb->count) % wb->nbufs] = len;
+	wb->count++;
+	wb->in_flight += len;
+	*buf = wb->free[--wb->nfree];
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+	return 0;
+}
+
+
+/**
+ * Compression of a File opened with compression=...: gzip with zlib,
+ * zstd and lz4 (frame format) when built with HAVE_ZSTD / HAVE_LZ4.
+ * Writes are compressed in the writing thread into a buffer that is
+ * handed out by emit() when full. Reads are decompressed by a thread of
+ * their own: the File reads ahead from a struct readahead filled by
+ * codec_read(), which decompresses what a second read-ahead gets from
+ * the network, so decompression and network reads overlap. Concatenated
+ * gzip members and zstd/lz4 frames are read as one stream, as appends
+ * produce them. The output buffer is swapped with write-behind buffers
+ * and freed with the GIL released, so it is allocated with malloc.
+ */
+enum codec_kind {
+	CODEC_NONE,
+	CODEC_GZIP,
+	CODEC_ZSTD,
+	CODEC_LZ4,
+};
+
+enum codec_op {
+	CODEC_RUN,
+	CODEC_FLUSH,		/* what was written so far can be decompressed */
+	CODEC_END,
+};
+
+/* takes the full buffer, may swap it for another one of the same size */
+typedef int (*emit_func)(void *arg, char **buf, Py_ssize_t len);
+
+struct codec {
+	enum codec_kind kind;
+	int compress;
+	z_stream z;
+#ifdef HAVE_ZSTD
+	ZSTD_CStream *zc;
+	ZSTD_DStream *zd;
+#endif
+#ifdef HAVE_LZ4
+	LZ4F_cctx *lc;
+	LZ4F_dctx *ld;
+	int lz4_begun;		/* frame header written */
+#endif
+	int in_frame;		/* a frame was started and not finished */
+	char *buf;		/* output when compressing, input otherwise */
+	Py_ssize_t size;
+	Py_ssize_t pos;		/* consumed input */
+	Py_ssize_t len;		/* valid bytes */
+	struct readahead *src;	/* compressed data, when decompressing */
+};
+
+#define LZ4_PIECE (16 * 1024)
+
+
+/**
+ * Map a compression name to a codec, "auto" guesses it from the path
+ * suffix when writing. Reads with "auto" are sniffed by codec_sniff().
+ * @return Returns the codec, -1 with an exception set for a bad name.
+ */
+static int
+codec_kind(const char *name, const char *path, int compress)
+{
+	size_t n = strlen(path);
+	int kind = -1;
+
+	if (name == NULL || !strcmp(name, "none"))
+		kind = CODEC_NONE;
+	else if (!strcmp(name, "gzip"))
+		kind = CODEC_GZIP;
+	else if (!strcmp(name, "zstd"))
+		kind = CODEC_ZSTD;
+	else if (!strcmp(name, "lz4"))
+		kind = CODEC_LZ4;
+	else if (!strcmp(name, "auto") && !compress)
+		return CODEC_NONE;
+	else if (!strcmp(name, "auto") && n > 3 && !strcmp(path + n - 3, ".gz"))
+		kind = CODEC_GZIP;
+	else if (!strcmp(name, "auto") && n > 4 && !strcmp(path + n - 4, ".zst"))
+		kind = CODEC_ZSTD;
+	else if (!strcmp(name, "auto") && n > 4 && !strcmp(path + n - 4, ".lz4"))
+		kind = CODEC_LZ4;
+	else if (!strcmp(name, "auto"))
+		kind = CODEC_NONE;
+
+	if (kind == -1) {
+		PyErr_SetString(PyExc_ValueError, "Unknown compression");
+		return -1;
+	}
+#ifndef HAVE_ZSTD
+	if (kind == CODEC_ZSTD) {
+		PyErr_SetString(PyExc_ValueError, "pyhdfs was built without zstd");
+		return -1;
+	}
+#endif
+#ifndef HAVE_LZ4
+	if (kind == CODEC_LZ4) {
+		PyErr_SetString(PyExc_ValueError, "pyhdfs was built without lz4");
+		return -1;
+	}
+#endif
+	return kind;
+}
+
+
+/**
+ * Guess the codec of a stream from its magic number.
+ */
+static enum codec_kind
+codec_sniff(const unsigned char *head, Py_ssize_t len)
+{
+	if (len >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+		return CODEC_GZIP;
+#ifdef HAVE_ZSTD
+	if (len >= 4 && !memcmp(head, "\x28\xb5\x2f\xfd", 4))
+		return CODEC_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+	if (len >= 4 && !memcmp(head, "\x04\x22\x4d\x18", 4))
+		return CODEC_LZ4;
+#endif
+	return CODEC_NONE;
+}
+
+
+static void
+codec_free(struct codec *c)
+{
+	if (c == NULL)
+		return;
+	readahead_free(c->src);
+	if (c->kind == CODEC_GZIP && c->compress)
+		deflateEnd(&c->z);
+	else if (c->kind == CODEC_GZIP)
+		inflateEnd(&c->z);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCStream(c->zc);
+	ZSTD_freeDStream(c->zd);
+#endif
+#ifdef HAVE_LZ4
+	if (c->lc != NULL)
+		LZ4F_freeCompressionContext(c->lc);
+	if (c->ld != NULL)
+		LZ4F_freeDecompressionContext(c->ld);
+#endif
+	free(c->buf);
+	free(c);
+}
+
+
+/**
+ * Set up a compressor, or a decompressor of the data of src.
+ * @param size Size of the output buffer when compressing, it is handed
+ * to emit() and must fit the lz4 bound of LZ4_PIECE bytes, which
+ * assumes a whole 64K block is pending.
+ * @return Returns the codec, NULL if out of memory.
+ */
+static struct codec *
+codec_new(enum codec_kind kind, int compress, Py_ssize_t size)
+{
+	struct codec *c;
+	int ok = 0;
+
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	memset(c, 0, sizeof(*c));
+	c->kind = kind;
+	c->compress = compress;
+	c->size = size;
+	c->buf = malloc(size);
+	if (c->buf == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	switch (kind) {
+	case CODEC_GZIP:
+		/* 16 writes a gzip wrapper, 32 reads gzip or zlib */
+		if (compress)
+			ok = deflateInit2(&c->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					  15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		else
+			ok = inflateInit2(&c->z, 15 + 32) == Z_OK;
+		if (!ok)
+			c->kind = CODEC_NONE;	/* nothing to end */
+		break;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		if (compress)
+			ok = (c->zc = ZSTD_createCStream()) != NULL;
+		else
+			ok = (c->zd = ZSTD_createDStream()) != NULL;
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		if (compress)
+			ok = !LZ4F_isError(LZ4F_createCompressionContext(&c->lc, LZ4F_VERSION));
+		else
+			ok = !LZ4F_isError(LZ4F_createDecompressionContext(&c->ld, LZ4F_VERSION));
+		break;
+#endif
+	default:
+		break;
+	}
+	if (!ok) {
+		codec_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+
+/**
+ * Compress size bytes of data, handing out the output buffer whenever it
+ * fills up, and for CODEC_FLUSH and CODEC_END at the end.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int
+codec_compress(struct codec *c, const char *data, Py_ssize_t size,
+	       enum codec_op op, emit_func emit, void *arg)
+{
+	int done = 0, full, r;
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+	size_t left;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer zin = {data, size, 0};
+	ZSTD_outBuffer zout;
+#endif
+#ifdef HAVE_LZ4
+	size_t piece;
+#endif
+
+	c->z.next_in = (Bytef *)data;
+	c->z.avail_in = size;
+	while (!done) {
+		full = 0;
+		switch (c->kind) {
+		case CODEC_GZIP:
+			c->z.next_out = (Bytef *)c->buf + c->len;
+			c->z.avail_out = c->size - c->len;
+			r = deflate(&c->z, op == CODEC_RUN ? Z_NO_FLUSH :
+				    op == CODEC_FLUSH ? Z_SYNC_FLUSH : Z_FINISH);
+			if (r == Z_STREAM_ERROR)
+				return -1;
+			c->len = c->size - c->z.avail_out;
+			if (op == CODEC_RUN)
+				done = c->z.avail_in == 0;
+			else if (op == CODEC_FLUSH)
+				done = c->z.avail_in == 0 && c->z.avail_out > 0;
+			else
+				done = r == Z_STREAM_END;
+			if (done && op == CODEC_END)
+				deflateReset(&c->z);
+			break;
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			zout.dst = c->buf;
+			zout.size = c->size;
+			zout.pos = c->len;
+			left = ZSTD_compressStream2(c->zc, &zout, &zin,
+						    op == CODEC_RUN ? ZSTD_e_continue :
+						    op == CODEC_FLUSH ? ZSTD_e_flush :
+						    ZSTD_e_end);
+			if (ZSTD_isError(left))
+				return -1;
+			c->len = zout.pos;
+			done = op == CODEC_RUN ? zin.pos == zin.size : left == 0;
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			/* every call needs room for its worst case */
+			piece = size < LZ4_PIECE ? size : LZ4_PIECE;
+			if ((size_t)(c->size - c->len) <
+			    LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(piece, NULL)) {
+				if (c->len == 0)
+					return -1;
+				full = 1;
+				break;
+			}
+			if (!c->lz4_begun) {
+				left = LZ4F_compressBegin(c->lc, c->buf + c->len,
+							  c->size - c->len, NULL);
+				c->lz4_begun = 1;
+			} else if (size > 0) {
+				left = LZ4F_compressUpdate(c->lc, c->buf + c->len,
+							   c->size - c->len,
+							   data, piece, NULL);
+				data += piece;
+				size -= piece;
+			} else if (op == CODEC_RUN) {
+				left = 0;
+				done = 1;
+			} else if (op == CODEC_FLUSH) {
+				left = LZ4F_flush(c->lc, c->buf + c->len,
+						  c->size - c->len, NULL);
+				done = 1;
+			} else {
+				left = LZ4F_compressEnd(c->lc, c->buf + c->len,
+							c->size - c->len, NULL);
+				c->lz4_begun = 0;
+				done = 1;
+			}
+			if (LZ4F_isError(left))
+				return -1;
+			c->len += left;
+			break;
+#endif
+		default:
+			return -1;
+		}
+
+		/* hand out a full buffer, or what is left at a flush */
+		if (c->len > 0 && (full || c->len == c->size ||
+				   (done && op != CODEC_RUN))) {
+			if (emit(arg, &c->buf, c->len) == -1)
+				return -1;
+			c->len = 0;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Decompress from the input buffer into dst. The input may be empty
+ * while the decoder still holds output of what it consumed.
+ * @return Returns the number of bytes produced, -1 on corrupt data or
+ * if nothing could be consumed or produced.
+ */
+static Py_ssize_t
+codec_decode(struct codec *c, char *dst, Py_ssize_t size)
+{
+	Py_ssize_t produced = 0, consumed = 0;
+	int r;
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	size_t hint;
+#endif
+#ifdef HAVE_LZ4
+	size_t in, out, left;
+#endif
+
+	switch (c->kind) {
+	case CODEC_GZIP:
+		c->z.next_in = (Bytef *)c->buf + c->pos;
+		c->z.avail_in = c->len - c->pos;
+		c->z.next_out = (Bytef *)dst;
+		c->z.avail_out = size;
+		r = inflate(&c->z, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+			return -1;
+		consumed = c->len - c->pos - c->z.avail_in;
+		produced = size - c->z.avail_out;
+		/* the next gzip member, if any, starts afresh */
+		c->in_frame = r != Z_STREAM_END;
+		if (r == Z_STREAM_END)
+			inflateReset(&c->z);
+		break;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		zin.src = c->buf + c->pos;
+		zin.size = c->len - c->pos;
+		zin.pos = 0;
+		zout.dst = dst;
+		zout.size = size;
+		zout.pos = 0;
+		hint = ZSTD_decompressStream(c->zd, &zout, &zin);
+		if (ZSTD_isError(hint))
+			return -1;
+		consumed = zin.pos;
+		produced = zout.pos;
+		c->in_frame = hint != 0;
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		in = c->len - c->pos;
+		out = size;
+		left = LZ4F_decompress(c->ld, dst, &out, c->buf + c->pos, &in, NULL);
+		if (LZ4F_isError(left))
+			return -1;
+		consumed = in;
+		produced = out;
+		c->in_frame = left != 0;
+		break;
+#endif
+	default:
+		return -1;
+	}
+
+	c->pos += consumed;
+	if (consumed == 0 && produced == 0)
+		return -1;
+	return produced;
+}
+
+
+/**
+ * fill_func decompressing the compressed stream read ahead in c->src.
+ * @return Returns size bytes, less only at the end of the stream, -1 on
+ * error or if the stream is truncated.
+ */
+static tSize
+codec_read(void *arg, char *dst, Py_ssize_t size)
+{
+	struct codec *c = arg;
+	Py_ssize_t done = 0, n;
+
+	while (done < size) {
+		if (c->pos == c->len) {
+			/* drain what the decoder holds before looking for more */
+			n = -1;
+			if (c->in_frame)
+				n = codec_decode(c, dst + done, size - done);
+			if (n > 0) {
+				done += n;
+				continue;
+			}
+			n = readahead_read(c->src, c->buf, c->size);
+			if (n == -1 || (n == 0 && c->in_frame))
+				return -1;
+			if (n == 0)
+				break;
+			c->pos = 0;
+			c->len = n;
+		}
+		n = codec_decode(c, dst + done, size - done);
+		if (n == -1)
+			return -1;
+		done += n;
+	}
+	return done;
+}
+
+
+/**
+ * pyhdfs.File - a hdfs file opened by open().
+ *
+ * Holds the fs/file handles together with a client-side buffer: in read
+ * mode it is a read-ahead buffer, so small reads and readline() are
+ * served from memory; in write mode small writes are coalesced in it
+ * before they are handed to hdfsWrite. Every method takes the per-file
+ * lock and drops the GIL while it talks to libhdfs. With readahead, the
+ * buffer is refilled from the chunks of struct readahead instead; with
+ * async_writes, a full buffer is queued to struct writebehind as is and
+ * replaced by one of its pool. With compression, the buffer holds
+ * uncompressed data and the stream is only used through the codec.
+ */
+typedef struct {
+	PyObject_HEAD
+	hdfsFS fs;
+	hdfsFile file;		/* NULL once closed */
+	char *path;
+	int flags;
+	char *buf;
+	Py_ssize_t bufsize;
+	Py_ssize_t pos;		/* read: next unread byte in buf */
+	Py_ssize_t len;		/* read: valid bytes in buf, write: pending bytes */
+	tOffset raw_pos;	/* position of the underlying stream */
+	int pos_stale;		/* raw handle was given out, raw_pos may be off */
+	char *cache_path;	/* page cache key, set on first cached pread */
+	tTime cache_mtime;
+	tOffset cache_fsize;
+	int cache_failed;
+	struct readahead *ra;	/* NULL unless opened with readahead */
+	struct writebehind *wb;	/* NULL unless opened with async_writes */
+	struct codec *codec;	/* NULL unless opened with compression */
+	pthread_mutex_t lock;
+} HdfsFileObject;
+
+static PyTypeObject HdfsFileType;
+
+#define HdfsFile_Check(op) PyObject_TypeCheck(op, &HdfsFileType)
+#define FILE_READABLE(f) (((f)->flags & O_ACCMODE) == O_RDONLY)
+#define FILE_MODE(f) (FILE_READABLE(f) ? "r" : (f)->flags & O_APPEND ? "a" : "w")
+/* a thread or codec of the File uses the stream, go through its methods */
+#define FILE_OWNS_STREAM(op) (HdfsFile_Check(op) && \
+	(((HdfsFileObject *)(op))->ra || ((HdfsFileObject *)(op))->wb || \
+	 ((HdfsFileObject *)(op))->codec))
+
+
+/**
+ * Take the per-file lock. If another thread holds it, wait with the GIL
+ * released, the holder may need the GIL back to finish.
+ */
+static void
+file_lock(HdfsFileObject *self)
+{
+	if (pthread_mutex_trylock(&self->lock) != 0) {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&self->lock);
+		Py_END_ALLOW_THREADS
+	}
+}
+
+
+static void
+file_unlock(HdfsFileObject *self)
+{
+	pthread_mutex_unlock(&self->lock);
+}
+
+
+static int
+file_check_open(HdfsFileObject *self)
+{
+	if (self->file == NULL) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+		return -1;
+	}
+	return 0;
+}
+
+
+static int
+file_check_mode(HdfsFileObject *self, int readable)
+{
+	if (file_check_open(self) < 0)
+		return -1;
+	if (FILE_READABLE(self) != readable) {
+		PyErr_SetString(PyExc_IOError, readable ?
+				"File not open for reading" :
+				"File not open for writing");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * The raw handle given out by convert_file may have moved the stream,
+ * ask libhdfs where it is before raw_pos is relied upon again.
+ */
+static void
+file_update_pos(HdfsFileObject *self)
+{
+	tOffset offset;
+
+	if (self->pos_stale) {
+		offset = hdfsTell(self->fs, self->file);
+		if (offset != -1) {
+			self->raw_pos = offset;
+			self->pos_stale = 0;
+		}
+	}
+}
+
+
+/**
+ * fill_func of the read-ahead of a File.
+ */
+static tSize
+file_stream_read(void *arg, char *dst, Py_ssize_t size)
+{
+	HdfsFileObject *self = arg;
+
+	return hdfsRead(self->fs, self->file, dst, size);
+}
+
+
+/**
+ * Read from the underlying stream, bypassing the client-side buffer.
+ * Called with the file lock held and the GIL released.
+ * @return Returns the number of bytes read, 0 on EOF, -1 on error.
+ */
+static tSize
+file_raw_read(HdfsFileObject *self, void *dst, Py_ssize_t size)
+{
+	tSize n;
+
+	if (size > INT32_MAX)
+		size = INT32_MAX;
+	if (self->ra != NULL) {
+		if (self->ra->paused) {
+			file_update_pos(self);
+			readahead_resume(self->ra);
+		}
+		n = readahead_read(self->ra, dst, size);
+	} else {
+		n = hdfsRead(self->fs, self->file, dst, size);
+	}
+	if (n > 0)
+		self->raw_pos += n;
+	return n;
+}
+
+
+/**
+ * emit_func of the compressor of a File.
+ */
+static int
+file_emit(void *arg, char **buf, Py_ssize_t len)
+{
+	HdfsFileObject *self = arg;
+
+	if (self->wb != NULL)
+		return writebehind_submit(self->wb, buf, len);
+	return write_full(self->fs, self->file, *buf, len);
+}
+
+
+/**
+ * Write all of data to the underlying stream, bypassing the client-side
+ * buffer. Called with the file lock held and the GIL released. With
+ * write-behind, data is queued through the (empty) buffer instead.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int
+file_raw_write(HdfsFileObject *self, const char *data, Py_ssize_t size)
+{
+	tSize n;
+
+	if (self->codec != NULL) {
+		if (codec_compress(self->codec, data, size, CODEC_RUN,
+				   file_emit, self) == -1)
+			return -1;
+		self->raw_pos += size;
+		return 0;
+	}
+
+	while (self->wb != NULL && size > 0) {
+		n = size < self->bufsize ? size : self->bufsize;
+		memcpy(self->buf, data, n);
+		if (writebehind_submit(self->wb, &self->buf, n) == -1)
+			return -1;
+		data += n;
+		size -= n;
+		self->raw_pos += n;
+	}
+	while (size > 0) {
+		n = hdfsWrite(self->fs, self->file, (void *)data,
+			      size > INT32_MAX ? INT32_MAX : size);
+		if (n <= 0)
+			return -1;
+		data += n;
+		size -= n;
+		self->raw_pos += n;
+	}
+	return 0;
+}
+
+
+/**
+ * Refill the read buffer with a single read from the stream.
+ * @return Returns the number of bytes buffered, 0 on EOF, -1 on error.
+ */
+static tSize
+file_fill(HdfsFileObject *self)
+{
+	tSize n = file_raw_read(self, self->buf, self->bufsize);
+
+	self->pos = 0;
+	self->len = n > 0 ? n : 0;
+	return n;
+}
+
+
+/**
+ * Copy up to size bytes to dst, from the buffer first and then from the
+ * stream. Requests of at least a buffer's worth go to the stream directly.
+ * Called with the file lock held and the GIL released.
+ * @return Returns the number of bytes read, less than size only at EOF,
+ * -1 on error.
+ */
+static Py_ssize_t
+file_read_into(HdfsFileObject *self, char *dst, Py_ssize_t size)
+{
+	Py_ssize_t done = 0, avail;
+	tSize n;
+
+	while (done < size) {
+		avail = self->len - self->pos;
+		if (avail > 0) {
+			if (avail > size - done)
+				avail = size - done;
+			memcpy(dst + done, self->buf + self->pos, avail);
+			self->pos += avail;
+			done += avail;
+		} else if (size - done >= self->bufsize) {
+			n = file_raw_read(self, dst + done, size - done);
+			if (n <= 0)
+				return n == 0 ? done : -1;
+			done += n;
+		} else {
+			n = file_fill(self);
+			if (n <= 0)
+				return n == 0 ? done : -1;
+		}
+	}
+	return done;
+}
+
+
+/**
+ * Coalesce data in the buffer, or write it out directly if it is at
+ * least a buffer's worth. Called with the file lock held and the GIL
+ * released.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int file_flush_buffer(HdfsFileObject *self);
+
+static int
+file_buffered_write(HdfsFileObject *self, const char *data, Py_ssize_t size)
+{
+	if (self->len + size <= self->bufsize) {
+		memcpy(self->buf + self->len, data, size);
+		self->len += size;
+		return 0;
+	}
+	if (file_flush_buffer(self) == -1)
+		return -1;
+	if (size >= self->bufsize)
+		return file_raw_write(self, data, size);
+	memcpy(self->buf, data, size);
+	self->len = size;
+	return 0;
+}
+
+
+/**
+ * Hand pending writes to hdfsWrite. Called with the file lock held and
+ * the GIL released.
+ */
+static int
+file_flush_buffer(HdfsFileObject *self)
+{
+	int ret = 0;
+
+	if (!FILE_READABLE(self) && self->len > 0 && self->wb != NULL &&
+	    self->codec == NULL) {
+		ret = writebehind_submit(self->wb, &self->buf, self->len);
+		if (ret == 0)
+			self->raw_pos += self->len;
+		self->len = 0;
+	} else if (!FILE_READABLE(self) && self->len > 0) {
+		ret = file_raw_write(self, self->buf, self->len);
+		self->len = 0;
+	}
+	return ret;
+}
+
+
+/**
+ * Bring the underlying stream to the logical position of the file, so
+ * the raw handle can be used directly: pending writes are flushed and
+ * read-ahead data is dropped.
+ */
+static int
+file_sync(HdfsFileObject *self)
+{
+	int ret = 0;
+	tOffset offset;
+
+	file_update_pos(self);
+	if (!FILE_READABLE(self)) {
+		ret = file_flush_buffer(self);
+		if (self->wb != NULL && writebehind_drain(self->wb) == -1)
+			ret = -1;
+		return ret;
+	}
+
+	/* the thread ran ahead of raw_pos, it stays parked until next read */
+	if (self->ra != NULL && !self->ra->paused) {
+		readahead_pause(self->ra);
+		offset = self->raw_pos - (self->len - self->pos);
+		ret = hdfsSeek(self->fs, self->file, offset);
+		if (ret != -1)
+			self->raw_pos = offset;
+	} else if (self->pos < self->len) {
+		offset = self->raw_pos - (self->len - self->pos);
+		ret = hdfsSeek(self->fs, self->file, offset);
+		if (ret != -1)
+			self->raw_pos = offset;
+	}
+	self->pos = self->len = 0;
+	return ret;
+}
+
+
+static int
+file_close_impl(HdfsFileObject *self)
+{
+	int ret = 0;
+
+	if (self->file == NULL)
+		return 0;
+	if (file_flush_buffer(self) == -1)
+		ret = -1;
+	if (self->codec != NULL && !FILE_READABLE(self) &&
+	    codec_compress(self->codec, NULL, 0, CODEC_END, file_emit, self) == -1)
+		ret = -1;
+	if (self->wb != NULL && writebehind_drain(self->wb) == -1)
+		ret = -1;
+	writebehind_free(self->wb);
+	self->wb = NULL;
+	/* the decompressor may be waiting for the network */
+	if (self->codec != NULL && self->codec->src != NULL)
+		readahead_cancel(self->codec->src);
+	readahead_free(self->ra);
+	self->ra = NULL;
+	codec_free(self->codec);
+	self->codec = NULL;
+	if (hdfsCloseFile(self->fs, self->file) == -1)
+		ret = -1;
+	self->file = NULL;
+	if (!FILE_READABLE(self))
+		meta_invalidate(self->fs, self->path);
+	return ret;
+}
+
+
+/**
+ * Guess the codec of a file opened for reading from its first bytes.
+ * @return Returns the codec, -1 on error.
+ */
+static int
+file_sniff(HdfsFileObject *self)
+{
+	unsigned char head[4];
+	Py_ssize_t len = 0;
+	tSize n;
+
+	while (len < (Py_ssize_t)sizeof(head)) {
+		n = hdfsRead(self->fs, self->file, head + len, sizeof(head) - len);
+		if (n == -1)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	if (len > 0 && hdfsSeek(self->fs, self->file, 0) == -1)
+		return -1;
+	return codec_sniff(head, len);
+}
+
+
+/**
+ * Compress writes, or decompress reads on a thread of their own, behind
+ * a read-ahead of at least two chunks of compressed data.
+ */
+static int
+file_codec_setup(HdfsFileObject *self, enum codec_kind kind, int readahead)
+{
+	if (!FILE_READABLE(self)) {
+		self->codec = codec_new(kind, 1, self->bufsize);
+		return self->codec ? 0 : -1;
+	}
+
+	self->codec = codec_new(kind, 0, DEFAULT_CHUNK_SIZE);
+	if (self->codec == NULL)
+		return -1;
+	self->codec->src = readahead_new(file_stream_read, self,
+					 readahead > 2 ? readahead : 2,
+					 DEFAULT_CHUNK_SIZE);
+	if (self->codec->src == NULL)
+		return -1;
+	self->ra = readahead_new(codec_read, self->codec, 2, DEFAULT_CHUNK_SIZE);
+	return self->ra ? 0 : -1;
+}
+
+
+/**
+ * Open a hdfs file, see hdfs_open for the arguments.
+ */
+static PyObject *
+file_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "path", "mode", "bufsize", "replication",
+				 "blocksize", "buffering", "readahead", "async_writes",
+				 "compression", NULL};
+	HdfsFileObject *self;
+	PyObject *pyfs;
+	hdfsFS fs;
+	hdfsFile file;
+	const char *path;
+	const char *mode = "r";
+	int bufsiz = 0;
+	short rep = 0;
+	tSize blksiz = 0;
+	Py_ssize_t buffering = DEFAULT_BUFFER_SIZE;
+	int readahead = 0;
+	int async_writes = 0;
+	const char *compression = NULL;
+	int kind;
+	int flags = O_RDONLY;
+	hdfsFileInfo *info;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sihiniiz", kwlist,
+					 &pyfs, &path, &mode, &bufsiz, &rep,
+					 &blksiz, &buffering, &readahead,
+					 &async_writes, &compression))
+		return NULL;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	if (!strcmp(mode, "r")) {
+		flags = O_RDONLY;
+	} else if (!strcmp(mode, "w")) {
+		flags = O_WRONLY;
+	} else if (!strcmp(mode, "a")) {
+		flags = O_WRONLY | O_APPEND;
+	} else {
+		/* bad open mode */
+		PyErr_SetString(PyExc_ValueError, "Unknown file open mode");
+		return NULL;
+	}
+
+	if (readahead > 0 && flags != O_RDONLY) {
+		PyErr_SetString(PyExc_ValueError, "readahead needs read mode");
+		return NULL;
+	}
+	if (async_writes > 0 && flags == O_RDONLY) {
+		PyErr_SetString(PyExc_ValueError, "async_writes needs write mode");
+		return NULL;
+	}
+	kind = codec_kind(compression, path, flags != O_RDONLY);
+	if (kind == -1)
+		return NULL;
+	/* the compressor output is swapped with write-behind buffers */
+	if (kind != CODEC_NONE && buffering < CODEC_BUFFER_SIZE)
+		buffering = CODEC_BUFFER_SIZE;
+	/* each buffer is one queued write, tiny ones would flood the thread */
+	if (async_writes > 0 && buffering < DEFAULT_BUFFER_SIZE)
+		buffering = DEFAULT_BUFFER_SIZE;
+
+	/* unbuffered still needs room for one byte, readline() uses it */
+	if (buffering <= 0)
+		buffering = 1;
+
+	self = (HdfsFileObject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	pthread_mutex_init(&self->lock, NULL);
+	self->fs = fs;
+	self->flags = flags;
+	self->bufsize = buffering;
+	self->path = strdup(path);
+	self->buf = malloc(buffering);
+	if (self->path == NULL || self->buf == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	file = hdfsOpenFile(fs, path, flags, bufsiz, rep, blksiz);
+	if (file && !FILE_READABLE(self))
+		meta_invalidate(fs, path);
+	/* appends start at the end of the file */
+	if (file && (flags & O_APPEND) && (info = hdfsGetPathInfo(fs, path))) {
+		self->raw_pos = info->mSize;
+		hdfsFreeFileInfo(info, 1);
+	}
+	Py_END_ALLOW_THREADS
+	if (!file) {
+		Py_DECREF(self);
+		PyErr_SetString(PyExc_IOError, "Failed to open file");
+		return NULL;
+	}
+	self->file = file;
+
+	if (flags == O_RDONLY && compression != NULL &&
+	    !strcmp(compression, "auto")) {
+		Py_BEGIN_ALLOW_THREADS
+		kind = file_sniff(self);
+		Py_END_ALLOW_THREADS
+		if (kind == -1) {
+			Py_DECREF(self);
+			PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+			return NULL;
+		}
+	}
+	if (kind != CODEC_NONE) {
+		if (file_codec_setup(self, kind, readahead) == -1) {
+			Py_DECREF(self);
+			PyErr_SetString(PyExc_IOError, "Failed to set up compression");
+			return NULL;
+		}
+	} else if (readahead > 0) {
+		self->ra = readahead_new(file_stream_read, self, readahead,
+					 DEFAULT_CHUNK_SIZE);
+		if (self->ra == NULL) {
+			Py_DECREF(self);
+			PyErr_SetString(PyExc_IOError, "Failed to start read-ahead");
+			return NULL;
+		}
+	}
+	if (async_writes > 0) {
+		self->wb = writebehind_new(fs, file, async_writes, buffering);
+		if (self->wb == NULL) {
+			Py_DECREF(self);
+			PyErr_SetString(PyExc_IOError, "Failed to start write-behind");
+			return NULL;
+		}
+	}
+	return (PyObject *)self;
+}
+
+
+static void
+file_dealloc(HdfsFileObject *self)
+{
+	if (self->file != NULL) {
+		Py_BEGIN_ALLOW_THREADS
+		file_close_impl(self);
+		Py_END_ALLOW_THREADS
+	}
+	pthread_mutex_destroy(&self->lock);
+	free(self->buf);
+	free(self->path);
+	free(self->cache_path);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static PyObject *
+file_repr(HdfsFileObject *self)
+{
+	return PyString_FromFormat("<%s hdfs file '%s', mode '%s' at %p>",
+				   self->file ? "open" : "closed", self->path,
+				   FILE_MODE(self), self);
+}
+
+
+static PyObject *
+file_read(HdfsFileObject *self, PyObject *args)
+{
+	Py_ssize_t size = -1, alloc, done = 0, n = 0;
+	PyObject *res;
+
+	if (!PyArg_ParseTuple(args, "|n:read", &size))
+		return NULL;
+
+	file_lock(self);
+	if (file_check_mode(self, 1) < 0) {
+		file_unlock(self);
+		return NULL;
+	}
+
+	/* served from the buffer, no need to let go of the GIL */
+	if (size >= 0 && size <= self->len - self->pos) {
+		res = PyString_FromStringAndSize(self->buf + self->pos, size);
+		if (res != NULL)
+			self->pos += size;
+		file_unlock(self);
+		return res;
+	}
+
+	alloc = size >= 0 ? size : DEFAULT_READ_SIZE;
+	res = PyString_FromStringAndSize(NULL, alloc);
+	while (res != NULL) {
+		Py_BEGIN_ALLOW_THREADS
+		n = file_read_into(self, PyString_AS_STRING(res) + done,
+				   alloc - done);
+		Py_END_ALLOW_THREADS
+		if (n == -1)
+			break;
+		done += n;
+		if (size >= 0 || done < alloc)
+			break;
+		alloc *= 2;
+		_PyString_Resize(&res, alloc);
+	}
+	file_unlock(self);
+
+	if (res == NULL)
+		return NULL;
+	if (n == -1) {
+		Py_DECREF(res);
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		return NULL;
+	}
+	if (done != alloc)
+		_PyString_Resize(&res, done);
+	return res;
+}
+
+
+/**
+ * "O&" converter for the buffers read into, like "w*" but also taking
+ * objects that only have the old buffer interface, as mmap and array
+ * before Python 2.7. The view must be released with PyBuffer_Release.
+ */
+static int
+convert_writable(PyObject *obj, void *addr)
+{
+	Py_buffer *view = addr;
+	void *ptr;
+	Py_ssize_t len;
+
+	if (PyObject_CheckBuffer(obj))
+		return PyObject_GetBuffer(obj, view, PyBUF_WRITABLE) == 0;
+	if (PyObject_AsWriteBuffer(obj, &ptr, &len) < 0)
+		return 0;
+	return PyBuffer_FillInfo(view, obj, ptr, len, 0, PyBUF_WRITABLE) == 0;
+}
+
+
+static PyObject *
+file_readinto(HdfsFileObject *self, PyObject *args)
+{
+	Py_buffer buf;
+	Py_ssize_t n;
+
+	if (!PyArg_ParseTuple(args, "O&:readinto", convert_writable, &buf))
+		return NULL;
+
+	file_lock(self);
+	if (file_check_mode(self, 1) < 0) {
+		file_unlock(self);
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	n = file_read_into(self, buf.buf, buf.len);
+	Py_END_ALLOW_THREADS
+	file_unlock(self);
+	PyBuffer_Release(&buf);
+
+	if (n == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		return NULL;
+	}
+	return PyInt_FromSsize_t(n);
+}
+
+
+/**
+ * Read one line, including the trailing newline, at most size bytes if
+ * size >= 0. An empty string is returned at EOF.
+ */
+static PyObject *
+file_readline_impl(HdfsFileObject *self, Py_ssize_t size)
+{
+	PyObject *res = NULL;
+	Py_ssize_t done = 0, take;
+	char *start, *nl;
+	tSize n;
+
+	file_lock(self);
+	if (file_check_mode(self, 1) < 0)
+		goto out;
+
+	while (size != 0) {
+		if (self->pos == self->len) {
+			Py_BEGIN_ALLOW_THREADS
+			n = file_fill(self);
+			Py_END_ALLOW_THREADS
+			if (n == -1) {
+				Py_XDECREF(res);
+				res = NULL;
+				PyErr_SetString(PyExc_IOError,
+						"Failed to read data from file");
+				goto out;
+			}
+			if (n == 0)
+				break;
+		}
+		start = self->buf + self->pos;
+		take = self->len - self->pos;
+		if (size >= 0 && take > size - done)
+			take = size - done;
+		nl = memchr(start, '\n', take);
+		if (nl != NULL)
+			take = nl - start + 1;
+
+		/* not from (start, take), short strings may come back shared */
+		if (res == NULL)
+			res = PyString_FromStringAndSize(NULL, take);
+		else
+			_PyString_Resize(&res, done + take);
+		if (res == NULL)
+			goto out;
+		memcpy(PyString_AS_STRING(res) + done, start, take);
+		self->pos += take;
+		done += take;
+		if (nl != NULL || (size >= 0 && done == size))
+			break;
+	}
+	if (res == NULL)
+		res = PyString_FromStringAndSize(NULL, 0);
+out:
+	file_unlock(self);
+	return res;
+}
+
+
+static PyObject *
+file_readline(HdfsFileObject *self, PyObject *args)
+{
+	Py_ssize_t size = -1;
+
+	if (!PyArg_ParseTuple(args, "|n:readline", &size))
+		return NULL;
+	return file_readline_impl(self, size);
+}
+
+
+static PyObject *
+file_iternext(HdfsFileObject *self)
+{
+	PyObject *line = file_readline_impl(self, -1);
+
+	if (line != NULL && PyString_GET_SIZE(line) == 0) {
+		Py_DECREF(line);
+		return NULL;
+	}
+	return line;
+}
+
+
+static PyObject *
+file_write(HdfsFileObject *self, PyObject *args)
+{
+	Py_buffer data;
+	Py_ssize_t size;
+	int ret = 0;
+
+	if (!PyArg_ParseTuple(args, "s*:write", &data))
+		return NULL;
+	size = data.len;
+
+	file_lock(self);
+	if (file_check_mode(self, 0) < 0) {
+		file_unlock(self);
+		PyBuffer_Release(&data);
+		return NULL;
+	}
+
+	if (self->len + data.len <= self->bufsize) {
+		/* coalesced in the buffer, no need to let go of the GIL */
+		memcpy(self->buf + self->len, data.buf, data.len);
+		self->len += data.len;
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		ret = file_buffered_write(self, data.buf, data.len);
+		Py_END_ALLOW_THREADS
+	}
+	file_unlock(self);
+	PyBuffer_Release(&data);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to write data to file");
+		return NULL;
+	}
+	return PyInt_FromSsize_t(size);
+}
+
+
+/**
+ * Get the buffers of a sequence of contiguous buffer objects.
+ * @return Returns an array to give to release_buffers, NULL on error.
+ */
+static Py_buffer *
+get_buffers(PyObject *pybufs, Py_ssize_t *nbufs)
+{
+	Py_buffer *bufs;
+	PyObject *seq;
+	Py_ssize_t i;
+
+	seq = PySequence_Fast(pybufs, "buffers must be a sequence");
+	if (seq == NULL)
+		return NULL;
+	*nbufs = PySequence_Fast_GET_SIZE(seq);
+	bufs = PyMem_Malloc((*nbufs + 1) * sizeof(Py_buffer));
+	if (bufs == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for (i = 0; i < *nbufs; i++) {
+		if (!PyArg_Parse(PySequence_Fast_GET_ITEM(seq, i), "s*", &bufs[i]))
+			break;
+	}
+	Py_DECREF(seq);
+	if (i < *nbufs) {
+		while (i-- > 0)
+			PyBuffer_Release(&bufs[i]);
+		PyMem_Free(bufs);
+		return NULL;
+	}
+	return bufs;
+}
+
+
+static void
+release_buffers(Py_buffer *bufs, Py_ssize_t nbufs)
+{
+	Py_ssize_t i;
+
+	for (i = 0; i < nbufs; i++)
+		PyBuffer_Release(&bufs[i]);
+	PyMem_Free(bufs);
+}
+
+
+/**
+ * Write a sequence of buffers, see hdfs_writev.
+ */
+static PyObject *
+file_writev_impl(HdfsFileObject *self, PyObject *pybufs)
+{
+	Py_buffer *bufs;
+	Py_ssize_t i, nbufs, size = 0;
+	int ret = 0;
+
+	bufs = get_buffers(pybufs, &nbufs);
+	if (bufs == NULL)
+		return NULL;
+
+	file_lock(self);
+	if (file_check_mode(self, 0) < 0) {
+		file_unlock(self);
+		release_buffers(bufs, nbufs);
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < nbufs && ret == 0; i++) {
+		ret = file_buffered_write(self, bufs[i].buf, bufs[i].len);
+		size += bufs[i].len;
+	}
+	Py_END_ALLOW_THREADS
+	file_unlock(self);
+	release_buffers(bufs, nbufs);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to write data to file");
+		return NULL;
+	}
+	return PyInt_FromSsize_t(size);
+}
+
+
+static PyObject *
+file_writev(HdfsFileObject *self, PyObject *args)
+{
+	PyObject *pybufs;
+
+	if (!PyArg_ParseTuple(args, "O:writev", &pybufs))
+		return NULL;
+	return file_writev_impl(self, pybufs);
+}
+
+
+static PyObject *
+file_flush(HdfsFileObject *self)
+{
+	int ret = 0;
+
+	file_lock(self);
+	if (file_check_open(self) < 0) {
+		file_unlock(self);
+		return NULL;
+	}
+	if (!FILE_READABLE(self)) {
+		Py_BEGIN_ALLOW_THREADS
+		ret = file_flush_buffer(self);
+		if (ret == 0 && self->codec != NULL)
+			ret = codec_compress(self->codec, NULL, 0, CODEC_FLUSH,
+					     file_emit, self);
+		if (self->wb != NULL && writebehind_drain(self->wb) == -1)
+			ret = -1;
+		if (ret == 0)
+			ret = hdfsFlush(self->fs, self->file);
+		Py_END_ALLOW_THREADS
+	}
+	file_unlock(self);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to flush file");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+file_seek(HdfsFileObject *self, PyObject *args)
+{
+	tOffset offset, start;
+	int whence = 0;
+	int ret = 0;
+	hdfsFileInfo *info = NULL;
+
+	if (!PyArg_ParseTuple(args, "L|i:seek", &offset, &whence))
+		return NULL;
+	if (whence < 0 || whence > 2) {
+		PyErr_SetString(PyExc_ValueError, "Invalid whence");
+		return NULL;
+	}
+
+	file_lock(self);
+	if (file_check_mode(self, 1) < 0) {
+		file_unlock(self);
+		return NULL;
+	}
+	if (self->codec != NULL) {
+		file_unlock(self);
+		PyErr_SetString(PyExc_IOError, "Cannot seek in a compressed file");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	file_update_pos(self);
+	if (whence == 1) {
+		offset += self->raw_pos - (self->len - self->pos);
+	} else if (whence == 2) {
+		info = hdfsGetPathInfo(self->fs, self->path);
+		if (info != NULL) {
+			offset += info->mSize;
+			hdfsFreeFileInfo(info, 1);
+		} else {
+			ret = -1;
+		}
+	}
+
+	/* stay in the buffer if we can, otherwise drop it */
+	start = self->raw_pos - self->len;
+	if (ret == -1 || offset < 0) {
+		ret = -1;
+	} else if (offset >= start && offset <= self->raw_pos) {
+		self->pos = offset - start;
+	} else {
+		if (self->ra != NULL)
+			readahead_pause(self->ra);
+		ret = hdfsSeek(self->fs, self->file, offset);
+		if (ret != -1) {
+			self->raw_pos = offset;
+			self->pos = self->len = 0;
+		} else if (self->ra != NULL) {
+			/* the thread ran ahead of raw_pos, read on from there */
+			hdfsSeek(self->fs, self->file, self->raw_pos);
+		}
+		if (self->ra != NULL)
+			readahead_resume(self->ra);
+	}
+	Py_END_ALLOW_THREADS
+	file_unlock(self);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to seek in file");
+		return NULL;
+	}
+	return PyLong_FromLongLong(offset);
+}
+
+
+static PyObject *
+file_tell(HdfsFileObject *self)
+{
+	tOffset offset;
+
+	file_lock(self);
+	if (file_check_open(self) < 0) {
+		file_unlock(self);
+		return NULL;
+	}
+	if (self->pos_stale) {
+		Py_BEGIN_ALLOW_THREADS
+		file_update_pos(self);
+		Py_END_ALLOW_THREADS
+	}
+	if (FILE_READABLE(self))
+		offset = self->raw_pos - (self->len - self->pos);
+	else
+		offset = self->raw_pos + self->len;
+	file_unlock(self);
+	return PyLong_FromLongLong(offset);
+}
+
+
+static PyObject *
+file_close(HdfsFileObject *self)
+{
+	int ret;
+
+	file_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	ret = file_close_impl(self);
+	Py_END_ALLOW_THREADS
+	file_unlock(self);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to close file");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+file_readahead_stats(HdfsFileObject *self)
+{
+	struct readahead *ra;
+	PyObject *res;
+
+	file_lock(self);
+	ra = self->ra;
+	if (ra == NULL) {
+		file_unlock(self);
+		PyErr_SetString(PyExc_ValueError, "File not opened with readahead");
+		return NULL;
+	}
+	pthread_mutex_lock(&ra->lock);
+	res = Py_BuildValue("{s:i,s:i,s:n,s:k,s:K,s:k,s:d,s:k}",
+			    "slots", ra->nslots, "depth", ra->count,
+			    "chunk_size", ra->chunk, "chunks", ra->chunks,
+			    "bytes", ra->bytes, "stalls", ra->stalls,
+			    "stall_time", ra->stall_time, "full", ra->full);
+	pthread_mutex_unlock(&ra->lock);
+	file_unlock(self);
+	return res;
+}
+
+
+static PyObject *
+file_async_write_stats(HdfsFileObject *self)
+{
+	struct writebehind *wb;
+	PyObject *res;
+
+	file_lock(self);
+	wb = self->wb;
+	if (wb == NULL) {
+		file_unlock(self);
+		PyErr_SetString(PyExc_ValueError, "File not opened with async_writes");
+		return NULL;
+	}
+	pthread_mutex_lock(&wb->lock);
+	res = Py_BuildValue("{s:i,s:i,s:n,s:k,s:K,s:k,s:d,s:O}",
+			    "buffers", wb->nbufs, "queued", wb->count,
+			    "in_flight", wb->in_flight, "writes", wb->writes,
+			    "bytes", wb->bytes, "waits", wb->waits,
+			    "wait_time", wb->wait_time,
+			    "error", wb->error ? Py_True : Py_False);
+	pthread_mutex_unlock(&wb->lock);
+	file_unlock(self);
+	return res;
+}
+
+
+static PyObject *
+file_enter(HdfsFileObject *self)
+{
+	if (file_check_open(self) < 0)
+		return NULL;
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+
+static PyObject *
+file_exit(HdfsFileObject *self, PyObject *args)
+{
+	return file_close(self);
+}
+
+
+static PyObject *
+file_get_closed(HdfsFileObject *self, void *closure)
+{
+	return PyBool_FromLong(self->file == NULL);
+}
+
+
+static PyObject *
+file_get_name(HdfsFileObject *self, void *closure)
+{
+	return PyString_FromString(self->path);
+}
+
+
+static PyObject *
+file_get_mode(HdfsFileObject *self, void *closure)
+{
+	return PyString_FromString(FILE_MODE(self));
+}
+
+
+static PyMethodDef HdfsFileMethods[] =
+{
+	{"read", (PyCFunction)file_read, METH_VARARGS, "read([size]) -> read at most size bytes, returned as a string \n\nIf the size argument is negative or omitted, read until EOF. Less than size bytes are returned only at EOF"},
+	{"readinto", (PyCFunction)file_readinto, METH_VARARGS, "readinto(buffer) -> bytesread \n\nRead up to len(buffer) bytes into a writable buffer"},
+	{"readline", (PyCFunction)file_readline, METH_VARARGS, "readline([size]) -> next line from the file, as a string \n\nThe trailing newline is kept. An empty string is returned at EOF"},
+	{"write", (PyCFunction)file_write, METH_VARARGS, "write(buffer) -> byteswritten \n\nWrite a string or any contiguous buffer (bytearray, memoryview...) into the file, small writes are buffered"},
+	{"writev", (PyCFunction)file_writev, METH_VARARGS, "writev(buffers) -> byteswritten \n\nWrite a sequence of buffers into the file in one call, small ones are coalesced in the file buffer"},
+	{"flush", (PyCFunction)file_flush, METH_NOARGS, "flush() -> None \n\nWrite out buffered data and flush the file"},
+	{"seek", (PyCFunction)file_seek, METH_VARARGS, "seek(offset[, whence]) -> offset \n\nMove to a new position in read-only mode, whence is 0 (absolute), 1 (relative) or 2 (from the end)"},
+	{"tell", (PyCFunction)file_tell, METH_NOARGS, "tell() -> int \n\nGet the current offset in the file, in bytes"},
+	{"close", (PyCFunction)file_close, METH_NOARGS, "close() -> None \n\nFlush buffered data and close the file"},
+	{"async_write_stats", (PyCFunction)file_async_write_stats, METH_NOARGS, "async_write_stats() -> dict \n\nCounters of a file opened with async_writes: buffers, queued, in_flight bytes, writes and bytes done by the writer thread, waits and wait_time (writes that waited for a free buffer) and error"},
+	{"readahead_stats", (PyCFunction)file_readahead_stats, METH_NOARGS, "readahead_stats() -> dict \n\nCounters of a file opened with readahead: slots, depth (chunks ready now), chunk_size, chunks and bytes read ahead, stalls and stall_time (reads that waited for the network) and full (times the network waited for the reader)"},
+	{"__enter__", (PyCFunction)file_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)file_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyGetSetDef HdfsFileGetSet[] =
+{
+	{"closed", (getter)file_get_closed, NULL, "True if the file is closed", NULL},
+	{"name", (getter)file_get_name, NULL, "Path the file was opened with", NULL},
+	{"mode", (getter)file_get_mode, NULL, "Mode the file was opened with", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+
+static PyTypeObject HdfsFileType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.File",			/* tp_name */
+	sizeof(HdfsFileObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)file_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	(reprfunc)file_repr,		/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"File(fs, path[, mode[, bufsize[, replication[, blocksize[, buffering[, readahead[, async_writes[, compression]]]]]]]]])\n\nA buffered hdfs file, as returned by open()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	PyObject_SelfIter,		/* tp_iter */
+	(iternextfunc)file_iternext,	/* tp_iternext */
+	HdfsFileMethods,		/* tp_methods */
+	0,				/* tp_members */
+	HdfsFileGetSet,			/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	0,				/* tp_init */
+	0,				/* tp_alloc */
+	file_new,			/* tp_new */
+};
+
+
+/**
+ * "O&" converter for the hdfsfile argument of the module functions.
+ * Accepts a File (whose buffers are synced first, so it is safe to use
+ * the raw handle) or a bare handle as returned by older versions.
+ */
+static int
+convert_file(PyObject *obj, void *addr)
+{
+	HdfsFileObject *f;
+	int ret;
+
+	if (!HdfsFile_Check(obj)) {
+		*(hdfsFile *)addr = (hdfsFile)PyLong_AsVoidPtr(obj);
+		return !PyErr_Occurred();
+	}
+
+	f = (HdfsFileObject *)obj;
+	if (f->codec != NULL) {
+		PyErr_SetString(PyExc_ValueError, "Compressed file has no raw handle");
+		return 0;
+	}
+	file_lock(f);
+	if (file_check_open(f) < 0) {
+		file_unlock(f);
+		return 0;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	ret = file_sync(f);
+	Py_END_ALLOW_THREADS
+	*(hdfsFile *)addr = f->file;
+	f->pos_stale = 1;
+	file_unlock(f);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to sync buffered file");
+		return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * pyhdfs.LineIterator - records of a File split on a delimiter, as
+ * returned by iterlines().
+ *
+ * Reads the file a chunk at a time and scans it with memchr (memmem for
+ * multi-byte delimiters). Only the unfinished record at the end of a
+ * chunk is moved to the front of the buffer before the next read, the
+ * buffer grows only for records longer than a chunk.
+ *
+ * For open_split(), limit ends the records at those starting at or after
+ * it, and skip drops the record cut by the start of the split, which
+ * belongs to the previous one.
+ */
+typedef struct {
+	PyObject_HEAD
+	HdfsFileObject *file;
+	int owns_file;		/* opened by iterlines(), closed at the end */
+	char *delim;
+	Py_ssize_t dlen;
+	int keepends;
+	Py_ssize_t batch;
+	char *buf;
+	Py_ssize_t cap;
+	Py_ssize_t start;	/* first byte of the next record */
+	Py_ssize_t scan;	/* no delimiter in [start, scan) */
+	Py_ssize_t end;		/* end of valid data */
+	tOffset base;		/* file offset of buf[0] */
+	tOffset limit;		/* end of the split, -1 for none */
+	int skip;		/* the first record is not ours */
+	int eof;
+	int busy;
+} LineIterObject;
+
+
+/**
+ * Close the File if the iterator opened it. Called on the error path of
+ * lines_iternext() too, so a pending exception is kept over the close.
+ */
+static void
+lines_close_file(LineIterObject *self)
+{
+	PyObject *res, *type, *value, *tb;
+
+	if (self->file != NULL && self->owns_file) {
+		PyErr_Fetch(&type, &value, &tb);
+		res = file_close(self->file);
+		if (res == NULL)
+			PyErr_Clear();
+		Py_XDECREF(res);
+		PyErr_Restore(type, value, tb);
+	}
+	Py_CLEAR(self->file);
+}
+
+
+static void
+lines_dealloc(LineIterObject *self)
+{
+	lines_close_file(self);
+	PyMem_Free(self->buf);
+	PyMem_Free(self->delim);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+/**
+ * Read more data after the end of the buffer, moving the unfinished
+ * record to the front or growing the buffer first if it is full.
+ * @return Returns the number of bytes read, 0 on EOF, -1 on error.
+ */
+static Py_ssize_t
+lines_fill(LineIterObject *self)
+{
+	HdfsFileObject *f = self->file;
+	Py_ssize_t n;
+	char *buf;
+
+	if (self->start > 0) {
+		memmove(self->buf, self->buf + self->start, self->end - self->start);
+		self->base += self->start;
+		self->end -= self->start;
+		self->scan -= self->start;
+		self->start = 0;
+	}
+	if (self->end == self->cap) {
+		buf = PyMem_Realloc(self->buf, self->cap * 2);
+		if (buf == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		self->buf = buf;
+		self->cap *= 2;
+	}
+
+	file_lock(f);
+	if (file_check_mode(f, 1) < 0) {
+		file_unlock(f);
+		return -1;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	n = file_read_into(f, self->buf + self->end, self->cap - self->end);
+	Py_END_ALLOW_THREADS
+	file_unlock(f);
+
+	if (n == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		return -1;
+	}
+	self->end += n;
+	return n;
+}
+
+
+/**
+ * Cut the next record out of the buffer.
+ * @return Returns a new string, NULL with no exception set at the end.
+ */
+static PyObject *
+lines_next_record(LineIterObject *self)
+{
+	char *rec, *hit;
+	Py_ssize_t n, len;
+
+	for (;;) {
+		if (self->limit >= 0 && !self->skip &&
+		    self->base + self->start >= self->limit)
+			return NULL;
+		rec = self->buf + self->start;
+		if (self->dlen == 1)
+			hit = memchr(self->buf + self->scan, self->delim[0],
+				     self->end - self->scan);
+		else
+			hit = memmem(self->buf + self->scan, self->end - self->scan,
+				     self->delim, self->dlen);
+		if (hit != NULL) {
+			len = hit - rec;
+			self->start = self->scan = len + self->dlen + self->start;
+			if (self->skip) {
+				self->skip = 0;
+				continue;
+			}
+			return PyString_FromStringAndSize(rec, self->keepends ?
+							  len + self->dlen : len);
+		}
+
+		/* a multi-byte delimiter may straddle the end of the data */
+		self->scan = self->end - (self->dlen - 1);
+		if (self->scan < self->start)
+			self->scan = self->start;
+
+		if (self->eof) {
+			len = self->end - self->start;
+			if (len == 0 || self->skip)
+				return NULL;
+			self->start = self->scan = self->end;
+			return PyString_FromStringAndSize(rec, len);
+		}
+
+		n = lines_fill(self);
+		if (n == -1)
+			return NULL;
+		if (n == 0)
+			self->eof = 1;
+	}
+}
+
+
+static PyObject *
+lines_iternext(LineIterObject *self)
+{
+	PyObject *res, *rec;
+
+	if (self->file == NULL)
+		return NULL;
+	if (self->busy) {
+		PyErr_SetString(PyExc_ValueError, "LineIterator already executing");
+		return NULL;
+	}
+	self->busy = 1;
+
+	if (self->batch <= 0) {
+		res = lines_next_record(self);
+	} else {
+		res = PyList_New(0);
+		while (res != NULL && PyList_GET_SIZE(res) < self->batch) {
+			rec = lines_next_record(self);
+			if (rec == NULL) {
+				if (PyErr_Occurred())
+					Py_CLEAR(res);
+				break;
+			}
+			if (PyList_Append(res, rec) < 0)
+				Py_CLEAR(res);
+			Py_DECREF(rec);
+		}
+		if (res != NULL && PyList_GET_SIZE(res) == 0)
+			Py_CLEAR(res);
+	}
+
+	if (res == NULL)
+		lines_close_file(self);
+	self->busy = 0;
+	return res;
+}
+
+
+static PyTypeObject LineIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.LineIterator",		/* tp_name */
+	sizeof(LineIterObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)lines_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"Iterator over the records of a hdfs file, see iterlines()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	PyObject_SelfIter,		/* tp_iter */
+	(iternextfunc)lines_iternext,	/* tp_iternext */
+};
+
+
+/**
+ * Set up a LineIterator over file, stealing the reference.
+ * @param delim The record separator, NULL for "\n".
+ * @return Returns the iterator, NULL on error.
+ */
+static LineIterObject *
+lines_new(PyObject *file, int owns_file, Py_buffer *delim, Py_ssize_t chunk,
+	  Py_ssize_t batch, int keepends)
+{
+	LineIterObject *it;
+
+	it = PyObject_New(LineIterObject, &LineIterType);
+	if (it == NULL) {
+		Py_DECREF(file);
+		return NULL;
+	}
+	it->file = (HdfsFileObject *)file;
+	it->owns_file = owns_file;
+	it->dlen = delim ? delim->len : 1;
+	it->delim = PyMem_Malloc(it->dlen);
+	it->cap = chunk;
+	it->buf = PyMem_Malloc(chunk);
+	if (it->delim == NULL || it->buf == NULL) {
+		Py_DECREF(it);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	memcpy(it->delim, delim ? delim->buf : "\n", it->dlen);
+	it->keepends = keepends;
+	it->batch = batch;
+	it->start = it->scan = it->end = 0;
+	it->base = 0;
+	it->limit = -1;
+	it->skip = 0;
+	it->eof = it->busy = 0;
+	return it;
+}
+
+
+/**
+ * Check the delimiter and chunk arguments of iterlines() and open_split().
+ * @return Returns 0 if they are valid, -1 with an exception set otherwise.
+ */
+static int
+lines_check_args(Py_buffer *delim, Py_ssize_t chunk)
+{
+	if (delim->buf != NULL && delim->len == 0) {
+		PyErr_SetString(PyExc_ValueError, "Empty delimiter");
+		return -1;
+	}
+	if (chunk <= 0) {
+		PyErr_SetString(PyExc_ValueError, "chunk must be positive");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Iterate over the records of a file.
+ * @param fs The configured filesystem handle.
+ * @param file A File opened for reading, or the path of a file, which is
+ * then opened and closed by the iterator.
+ * @param delimiter The record separator, "\n" by default.
+ * @param chunk Size of the reads from the file.
+ * @param batch Yield lists of up to batch records instead of records.
+ * @param keepends Keep the delimiter at the end of the records.
+ * @return Returns a LineIterator, NULL on error.
+ */
+static PyObject *
+hdfs_iterlines(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "file", "delimiter", "chunk", "batch",
+				 "keepends", NULL};
+	LineIterObject *it = NULL;
+	PyObject *pyfs;
+	PyObject *pyfile;
+	Py_buffer delim;
+	Py_ssize_t chunk = DEFAULT_CHUNK_SIZE;
+	Py_ssize_t batch = 0;
+	int keepends = 0;
+	int owns_file = 0;
+
+	delim.buf = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|s*nni", kwlist, &pyfs,
+					 &pyfile, &delim, &chunk, &batch,
+					 &keepends))
+		return NULL;
+	if (lines_check_args(&delim, chunk) < 0)
+		goto out;
+
+	if (HdfsFile_Check(pyfile)) {
+		Py_INCREF(pyfile);
+	} else {
+		/* chunks bypass the File's buffer, keep it minimal */
+		pyfile = PyObject_CallFunction((PyObject *)&HdfsFileType, "OOsiiii",
+					       pyfs, pyfile, "r", 0, 0, 0, 1);
+		if (pyfile == NULL)
+			goto out;
+		owns_file = 1;
+	}
+	it = lines_new(pyfile, owns_file, delim.buf ? &delim : NULL, chunk,
+		       batch, keepends);
+
+out:
+	if (delim.buf != NULL)
+		PyBuffer_Release(&delim);
+	return (PyObject *)it;
+}
+
+
+/**
+ * Iterate over the records of one split of a file, those starting in
+ * [start, start + length). The record cut by start is skipped, it ends
+ * the previous split, and the last record is read past the end of the
+ * split up to its delimiter. So the splits of a file together yield each
+ * of its records once, as long as the delimiter cannot overlap itself
+ * ("||" can, "\r\n" cannot).
+ * @param fs The configured filesystem handle.
+ * @param path The path of the file.
+ * @param start Offset of the split.
+ * @param length Length of the split.
+ * @param delimiter The record separator, "\n" by default.
+ * @param readahead Number of 1M chunks read ahead by a thread.
+ * @param chunk Size of the reads from the file.
+ * @param batch Yield lists of up to batch records instead of records.
+ * @param keepends Keep the delimiter at the end of the records.
+ * @return Returns a LineIterator, NULL on error.
+ */
+static PyObject *
+hdfs_open_split(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "path", "start", "length", "delimiter",
+				 "readahead", "chunk", "batch", "keepends",
+				 NULL};
+	LineIterObject *it = NULL;
+	HdfsFileObject *f;
+	hdfsFileInfo *info;
+	PyObject *pyfs;
+	PyObject *pyfile;
+	const char *path;
+	Py_buffer delim;
+	tOffset start, length, pos;
+	Py_ssize_t chunk = DEFAULT_CHUNK_SIZE;
+	Py_ssize_t batch = 0;
+	int readahead = 2;
+	int keepends = 0;
+	int ret = 0;
+
+	delim.buf = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OsLL|s*inni", kwlist,
+					 &pyfs, &path, &start, &length, &delim,
+					 &readahead, &chunk, &batch, &keepends))
+		return NULL;
+	if (lines_check_args(&delim, chunk) < 0)
+		goto out;
+	if (start < 0 || length < 0) {
+		PyErr_SetString(PyExc_ValueError, "Negative split");
+		goto out;
+	}
+
+	pyfile = PyObject_CallFunction((PyObject *)&HdfsFileType, "Ossiiii",
+				       pyfs, path, "r", 0, 0, 0, 1);
+	if (pyfile == NULL)
+		goto out;
+	it = lines_new(pyfile, 1, delim.buf ? &delim : NULL, chunk, batch,
+		       keepends);
+	if (it == NULL)
+		goto out;
+
+	/*
+	 * A record starts right after a delimiter, so the first one at or
+	 * after start follows the first delimiter found from start - dlen.
+	 */
+	pos = start > it->dlen ? start - it->dlen : 0;
+	it->base = pos;
+	it->limit = start + length;
+	it->skip = start > 0;
+
+	/* nobody else has the File yet, set it up without its lock */
+	f = it->file;
+	Py_BEGIN_ALLOW_THREADS
+	if (pos > 0)
+		ret = hdfsSeek(f->fs, f->file, pos);
+	if (ret == -1) {
+		/* hdfsSeek fails past EOF, where a split has no records */
+		info = hdfsGetPathInfo(f->fs, path);
+		if (info != NULL && pos >= info->mSize) {
+			it->eof = 1;
+			ret = 0;
+		}
+		if (info != NULL)
+			hdfsFreeFileInfo(info, 1);
+	} else {
+		f->raw_pos = pos;
+		if (readahead > 0) {
+			f->ra = readahead_new(file_stream_read, f, readahead,
+					      DEFAULT_CHUNK_SIZE);
+			if (f->ra == NULL)
+				ret = -1;
+		}
+	}
+	Py_END_ALLOW_THREADS
+	if (ret == -1) {
+		Py_CLEAR(it);
+		PyErr_SetString(PyExc_IOError, "Failed to open split");
+	}
+
+out:
+	if (delim.buf != NULL)
+		PyBuffer_Release(&delim);
+	return (PyObject *)it;
+}
+
+
+/**
+ * Connect to the hdfs file system.
+ * @param host A string containing either a host name, or an ip address
+ * of the namenode of a hdfs cluster. None connects to the local file system.
+ * @param port The port on which the server is listening.
+ * @return Returns a handle to the filesystem or NULL on error.
+ */
+static PyObject *
+hdfs_connect(PyObject *self, PyObject *args)
+{
+	const char *host;
+	tPort port;
+	hdfsFS fs;
+	
+	if (!PyArg_ParseTuple(args, "zH", &host, &port))
+		return NULL;
+	
+	Py_BEGIN_ALLOW_THREADS
+	fs = hdfsConnect(host, port);
+	Py_END_ALLOW_THREADS
+	if(!fs) {
+		PyErr_Format(PyExc_SystemError, "Failed to conncect to %s:%d",
+			     host ? host : "localfs", port);
+		return NULL;
+	} 	
+	
+	return PyLong_FromVoidPtr((void *)fs);
+}
+
+
+/**
+ * Connect to the hdfs file system as a specific user.
+ * @param host A string containing either a host name, or an ip address
+ * of the namenode of a hdfs cluster. None connects to the local file system.
+ * @param port The port on which the server is listening.
+ * @param user The hadoop user name, None for the default user.
+ * @param groups A sequence of group names of the user. (optional)
+ * @return Returns a handle to the filesystem or NULL on error.
+ */
+static PyObject *
+hdfs_connect_as_user(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"host", "port", "user", "groups", NULL};
+	const char *host;
+	const char *user;
+	const char **groups = NULL;
+	PyObject *pygroups = NULL;
+	PyObject *seq = NULL;
+	Py_ssize_t i, ngroups = 0;
+	tPort port;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "zHz|O", kwlist, &host,
+					 &port, &user, &pygroups))
+		return NULL;
+
+	if (pygroups != NULL && pygroups != Py_None) {
+		seq = PySequence_Fast(pygroups, "groups must be a sequence");
+		if (seq == NULL)
+			return NULL;
+		ngroups = PySequence_Fast_GET_SIZE(seq);
+		groups = PyMem_Malloc((ngroups + 1) * sizeof(char *));
+		if (groups == NULL) {
+			Py_DECREF(seq);
+			return PyErr_NoMemory();
+		}
+		for (i = 0; i < ngroups; i++) {
+			groups[i] = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+			if (groups[i] == NULL) {
+				PyMem_Free(groups);
+				Py_DECREF(seq);
+				return NULL;
+			}
+		}
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	fs = hdfsConnectAsUser(host, port, user, groups, (int)ngroups);
+	Py_END_ALLOW_THREADS
+	PyMem_Free(groups);
+	Py_XDECREF(seq);
+	if (!fs) {
+		PyErr_Format(PyExc_SystemError, "Failed to conncect to %s:%d as %s",
+			     host ? host : "localfs", port,
+			     user ? user : "default user");
+		return NULL;
+	}
+
+	return PyLong_FromVoidPtr((void *)fs);
+}
+
+
+/**
+ * pyhdfs.RollingFile - an append-only log in hdfs, as returned by
+ * rolling().
+ *
+ * Records are written to path through a File opened in append mode, so
+ * a restarted writer goes on with the same file. Small records are
+ * batched in the File buffer. A thread flushes the buffer and the
+ * stream every flush_interval seconds if anything was written, with no
+ * flush per record. Where libhdfs has hdfsHFlush (HAVE_HDFS_HFLUSH) the
+ * stream is hflushed, so a record is readable at most that long after
+ * write() returned. The 0.20 libhdfs only has hdfsFlush, a client-side
+ * flush: records may then stay invisible to readers until more data
+ * follows or the file is closed. Before a record is written, path is
+ * rotated if it has grown to max_size bytes or is older than max_age
+ * seconds: it is closed, renamed to path.YYYYmmdd-HHMMSS and started
+ * again.
+ */
+typedef struct {
+	PyObject_HEAD
+	PyObject *pyfs;
+	hdfsFS fs;
+	char *path;
+	HdfsFileObject *file;	/* NULL once closed */
+	Py_ssize_t buffering;
+	tOffset max_size;
+	double max_age;
+	double flush_interval;
+	double started;		/* when the current file was opened */
+	int dirty;		/* written to since the last flush */
+	int error;		/* a flush of the thread failed */
+	int stop;
+	int has_thread;
+	unsigned long rotations;
+	unsigned long flushes;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} RollingFileObject;
+
+static PyTypeObject RollingFileType;
+
+
+static void
+rolling_lock(RollingFileObject *self)
+{
+	if (pthread_mutex_trylock(&self->lock) != 0) {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&self->lock);
+		Py_END_ALLOW_THREADS
+	}
+}
+
+
+/**
+ * Write out the buffer of the current file and flush it, with hflush
+ * if libhdfs has it. Called with the lock held and the GIL released.
+ */
+static int
+rolling_flush_file(RollingFileObject *self)
+{
+	HdfsFileObject *f = self->file;
+	int ret;
+
+	ret = file_flush_buffer(f);
+	if (f->wb != NULL && writebehind_drain(f->wb) == -1)
+		ret = -1;
+#ifdef HAVE_HDFS_HFLUSH
+	if (ret == 0)
+		ret = hdfsHFlush(f->fs, f->file);
+#else
+	if (ret == 0)
+		ret = hdfsFlush(f->fs, f->file);
+#endif
+	self->dirty = 0;
+	self->flushes++;
+	return ret;
+}
+
+
+static void *
+rolling_flusher(void *arg)
+{
+	RollingFileObject *self = arg;
+	struct timespec ts;
+	double deadline;
+
+	pthread_mutex_lock(&self->lock);
+	while (!self->stop) {
+		deadline = now_seconds() + self->flush_interval;
+		ts.tv_sec = (time_t)deadline;
+		ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&self->cond, &self->lock, &ts);
+		if (!self->stop && self->file != NULL && self->dirty &&
+		    !self->error && rolling_flush_file(self) == -1)
+			self->error = 1;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+
+/**
+ * Open path, appending to it if it exists. Called with the lock held.
+ */
+static int
+rolling_open(RollingFileObject *self)
+{
+	PyObject *f;
+	int exists;
+
+	Py_BEGIN_ALLOW_THREADS
+	exists = hdfsExists(self->fs, self->path) == 0;
+	Py_END_ALLOW_THREADS
+
+	f = PyObject_CallFunction((PyObject *)&HdfsFileType, "Ossihin",
+				  self->pyfs, self->path, exists ? "a" : "w",
+				  0, (short)0, 0, self->buffering);
+	if (f == NULL)
+		return -1;
+	self->file = (HdfsFileObject *)f;
+	self->started = now_seconds();
+	return 0;
+}
+
+
+/**
+ * Close the current file. Called with the lock held.
+ */
+static int
+rolling_close_file(RollingFileObject *self)
+{
+	int ret;
+
+	if (self->file == NULL)
+		return 0;
+	Py_BEGIN_ALLOW_THREADS
+	ret = file_close_impl(self->file);
+	Py_END_ALLOW_THREADS
+	Py_CLEAR(self->file);
+	self->dirty = 0;
+	return ret;
+}
+
+
+/**
+ * Close path, move it aside under its rotation time and start it again.
+ * Called with the lock held.
+ */
+static int
+rolling_rotate(RollingFileObject *self)
+{
+	char stamp[32];
+	char *dst;
+	size_t size;
+	time_t now = time(NULL);
+	int ret, i;
+
+	if (rolling_close_file(self) == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to close file");
+		return -1;
+	}
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	size = strlen(self->path) + strlen(stamp) + 16;
+	dst = malloc(size);
+	if (dst == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	snprintf(dst, size, "%s.%s", self->path, stamp);
+	/* more than one rotation in a second */
+	for (i = 1; hdfsExists(self->fs, dst) == 0; i++)
+		snprintf(dst, size, "%s.%s.%d", self->path, stamp, i);
+	ret = hdfsRename(self->fs, self->path, dst);
+	if (ret == 0) {
+		meta_invalidate(self->fs, self->path);
+		meta_invalidate(self->fs, dst);
+	}
+	Py_END_ALLOW_THREADS
+	free(dst);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to rename file");
+		return -1;
+	}
+	self->rotations++;
+	return rolling_open(self);
+}
+
+
+/**
+ * Check that the file is usable, and rotate it if it is due. Called with
+ * the lock held.
+ */
+static int
+rolling_prepare(RollingFileObject *self)
+{
+	tOffset size;
+
+	if (self->file == NULL) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+		return -1;
+	}
+	if (self->error) {
+		PyErr_SetString(PyExc_IOError, "Failed to flush file");
+		return -1;
+	}
+	size = self->file->raw_pos + self->file->len;
+	if (size > 0 && ((self->max_size > 0 && size >= self->max_size) ||
+			 (self->max_age > 0 &&
+			  now_seconds() - self->started >= self->max_age)))
+		return rolling_rotate(self);
+	return 0;
+}
+
+
+/**
+ * Write one record, see rolling_write.
+ */
+static int
+rolling_write_record(RollingFileObject *self, Py_buffer *data)
+{
+	HdfsFileObject *f;
+	int ret = 0;
+
+	if (rolling_prepare(self) == -1)
+		return -1;
+	f = self->file;
+	if (f->len + data->len <= f->bufsize) {
+		memcpy(f->buf + f->len, data->buf, data->len);
+		f->len += data->len;
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		ret = file_buffered_write(f, data->buf, data->len);
+		Py_END_ALLOW_THREADS
+	}
+	self->dirty = 1;
+	if (ret == -1)
+		PyErr_SetString(PyExc_IOError, "Failed to write data to file");
+	return ret;
+}
+
+
+static PyObject *
+rolling_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "path", "max_size", "max_age",
+				 "flush_interval", "buffering", NULL};
+	RollingFileObject *self;
+	PyObject *pyfs;
+	const char *path;
+	PY_LONG_LONG max_size = 0;
+	double max_age = 0;
+	double flush_interval = 1.0;
+	Py_ssize_t buffering = DEFAULT_BUFFER_SIZE;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|Lddn", kwlist, &pyfs,
+					 &path, &max_size, &max_age,
+					 &flush_interval, &buffering))
+		return NULL;
+
+	self = (RollingFileObject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	Py_INCREF(pyfs);
+	self->pyfs = pyfs;
+	self->fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	self->max_size = max_size;
+	self->max_age = max_age;
+	self->flush_interval = flush_interval;
+	self->buffering = buffering;
+	self->path = strdup(path);
+	if (self->path == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+
+	pthread_mutex_lock(&self->lock);
+	ret = rolling_open(self);
+	pthread_mutex_unlock(&self->lock);
+	if (ret == -1) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	if (flush_interval > 0) {
+		if (pthread_create(&self->tid, NULL, rolling_flusher, self) != 0) {
+			Py_DECREF(self);
+			PyErr_SetString(PyExc_IOError, "Failed to start flusher");
+			return NULL;
+		}
+		self->has_thread = 1;
+	}
+	return (PyObject *)self;
+}
+
+
+/**
+ * Stop the flusher and close the current file.
+ */
+static int
+rolling_close_impl(RollingFileObject *self)
+{
+	int ret;
+
+	if (self->has_thread) {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&self->lock);
+		self->stop = 1;
+		pthread_cond_signal(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+		pthread_join(self->tid, NULL);
+		Py_END_ALLOW_THREADS
+		self->has_thread = 0;
+	}
+	rolling_lock(self);
+	ret = rolling_close_file(self);
+	if (self->error)
+		ret = -1;
+	self->error = 0;
+	pthread_mutex_unlock(&self->lock);
+	return ret;
+}
+
+
+static void
+rolling_dealloc(RollingFileObject *self)
+{
+	rolling_close_impl(self);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	Py_XDECREF(self->pyfs);
+	free(self->path);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static PyObject *
+rolling_write(RollingFileObject *self, PyObject *args)
+{
+	Py_buffer data;
+	Py_ssize_t size;
+	int ret;
+
+	if (!PyArg_ParseTuple(args, "s*:write", &data))
+		return NULL;
+	size = data.len;
+	rolling_lock(self);
+	ret = rolling_write_record(self, &data);
+	pthread_mutex_unlock(&self->lock);
+	PyBuffer_Release(&data);
+
+	if (ret == -1)
+		return NULL;
+	return PyInt_FromSsize_t(size);
+}
+
+
+static PyObject *
+rolling_writelines(RollingFileObject *self, PyObject *args)
+{
+	PyObject *pyrecs;
+	Py_buffer *recs;
+	Py_ssize_t i, nrecs;
+	int ret = 0;
+
+	if (!PyArg_ParseTuple(args, "O:writelines", &pyrecs))
+		return NULL;
+	recs = get_buffers(pyrecs, &nrecs);
+	if (recs == NULL)
+		return NULL;
+	rolling_lock(self);
+	for (i = 0; i < nrecs && ret == 0; i++)
+		ret = rolling_write_record(self, &recs[i]);
+	pthread_mutex_unlock(&self->lock);
+	release_buffers(recs, nrecs);
+
+	if (ret == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+rolling_flush(RollingFileObject *self)
+{
+	int ret = 0;
+
+	rolling_lock(self);
+	if (self->file == NULL) {
+		pthread_mutex_unlock(&self->lock);
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+		return NULL;
+	}
+	if (!self->error) {
+		Py_BEGIN_ALLOW_THREADS
+		ret = rolling_flush_file(self);
+		Py_END_ALLOW_THREADS
+	}
+	if (ret == -1 || self->error) {
+		self->error = 1;
+		pthread_mutex_unlock(&self->lock);
+		PyErr_SetString(PyExc_IOError, "Failed to flush file");
+		return NULL;
+	}
+	pthread_mutex_unlock(&self->lock);
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+rolling_rotate_meth(RollingFileObject *self)
+{
+	int ret = -1;
+
+	rolling_lock(self);
+	if (self->file == NULL)
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+	else
+		ret = rolling_rotate(self);
+	pthread_mutex_unlock(&self->lock);
+
+	if (ret == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+rolling_close(RollingFileObject *self)
+{
+	if (rolling_close_impl(self) == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to close file");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+rolling_enter(RollingFileObject *self)
+{
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+
+static PyObject *
+rolling_exit(RollingFileObject *self, PyObject *args)
+{
+	return rolling_close(self);
+}
+
+
+static PyObject *
+rolling_stats(RollingFileObject *self)
+{
+	PyObject *res;
+	PY_LONG_LONG size = 0;
+	double age = 0;
+
+	rolling_lock(self);
+	if (self->file != NULL) {
+		size = self->file->raw_pos + self->file->len;
+		age = now_seconds() - self->started;
+	}
+	res = Py_BuildValue("{s:L,s:d,s:k,s:k,s:O}",
+			    "size", size, "age", age,
+			    "rotations", self->rotations,
+			    "flushes", self->flushes,
+			    "error", self->error ? Py_True : Py_False);
+	pthread_mutex_unlock(&self->lock);
+	return res;
+}
+
+
+static PyObject *
+rolling_get_closed(RollingFileObject *self, void *closure)
+{
+	return PyBool_FromLong(self->file == NULL);
+}
+
+
+static PyObject *
+rolling_get_name(RollingFileObject *self, void *closure)
+{
+	return PyString_FromString(self->path);
+}
+
+
+static PyMethodDef RollingFileMethods[] =
+{
+	{"write", (PyCFunction)rolling_write, METH_VARARGS, "write(record) -> byteswritten \n\nAppend a string or buffer to the file, rotating it first if it is due"},
+	{"writelines", (PyCFunction)rolling_writelines, METH_VARARGS, "writelines(records) -> None \n\nAppend a sequence of strings or buffers, as write() does for each"},
+	{"flush", (PyCFunction)rolling_flush, METH_NOARGS, "flush() -> None \n\nWrite out batched records and flush the file now, with hflush where libhdfs has it (Hadoop 2), otherwise with the client-side hdfsFlush of libhdfs 0.20"},
+	{"rotate", (PyCFunction)rolling_rotate_meth, METH_NOARGS, "rotate() -> None \n\nClose the file, move it aside and start it again"},
+	{"stats", (PyCFunction)rolling_stats, METH_NOARGS, "stats() -> dict \n\nSize and age of the current file, rotations and flushes so far"},
+	{"close", (PyCFunction)rolling_close, METH_NOARGS, "close() -> None \n\nFlush batched records and close the file"},
+	{"__enter__", (PyCFunction)rolling_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)rolling_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyGetSetDef RollingFileGetSet[] =
+{
+	{"closed", (getter)rolling_get_closed, NULL, "True if the file is closed", NULL},
+	{"name", (getter)rolling_get_name, NULL, "Path of the current file", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+
+static PyTypeObject RollingFileType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.RollingFile",		/* tp_name */
+	sizeof(RollingFileObject),	/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)rolling_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"RollingFile(fs, path[, max_size[, max_age[, flush_interval[, buffering]]]])\n\nAn append-only, rotated hdfs file, see rolling()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	RollingFileMethods,		/* tp_methods */
+	0,				/* tp_members */
+	RollingFileGetSet,		/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	0,				/* tp_init */
+	0,				/* tp_alloc */
+	rolling_new,			/* tp_new */
+};
+
+
+/**
+ * pyhdfs.Pool - a pool of connections to one namenode, as returned by
+ * pool().
+ *
+ * Handles are leased with acquire() and given back with release(); idle
+ * handles are reused most recently used first and disconnected once they
+ * have been idle for longer than idle_timeout. Handles are keyed by user,
+ * when max handles are open the least recently used idle handle of
+ * another user is disconnected to make room. libhdfs hands out handles
+ * of a user to a shared, cached FileSystem, and hdfsDisconnect closes it
+ * for every handle, so the handles of a user are disconnected all at once
+ * and only while none of them is leased. Discarded handles, and the idle
+ * ones of the same user, wait on their own list for that.
+ */
+struct pool_conn {
+	hdfsFS fs;
+	char *user;		/* NULL for the default user */
+	double last_used;
+	struct pool_conn *prev;
+	struct pool_conn *next;
+};
+
+struct conn_list {
+	struct pool_conn *head;		/* most recently used */
+	struct pool_conn *tail;
+	int count;
+};
+
+typedef struct {
+	PyObject_HEAD
+	char *host;
+	tPort port;
+	char *user;			/* default user of acquire() */
+	int max;			/* open handles at most */
+	double idle_timeout;
+	struct conn_list idle;
+	struct conn_list busy;
+	struct conn_list discarded;	/* to disconnect, not to reuse */
+	int connecting;
+	int closed;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long waits;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} PoolObject;
+
+static PyTypeObject PoolType;
+
+
+static void
+conn_push(struct conn_list *list, struct pool_conn *c)
+{
+	c->prev = NULL;
+	c->next = list->head;
+	if (list->head != NULL)
+		list->head->prev = c;
+	else
+		list->tail = c;
+	list->head = c;
+	list->count++;
+}
+
+
+static void
+conn_remove(struct conn_list *list, struct pool_conn *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		list->head = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		list->tail = c->prev;
+	list->count--;
+}
+
+
+static struct pool_conn *
+conn_find(struct conn_list *list, hdfsFS fs)
+{
+	struct pool_conn *c;
+
+	for (c = list->head; c != NULL; c = c->next) {
+		if (c->fs == fs)
+			return c;
+	}
+	return NULL;
+}
+
+
+static int
+same_user(const char *a, const char *b)
+{
+	return a == b || (a != NULL && b != NULL && !strcmp(a, b));
+}
+
+
+/**
+ * Check that no handle of user is leased, its idle handles can then be
+ * disconnected. Called with the pool lock held.
+ */
+static int
+pool_user_idle(PoolObject *self, const char *user)
+{
+	struct pool_conn *c;
+
+	for (c = self->busy.head; c != NULL; c = c->next) {
+		if (same_user(c->user, user))
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Move the handles of user in from to to. Called with the pool lock held.
+ * @return Returns the number of handles moved.
+ */
+static int
+pool_move_user(struct conn_list *from, struct conn_list *to,
+	       const char *user)
+{
+	struct pool_conn *c, *prev;
+	int n = 0;
+
+	for (c = from->tail; c != NULL; c = prev) {
+		prev = c->prev;
+		if (same_user(c->user, user)) {
+			conn_remove(from, c);
+			conn_push(to, c);
+			n++;
+		}
+	}
+	return n;
+}
+
+
+/**
+ * Move every idle and discarded handle of user to dead. The user must
+ * have no leased handle. Called with the pool lock held.
+ * @return Returns the number of idle handles moved.
+ */
+static int
+pool_drop_user(PoolObject *self, struct conn_list *dead, const char *user)
+{
+	/* user points into a handle that is moved too */
+	pool_move_user(&self->discarded, dead, user);
+	return pool_move_user(&self->idle, dead, user);
+}
+
+
+/**
+ * Check that user has no leased handle and that its idle handles have
+ * been idle since limit, or the pool is closed.
+ * Called with the pool lock held.
+ */
+static int
+pool_user_expired(PoolObject *self, const char *user, double limit)
+{
+	struct pool_conn *c;
+
+	if (!pool_user_idle(self, user))
+		return 0;
+	for (c = self->idle.head; c != NULL && !self->closed; c = c->next) {
+		if (same_user(c->user, user) && c->last_used >= limit)
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Move the handles that should be disconnected to dead: the handles of
+ * the users with a discarded handle, those of the users idle for too
+ * long, and all of them if the pool is closed. Users with leased handles
+ * are kept. Called with the pool lock held.
+ */
+static void
+pool_expire(PoolObject *self, struct conn_list *dead)
+{
+	double limit = now_seconds() - self->idle_timeout;
+	struct pool_conn *c, *prev;
+	int n;
+
+	for (c = self->discarded.tail; c != NULL; c = prev) {
+		prev = c->prev;
+		if (pool_user_idle(self, c->user)) {
+			pool_drop_user(self, dead, c->user);
+			prev = self->discarded.tail;
+		}
+	}
+	for (c = self->idle.tail; c != NULL; c = prev) {
+		prev = c->prev;
+		if (!self->closed && c->last_used >= limit)
+			break;
+		if (!pool_user_expired(self, c->user, limit))
+			continue;
+		n = pool_drop_user(self, dead, c->user);
+		if (!self->closed)
+			self->evictions += n;
+		prev = self->idle.tail;
+	}
+}
+
+
+/**
+ * Move the idle handles of the least recently used user that can be
+ * disconnected to dead, to make room for a handle of another user.
+ * Called with the pool lock held.
+ * @return Returns 0 on success, -1 if there is no such user.
+ */
+static int
+pool_evict_lru(PoolObject *self, struct conn_list *dead)
+{
+	struct pool_conn *c;
+
+	for (c = self->idle.tail; c != NULL; c = c->prev) {
+		if (pool_user_idle(self, c->user)) {
+			self->evictions += pool_drop_user(self, dead, c->user);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Disconnect the handles collected by pool_expire, with the pool lock
+ * released.
+ */
+static void
+pool_disconnect(struct conn_list *dead)
+{
+	struct pool_conn *c;
+
+	while ((c = dead->head) != NULL) {
+		conn_remove(dead, c);
+		meta_cache_drop(c->fs);
+		hdfsDisconnect(c->fs);
+		free(c->user);
+		free(c);
+	}
+}
+
+
+static void
+pool_conn_free(struct conn_list *list)
+{
+	struct pool_conn *c;
+
+	while ((c = list->head) != NULL) {
+		conn_remove(list, c);
+		free(c->user);
+		free(c);
+	}
+}
+
+
+static hdfsFS
+pool_connect(PoolObject *self, const char *user)
+{
+	if (user != NULL)
+		return hdfsConnectAsUser(self->host, self->port, user, NULL, 0);
+	return hdfsConnect(self->host, self->port);
+}
+
+
+/**
+ * Lease a handle of user, waiting up to timeout seconds (forever if
+ * negative) for one to be released when max handles are leased already.
+ * Called with the GIL released.
+ * @return Returns the handle, NULL on error with errno set: ETIMEDOUT,
+ * EBADF if the pool is closed, or the error of hdfsConnect.
+ */
+static hdfsFS
+pool_acquire(PoolObject *self, const char *user, double timeout)
+{
+	struct conn_list dead = {NULL, NULL, 0};
+	struct pool_conn *c = NULL;
+	struct timespec ts;
+	double deadline = now_seconds() + timeout;
+	hdfsFS fs = NULL;
+	char *owner;
+	int err = 0;
+
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+
+	pthread_mutex_lock(&self->lock);
+	pool_expire(self, &dead);
+	for (;;) {
+		if (self->closed) {
+			err = EBADF;
+			break;
+		}
+		for (c = self->idle.head; c != NULL; c = c->next) {
+			if (same_user(c->user, user))
+				break;
+		}
+		if (c != NULL) {
+			conn_remove(&self->idle, c);
+			conn_push(&self->busy, c);
+			self->hits++;
+			fs = c->fs;
+			break;
+		}
+		if (self->busy.count + self->idle.count + self->connecting
+		    < self->max || pool_evict_lru(self, &dead) == 0) {
+			self->connecting++;
+			pthread_mutex_unlock(&self->lock);
+			pool_disconnect(&dead);
+			errno = 0;
+			fs = pool_connect(self, user);
+			err = errno ? errno : EIO;
+			c = fs ? malloc(sizeof(*c)) : NULL;
+			owner = user ? strdup(user) : NULL;
+			pthread_mutex_lock(&self->lock);
+			self->connecting--;
+			if (c == NULL || (user && !owner)) {
+				if (fs != NULL) {
+					hdfsDisconnect(fs);
+					fs = NULL;
+					err = ENOMEM;
+				}
+				free(c);
+				free(owner);
+				pthread_cond_signal(&self->cond);
+				break;
+			}
+			c->fs = fs;
+			c->user = owner;
+			conn_push(&self->busy, c);
+			self->misses++;
+			break;
+		}
+		self->waits++;
+		if (timeout < 0) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		} else if (pthread_cond_timedwait(&self->cond, &self->lock,
+						  &ts) == ETIMEDOUT) {
+			err = ETIMEDOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	pool_disconnect(&dead);
+	if (fs == NULL)
+		errno = err;
+	return fs;
+}
+
+
+/**
+ * Give a leased handle back, disconnecting it if discard is set or the
+ * pool is closed, once no other handle of its user is leased. Called
+ * with the GIL released.
+ * @return Returns 0 on success, -1 if fs is not leased from this pool.
+ */
+static int
+pool_release(PoolObject *self, hdfsFS fs, int discard)
+{
+	struct conn_list dead = {NULL, NULL, 0};
+	struct pool_conn *c;
+
+	pthread_mutex_lock(&self->lock);
+	c = conn_find(&self->busy, fs);
+	if (c == NULL) {
+		pthread_mutex_unlock(&self->lock);
+		return -1;
+	}
+	conn_remove(&self->busy, c);
+	if (discard) {
+		/* its idle siblings share the FileSystem being discarded */
+		conn_push(&self->discarded, c);
+		pool_move_user(&self->idle, &self->discarded, c->user);
+	} else {
+		c->last_used = now_seconds();
+		conn_push(&self->idle, c);
+	}
+	pool_expire(self, &dead);
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+
+	pool_disconnect(&dead);
+	return 0;
+}
+
+
+static PyObject *
+pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"host", "port", "user", "max", "idle_timeout",
+				 NULL};
+	PoolObject *self;
+	const char *host;
+	const char *user = NULL;
+	tPort port;
+	int max = DEFAULT_POOL_SIZE;
+	double idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "zH|zid", kwlist, &host,
+					 &port, &user, &max, &idle_timeout))
+		return NULL;
+	if (max < 1) {
+		PyErr_SetString(PyExc_ValueError, "max must be at least 1");
+		return NULL;
+	}
+
+	self = (PoolObject *)type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	self->host = host ? strdup(host) : NULL;
+	self->user = user ? strdup(user) : NULL;
+	self->port = port;
+	self->max = max;
+	self->idle_timeout = idle_timeout;
+	if ((host && !self->host) || (user && !self->user)) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *)self;
+}
+
+
+static void
+pool_dealloc(PoolObject *self)
+{
+	struct conn_list dead = {NULL, NULL, 0};
+
+	/*
+	 * leased handles belong to their users now, the other handles of
+	 * their users share their FileSystem and are left connected
+	 */
+	self->closed = 1;
+	pool_expire(self, &dead);
+	pool_conn_free(&self->busy);
+	pool_conn_free(&self->idle);
+	pool_conn_free(&self->discarded);
+	Py_BEGIN_ALLOW_THREADS
+	pool_disconnect(&dead);
+	Py_END_ALLOW_THREADS
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	free(self->host);
+	free(self->user);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static PyObject *
+pool_acquire_impl(PoolObject *self, const char *user, double timeout)
+{
+	hdfsFS fs;
+
+	if (user == NULL)
+		user = self->user;
+
+	Py_BEGIN_ALLOW_THREADS
+	fs = pool_acquire(self, user, timeout);
+	Py_END_ALLOW_THREADS
+
+	if (fs == NULL) {
+		if (errno == EBADF)
+			PyErr_SetString(PyExc_ValueError, "Pool is closed");
+		else if (errno == ETIMEDOUT)
+			PyErr_SetString(PyExc_IOError, "Timed out waiting for a connection");
+		else
+			PyErr_Format(PyExc_IOError, "Failed to connect to %s:%d as %s",
+				     self->host ? self->host : "localfs", self->port,
+				     user ? user : "default user");
+		return NULL;
+	}
+	return PyLong_FromVoidPtr(fs);
+}
+
+
+static PyObject *
+pool_release_impl(PoolObject *self, PyObject *pyfs, int discard)
+{
+	hdfsFS fs;
+	int ret;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	if (fs == NULL && PyErr_Occurred())
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = pool_release(self, fs, discard);
+	Py_END_ALLOW_THREADS
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_ValueError, "Connection not leased from this pool");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+pool_acquire_meth(PoolObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"timeout", "user", NULL};
+	const char *user = NULL;
+	double timeout = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dz:acquire", kwlist,
+					 &timeout, &user))
+		return NULL;
+	return pool_acquire_impl(self, user, timeout);
+}
+
+
+static PyObject *
+pool_release_meth(PoolObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "discard", NULL};
+	PyObject *pyfs;
+	int discard = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:release", kwlist, &pyfs,
+					 &discard))
+		return NULL;
+	return pool_release_impl(self, pyfs, discard);
+}
+
+
+static PyObject *
+pool_stats(PoolObject *self)
+{
+	PyObject *res;
+
+	pthread_mutex_lock(&self->lock);
+	res = Py_BuildValue("{s:k,s:k,s:k,s:k,s:i,s:i}",
+			    "hits", self->hits,
+			    "misses", self->misses,
+			    "evictions", self->evictions,
+			    "waits", self->waits,
+			    "idle", self->idle.count,
+			    "in_use", self->busy.count);
+	pthread_mutex_unlock(&self->lock);
+	return res;
+}
+
+
+static PyObject *
+pool_close(PoolObject *self)
+{
+	struct conn_list dead = {NULL, NULL, 0};
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	self->closed = 1;
+	pool_expire(self, &dead);
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	pool_disconnect(&dead);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+
+/**
+ * pyhdfs.Lease - context manager returned by Pool.lease(), acquires a
+ * handle on enter and releases it on exit.
+ */
+typedef struct {
+	PyObject_HEAD
+	PoolObject *pool;
+	PyObject *fs;
+	char *user;
+	double timeout;
+} LeaseObject;
+
+
+static void
+lease_dealloc(LeaseObject *self)
+{
+	PyObject *res;
+
+	if (self->fs != NULL) {
+		res = pool_release_impl(self->pool, self->fs, 0);
+		if (res == NULL)
+			PyErr_Clear();
+		Py_XDECREF(res);
+	}
+	Py_XDECREF(self->fs);
+	Py_XDECREF(self->pool);
+	PyMem_Free(self->user);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static PyObject *
+lease_enter(LeaseObject *self)
+{
+	if (self->fs != NULL) {
+		PyErr_SetString(PyExc_ValueError, "Lease already entered");
+		return NULL;
+	}
+	self->fs = pool_acquire_impl(self->pool, self->user, self->timeout);
+	Py_XINCREF(self->fs);
+	return self->fs;
+}
+
+
+static PyObject *
+lease_exit(LeaseObject *self, PyObject *args)
+{
+	PyObject *fs = self->fs;
+	PyObject *res;
+
+	if (fs == NULL)
+		Py_RETURN_NONE;
+	self->fs = NULL;
+	res = pool_release_impl(self->pool, fs, 0);
+	Py_DECREF(fs);
+	if (res == NULL)
+		return NULL;
+	Py_DECREF(res);
+	Py_RETURN_FALSE;
+}
+
+
+static PyMethodDef LeaseMethods[] =
+{
+	{"__enter__", (PyCFunction)lease_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)lease_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject LeaseType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.Lease",			/* tp_name */
+	sizeof(LeaseObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)lease_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"A pooled connection, use as 'with pool.lease() as fs:'",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	LeaseMethods,			/* tp_methods */
+};
+
+
+static PyObject *
+pool_lease(PoolObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"timeout", "user", NULL};
+	LeaseObject *lease;
+	const char *user = NULL;
+	double timeout = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dz:lease", kwlist,
+					 &timeout, &user))
+		return NULL;
+
+	lease = PyObject_New(LeaseObject, &LeaseType);
+	if (lease == NULL)
+		return NULL;
+	Py_INCREF(self);
+	lease->pool = self;
+	lease->fs = NULL;
+	lease->timeout = timeout;
+	lease->user = NULL;
+	if (user != NULL) {
+		lease->user = PyMem_Malloc(strlen(user) + 1);
+		if (lease->user == NULL) {
+			Py_DECREF(lease);
+			return PyErr_NoMemory();
+		}
+		strcpy(lease->user, user);
+	}
+	return (PyObject *)lease;
+}
+
+
+static PyMethodDef PoolMethods[] =
+{
+	{"acquire", (PyCFunction)pool_acquire_meth, METH_VARARGS | METH_KEYWORDS, "acquire([timeout[, user]]) -> fs \n\nLease a connection as user (the user of the pool by default), reusing an idle one of that user if possible. When max connections are open, the least recently used idle connection of another user is disconnected, or acquire waits up to timeout seconds (forever by default) for one to be released"},
+	{"release", (PyCFunction)pool_release_meth, METH_VARARGS | METH_KEYWORDS, "release(fs[, discard]) -> None \n\nGive a leased connection back to the pool, or disconnect it and the idle connections of the same user if discard is true, once no connection of that user is leased (libhdfs shares one FileSystem between them)"},
+	{"lease", (PyCFunction)pool_lease, METH_VARARGS | METH_KEYWORDS, "lease([timeout[, user]]) -> context manager \n\nwith pool.lease() as fs: acquires a connection and releases it at the end of the block"},
+	{"stats", (PyCFunction)pool_stats, METH_NOARGS, "stats() -> dict \n\nCounters of the pool: hits, misses (new connections), evictions, waits, idle and in_use"},
+	{"close", (PyCFunction)pool_close, METH_NOARGS, "close() -> None \n\nDisconnect the idle connections, those of users with leased connections once these are released"},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject PoolType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.Pool",			/* tp_name */
+	sizeof(PoolObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)pool_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"Pool(host, port[, user[, max[, idle_timeout]]])\n\nA pool of connections to a hdfs file system, see pool()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	PoolMethods,			/* tp_methods */
+	0,				/* tp_members */
+	0,				/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	0,				/* tp_init */
+	0,				/* tp_alloc */
+	pool_new,			/* tp_new */
+};
+
+
+/**
+ * Create a pool of connections.
+ * @param host The namenode, None for the local file system.
+ * @param port The port on which the server is listening.
+ * @param user Connect as this user. (optional)
+ * @param max Number of connections open at once at most. (optional)
+ * @param idle_timeout Seconds after which an idle connection is
+ * disconnected. (optional)
+ * @return Returns a Pool object or NULL on error.
+ */
+static PyObject *
+hdfs_pool(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return PyObject_Call((PyObject *)&PoolType, args, kwds);
+}
+
+
+/**
+ * Open a hdfs file in given mode.
+ * @param fs The configured filesystem handle.
+ * @param path The full path to the file.
+ * @param flags - an | of bits/fcntl.h file flags - supported flags are O_RDONLY, O_WRONLY (meaning create or overwrite i.e., implies O_TRUNCAT), 
+ * O_WRONLY|O_APPEND. Other flags are generally ignored other than (O_RDWR || (O_EXCL & O_CREAT)) which return NULL and set errno equal ENOTSUP.
+ * @param bufferSize Size of buffer for read/write - pass 0 if you want
+ * to use the default configured values. (optional)
+ * @param replication Block replication - pass 0 if you want to use
+ * the default configured values. (optional)
+ * @param blocksize Size of block - pass 0 if you want to use the
+ * default configured values. (optional)
+ * @param buffering Size of the client-side buffer, 0 to pass every
+ * call to libhdfs. (optional)
+ * @param readahead Number of 1M chunks a thread reads ahead of the
+ * reader, 0 to read on demand. Read mode only. (optional)
+ * @param async_writes Number of buffers a thread writes behind the
+ * writer, 0 to write in the caller. Buffering is then 64K at least.
+ * Write mode only. (optional)
+ * @param compression "gzip", "zstd" or "lz4" to compress writes and
+ * decompress reads, "auto" to go by the path suffix when writing and by
+ * the magic number when reading. (optional)
+ * @return Returns a File object or NULL on error.
+ */
+static PyObject *
+hdfs_open(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return PyObject_Call((PyObject *)&HdfsFileType, args, kwds);
+}
+
+
+/**
+ * Open a rolling, append-only file.
+ * @param fs The configured filesystem handle.
+ * @param path The full path to the file, appended to if it exists.
+ * @param max_size Rotate the file once it has max_size bytes, 0 for no
+ * limit. (optional)
+ * @param max_age Rotate the file once it is max_age seconds old, 0 for no
+ * limit. (optional)
+ * @param flush_interval Flush written records every flush_interval
+ * seconds, 0 to flush only when asked. (optional)
+ * @param buffering Size of the buffer records are batched in. (optional)
+ * @return Returns a RollingFile object or NULL on error.
+ */
+static PyObject *
+hdfs_rolling(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return PyObject_Call((PyObject *)&RollingFileType, args, kwds);
+}
+
+
+/**
+ * Page cache for positional reads of File objects, enabled for the
+ * process by page_cache(). Pages of page_size bytes are keyed by path,
+ * modification time, size and offset, so a rewritten file gets new keys
+ * and its old pages age out. The cache is split in shards by key hash,
+ * each with its own lock, hash table and LRU list. All pages are slots
+ * of one arena allocated up front, a shard owns its slice of it, so a
+ * miss takes a free or the least recently used slot of its shard and
+ * never calls malloc for the data. The slot is filled with the shard
+ * unlocked; it is only linked in once loaded.
+ */
+struct page {
+	char *path;		/* NULL while free or loading */
+	tTime mtime;
+	tOffset fsize;
+	tOffset offset;
+	unsigned int hash;
+	Py_ssize_t len;		/* less than page_size only at EOF */
+	char *data;		/* slot in the arena */
+	struct page *hnext;	/* hash chain */
+	struct page *prev;	/* LRU list, most recent first */
+	struct page *next;	/* also chains the free slots */
+};
+
+struct page_shard {
+	struct page *pages;
+	struct page **buckets;
+	unsigned int nbuckets;
+	struct page *head;
+	struct page *tail;
+	struct page *free;
+	int count;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	pthread_mutex_t lock;
+};
+
+struct page_cache {
+	char *arena;
+	Py_ssize_t page_size;
+	int npages;		/* per shard */
+	struct page_shard shards[PAGE_SHARDS];
+	int users;		/* changed with page_cache_lock held */
+	int dropped;
+};
+
+static struct page_cache *page_cache = NULL;
+static pthread_mutex_t page_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+page_cache_free(struct page_cache *pc)
+{
+	struct page_shard *s;
+	int i, j;
+
+	for (i = 0; i < PAGE_SHARDS; i++) {
+		s = &pc->shards[i];
+		if (s->pages != NULL) {
+			for (j = 0; j < pc->npages; j++)
+				free(s->pages[j].path);
+		}
+		free(s->pages);
+		free(s->buckets);
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(pc->arena);
+	free(pc);
+}
+
+
+/**
+ * @return Returns a cache of npages pages per shard, NULL if out of
+ * memory.
+ */
+static struct page_cache *
+page_cache_new(Py_ssize_t page_size, int npages)
+{
+	struct page_cache *pc;
+	struct page_shard *s;
+	int i, j;
+
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL)
+		return NULL;
+	pc->page_size = page_size;
+	pc->npages = npages;
+	for (i = 0; i < PAGE_SHARDS; i++)
+		pthread_mutex_init(&pc->shards[i].lock, NULL);
+	pc->arena = malloc((size_t)page_size * npages * PAGE_SHARDS);
+	if (pc->arena == NULL) {
+		page_cache_free(pc);
+		return NULL;
+	}
+	for (i = 0; i < PAGE_SHARDS; i++) {
+		s = &pc->shards[i];
+		for (s->nbuckets = 16; s->nbuckets < (unsigned int)npages; s->nbuckets *= 2)
+			;
+		s->pages = calloc(npages, sizeof(*s->pages));
+		s->buckets = calloc(s->nbuckets, sizeof(*s->buckets));
+		if (s->pages == NULL || s->buckets == NULL) {
+			page_cache_free(pc);
+			return NULL;
+		}
+		for (j = npages - 1; j >= 0; j--) {
+			s->pages[j].data = pc->arena +
+				((size_t)i * npages + j) * page_size;
+			s->pages[j].next = s->free;
+			s->free = &s->pages[j];
+		}
+	}
+	return pc;
+}
+
+
+static struct page_cache *
+page_cache_get(void)
+{
+	struct page_cache *pc;
+
+	pthread_mutex_lock(&page_cache_lock);
+	pc = page_cache;
+	if (pc != NULL)
+		pc->users++;
+	pthread_mutex_unlock(&page_cache_lock);
+	return pc;
+}
+
+
+static void
+page_cache_put(struct page_cache *pc)
+{
+	if (pc == NULL)
+		return;
+	pthread_mutex_lock(&page_cache_lock);
+	if (--pc->users == 0 && pc->dropped)
+		page_cache_free(pc);
+	pthread_mutex_unlock(&page_cache_lock);
+}
+
+
+/**
+ * Replace the cache of the process, pc may be NULL to disable it. The
+ * old one is freed once its last reader is done.
+ */
+static void
+page_cache_set(struct page_cache *pc)
+{
+	struct page_cache *old;
+
+	pthread_mutex_lock(&page_cache_lock);
+	old = page_cache;
+	page_cache = pc;
+	if (old != NULL) {
+		old->dropped = 1;
+		if (old->users == 0)
+			page_cache_free(old);
+	}
+	pthread_mutex_unlock(&page_cache_lock);
+}
+
+
+static unsigned int
+page_hash(const char *path, tTime mtime, tOffset fsize, tOffset offset)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*path != '\0')
+		h = (h ^ (unsigned char)*path++) * 1099511628211ULL;
+	h = (h ^ (uint64_t)mtime) * 1099511628211ULL;
+	h = (h ^ (uint64_t)fsize) * 1099511628211ULL;
+	h = (h ^ (uint64_t)offset) * 1099511628211ULL;
+	/* spread the offsets over the shards */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (unsigned int)h;
+}
+
+
+static struct page **
+page_bucket(struct page_shard *s, unsigned int hash)
+{
+	/* the low bits picked the shard */
+	return &s->buckets[(hash / PAGE_SHARDS) & (s->nbuckets - 1)];
+}
+
+
+static struct page *
+page_find(struct page_shard *s, unsigned int hash, const char *path,
+	  tTime mtime, tOffset fsize, tOffset offset)
+{
+	struct page *p;
+
+	for (p = *page_bucket(s, hash); p != NULL; p = p->hnext) {
+		if (p->hash == hash && p->offset == offset && p->mtime == mtime &&
+		    p->fsize == fsize && !strcmp(p->path, path))
+			return p;
+	}
+	return NULL;
+}
+
+
+static void
+page_lru_remove(struct page_shard *s, struct page *p)
+{
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		s->head = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	else
+		s->tail = p->prev;
+}
+
+
+static void
+page_lru_push(struct page_shard *s, struct page *p)
+{
+	p->prev = NULL;
+	p->next = s->head;
+	if (s->head != NULL)
+		s->head->prev = p;
+	else
+		s->tail = p;
+	s->head = p;
+}
+
+
+/**
+ * Take a slot to load a page into, a free one or the least recently
+ * used page. Called with the shard lock held.
+ * @return Returns the slot, NULL if every slot is being loaded.
+ */
+static struct page *
+page_take(struct page_shard *s)
+{
+	struct page **pp, *p = s->free;
+
+	if (p != NULL) {
+		s->free = p->next;
+		return p;
+	}
+	p = s->tail;
+	if (p == NULL)
+		return NULL;
+	page_lru_remove(s, p);
+	pp = page_bucket(s, p->hash);
+	while (*pp != p)
+		pp = &(*pp)->hnext;
+	*pp = p->hnext;
+	free(p->path);
+	p->path = NULL;
+	s->count--;
+	s->evictions++;
+	return p;
+}
+
+
+static void
+page_give_back(struct page_shard *s, struct page *p)
+{
+	p->next = s->free;
+	s->free = p;
+}
+
+
+/**
+ * pread until size bytes are read or EOF is reached.
+ * @return Returns the number of bytes read, -1 on error.
+ */
+static Py_ssize_t
+pread_full(hdfsFS fs, hdfsFile file, tOffset offset, char *dst,
+	   Py_ssize_t size)
+{
+	Py_ssize_t done = 0;
+	tSize n;
+
+	while (done < size) {
+		n = hdfsPread(fs, file, offset + done, dst + done,
+			      size - done > INT32_MAX ? INT32_MAX : size - done);
+		if (n == -1)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+
+/**
+ * pread_full() from the stream of a File, under the File's lock so that
+ * a close() in another thread cannot free the stream meanwhile. Called
+ * with the GIL released.
+ * @return Returns the number of bytes read, -1 on error or if the File
+ * is closed.
+ */
+static Py_ssize_t
+page_load(HdfsFileObject *self, tOffset offset, char *dst, Py_ssize_t size)
+{
+	Py_ssize_t n = -1;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->file != NULL)
+		n = pread_full(self->fs, self->file, offset, dst, size);
+	pthread_mutex_unlock(&self->lock);
+	return n;
+}
+
+
+/**
+ * Copy up to size bytes at offset of the file of self through the page
+ * cache, loading the missing pages. Called with the GIL released.
+ * @return Returns the number of bytes copied, less than size only at
+ * EOF, -1 on error.
+ */
+static Py_ssize_t
+page_read(struct page_cache *pc, HdfsFileObject *self, tOffset offset,
+	  char *dst, Py_ssize_t size)
+{
+	struct page_shard *s;
+	struct page *p, *found;
+	char *key;
+	tOffset start;
+	Py_ssize_t done = 0, skip, n, len;
+	unsigned int hash;
+
+	while (done < size && offset + done < self->cache_fsize) {
+		skip = (offset + done) % pc->page_size;
+		start = offset + done - skip;
+		n = size - done < pc->page_size - skip ?
+			size - done : pc->page_size - skip;
+		hash = page_hash(self->cache_path, self->cache_mtime,
+				 self->cache_fsize, start);
+		s = &pc->shards[hash % PAGE_SHARDS];
+
+		pthread_mutex_lock(&s->lock);
+		p = page_find(s, hash, self->cache_path, self->cache_mtime,
+			      self->cache_fsize, start);
+		if (p != NULL) {
+			s->hits++;
+			page_lru_remove(s, p);
+			page_lru_push(s, p);
+		} else {
+			s->misses++;
+			p = page_take(s);
+			pthread_mutex_unlock(&s->lock);
+
+			if (p == NULL) {
+				/* every slot is being loaded, go around */
+				len = page_load(self, offset + done, dst + done,
+						n);
+				if (len == -1)
+					return -1;
+				done += len;
+				if (len < n)
+					break;
+				continue;
+			}
+			len = page_load(self, start, p->data, pc->page_size);
+			key = len == -1 ? NULL : strdup(self->cache_path);
+
+			pthread_mutex_lock(&s->lock);
+			found = page_find(s, hash, self->cache_path,
+					  self->cache_mtime, self->cache_fsize,
+					  start);
+			if (key == NULL || found != NULL) {
+				page_give_back(s, p);
+				free(key);
+				if (found == NULL) {
+					pthread_mutex_unlock(&s->lock);
+					return -1;
+				}
+				/* loaded by another reader meanwhile */
+				p = found;
+			} else {
+				p->path = key;
+				p->hash = hash;
+				p->mtime = self->cache_mtime;
+				p->fsize = self->cache_fsize;
+				p->offset = start;
+				p->len = len;
+				p->hnext = *page_bucket(s, hash);
+				*page_bucket(s, hash) = p;
+				page_lru_push(s, p);
+				s->count++;
+			}
+		}
+		if (skip + n > p->len)
+			n = skip < p->len ? p->len - skip : 0;
+		memcpy(dst + done, p->data + skip, n);
+		len = p->len;
+		pthread_mutex_unlock(&s->lock);
+		done += n;
+		if (n == 0 || len < pc->page_size)
+			break;
+	}
+	return done;
+}
+
+
+/**
+ * Find the path, modification time and size that key the pages of a
+ * File, on first use.
+ * @return Returns 0 if the File can go through the page cache, -1 if not.
+ */
+static int
+file_page_setup(HdfsFileObject *self)
+{
+	hdfsFileInfo *info = NULL;
+	char *realpath;
+
+	file_lock(self);
+	if (self->file == NULL || !FILE_READABLE(self)) {
+		file_unlock(self);
+		return -1;
+	}
+	if (self->cache_path == NULL && !self->cache_failed) {
+		Py_BEGIN_ALLOW_THREADS
+		realpath = hdfs_realpath(self->fs, self->path);
+		if (realpath != NULL)
+			info = hdfsGetPathInfo(self->fs, realpath);
+		if (info != NULL) {
+			self->cache_mtime = info->mLastMod;
+			self->cache_fsize = info->mSize;
+			self->cache_path = realpath;
+			hdfsFreeFileInfo(info, 1);
+		} else {
+			self->cache_failed = 1;
+			free(realpath);
+		}
+		Py_END_ALLOW_THREADS
+	}
+	file_unlock(self);
+	return self->cache_path != NULL ? 0 : -1;
+}
+
+
+/**
+ * Positional read of a File through the page cache, if it is enabled
+ * and the read is small enough to be worth caching.
+ * @param dst Buffer to read into, NULL to return a new string.
+ * @return Returns the string, or the number of bytes read as an int,
+ * NULL on error, or Py_NotImplemented (not a new reference) if the
+ * read has to go to hdfsPread.
+ */
+static PyObject *
+page_pread(PyObject *pyfile, tOffset offset, char *dst, Py_ssize_t size)
+{
+	HdfsFileObject *self = (HdfsFileObject *)pyfile;
+	struct page_cache *pc;
+	PyObject *res = NULL;
+	Py_ssize_t n;
+
+	if (!HdfsFile_Check(pyfile) || self->codec != NULL ||
+	    size > DEFAULT_CHUNK_SIZE || offset < 0)
+		return Py_NotImplemented;
+	pc = page_cache_get();
+	if (pc == NULL)
+		return Py_NotImplemented;
+	if (file_page_setup(self) == -1) {
+		page_cache_put(pc);
+		return Py_NotImplemented;
+	}
+
+	if (dst == NULL) {
+		res = PyString_FromStringAndSize(NULL, size);
+		if (res == NULL) {
+			page_cache_put(pc);
+			return NULL;
+		}
+	}
+	Py_BEGIN_ALLOW_THREADS
+	n = page_read(pc, self, offset, dst ? dst : PyString_AS_STRING(res),
+		      size);
+	page_cache_put(pc);
+	Py_END_ALLOW_THREADS
+
+	if (n == -1) {
+		Py_XDECREF(res);
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		return NULL;
+	}
+	if (dst != NULL)
+		return PyInt_FromSsize_t(n);
+	if (n != size)
+		_PyString_Resize(&res, n);
+	return res;
+}
+
+
+/**
+ * Enable, resize or disable the page cache of positional reads.
+ * @param size Memory budget in bytes, 0 disables the cache.
+ * @param page_size Size of the pages, cached and read from hdfs at
+ * once. (optional)
+ * @return Returns None, NULL on error.
+ */
+static PyObject *
+hdfs_page_cache(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"size", "page_size", NULL};
+	struct page_cache *pc = NULL;
+	Py_ssize_t size, page_size = DEFAULT_BUFFER_SIZE;
+	Py_ssize_t npages;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|n", kwlist, &size,
+					 &page_size))
+		return NULL;
+	if (page_size < 512 || page_size > INT32_MAX) {
+		PyErr_SetString(PyExc_ValueError, "Bad page size");
+		return NULL;
+	}
+
+	if (size > 0) {
+		npages = size / page_size / PAGE_SHARDS;
+		if (npages < 1)
+			npages = 1;
+		if (npages > INT32_MAX)
+			npages = INT32_MAX;
+		Py_BEGIN_ALLOW_THREADS
+		pc = page_cache_new(page_size, (int)npages);
+		Py_END_ALLOW_THREADS
+		if (pc == NULL)
+			return PyErr_NoMemory();
+	}
+	Py_BEGIN_ALLOW_THREADS
+	page_cache_set(pc);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+
+/**
+ * Get the counters of the page cache.
+ * @return Returns a dict, None if the cache is disabled.
+ */
+static PyObject *
+hdfs_page_cache_stats(PyObject *self, PyObject *args)
+{
+	struct page_cache *pc;
+	struct page_shard *s;
+	PyObject *res;
+	unsigned long hits = 0, misses = 0, evictions = 0;
+	long pages = 0;
+	int i;
+
+	pc = page_cache_get();
+	if (pc == NULL)
+		Py_RETURN_NONE;
+	for (i = 0; i < PAGE_SHARDS; i++) {
+		s = &pc->shards[i];
+		pthread_mutex_lock(&s->lock);
+		pages += s->count;
+		hits += s->hits;
+		misses += s->misses;
+		evictions += s->evictions;
+		pthread_mutex_unlock(&s->lock);
+	}
+	res = Py_BuildValue("{s:n,s:n,s:l,s:k,s:k,s:k,s:d}",
+			    "size", pc->page_size * pc->npages * PAGE_SHARDS,
+			    "page_size", pc->page_size,
+			    "pages", pages,
+			    "hits", hits,
+			    "misses", misses,
+			    "evictions", evictions,
+			    "hit_rate", hits + misses ?
+			    (double)hits / (hits + misses) : 0.0);
+	page_cache_put(pc);
+	return res;
+}
+
+
+/**
+ * Read data into a new string, filled in place by libhdfs so that no
+ * intermediate buffer is needed. The string starts at 2M at most and
+ * grows as data comes in, a large size on a small file costs nothing.
+ * @param offset Position to read from, or -1 to read from the current
+ * position of the stream.
+ * @param size Read at most size bytes. If full is set and size <= 0, read
+ * until EOF.
+ * @param full Keep calling libhdfs until size bytes (or EOF) are read,
+ * otherwise return after the first short read.
+ * @return Returns the string, NULL on error.
+ */
+static PyObject *
+read_string(hdfsFS fs, hdfsFile file, tOffset offset, Py_ssize_t size, int full)
+{
+	PyObject *res;
+	Py_ssize_t alloc, done = 0, want;
+	int until_eof = size <= 0;
+	tSize bytesread;
+	char *buf;
+
+	alloc = until_eof || size > DEFAULT_READ_SIZE ? DEFAULT_READ_SIZE : size;
+	res = PyString_FromStringAndSize(NULL, alloc);
+	if (res == NULL)
+		return NULL;
+
+	for (;;) {
+		buf = PyString_AS_STRING(res) + done;
+		want = alloc - done;
+		if (want > INT32_MAX)
+			want = INT32_MAX;
+
+		Py_BEGIN_ALLOW_THREADS
+		if (offset < 0)
+			bytesread = hdfsRead(fs, file, buf, want);
+		else
+			bytesread = hdfsPread(fs, file, offset + done, buf, want);
+		Py_END_ALLOW_THREADS
+
+		if (bytesread == -1) {
+			Py_DECREF(res);
+			PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+			return NULL;
+		}
+		done += bytesread;
+		if (bytesread == 0 || (!full && bytesread < want))
+			break;
+		if (done == alloc) {
+			if (!until_eof && done == size)
+				break;
+			alloc *= 2;
+			if (!until_eof && alloc > size)
+				alloc = size;
+			if (_PyString_Resize(&res, alloc) < 0)
+				return NULL;
+		}
+	}
+
+	if (done != alloc)
+		_PyString_Resize(&res, done);
+	return res;
+}
+
+
+/**
+ * Read data from an open file
+ * @param fs The configured filesystem handle.
+ * @param file The file handle.
+ * @param size read at most size bytes, 2M if omitted or <= 0.
+ * @return Returns the data read, NULL on error.
+ */
+static PyObject *
+hdfs_read(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	hdfsFS fs;
+	hdfsFile file;
+	int size = 0;
+
+	
+	if (!PyArg_ParseTuple(args, "OO|i", &pyfs, &pyfile, &size))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	if (size <= 0)
+		size = DEFAULT_READ_SIZE;
+	/* syncing would stop the read-ahead, read through the File instead */
+	if (FILE_OWNS_STREAM(pyfile))
+		return PyObject_CallMethod(pyfile, "read", "i", size);
+	if (!convert_file(pyfile, &file))
+		return NULL;
+	return read_string(fs, file, -1, size, 0);
+}
+
+
+static PyObject *
+hdfs_pread(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	PyObject *res;
+	hdfsFS fs;
+	hdfsFile file;
+	tOffset offset;
+	int size = 0;
+
+	
+	if (!PyArg_ParseTuple(args, "OOL|i", &pyfs, &pyfile, &offset, &size))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	if (size <= 0)
+		size = DEFAULT_READ_SIZE;
+	res = page_pread(pyfile, offset, NULL, size);
+	if (res != Py_NotImplemented)
+		return res;
+	if (!convert_file(pyfile, &file))
+		return NULL;
+	return read_string(fs, file, offset, size, 0);
+}
+
+
+/**
+ * Read exactly size bytes from an open file, or up to EOF.
+ * @param fs The configured filesystem handle.
+ * @param file The file handle.
+ * @param size The number of bytes wanted, read until EOF if omitted or <= 0.
+ * @return Returns the data read, NULL on error.
+ */
+static PyObject *
+hdfs_readall(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	hdfsFile file;
+	Py_ssize_t size = 0;
+
+	if (!PyArg_ParseTuple(args, "OO&|n", &pyfs, convert_file, &file, &size))
+		return NULL;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	return read_string(fs, file, -1, size, 1);
+}
+
+
+static PyObject *
+hdfs_preadall(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	PyObject *res;
+	hdfsFS fs;
+	hdfsFile file;
+	tOffset offset;
+	Py_ssize_t size = 0;
+
+	if (!PyArg_ParseTuple(args, "OOL|n", &pyfs, &pyfile, &offset, &size))
+		return NULL;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	if (size > 0) {
+		res = page_pread(pyfile, offset, NULL, size);
+		if (res != Py_NotImplemented)
+			return res;
+	}
+	if (!convert_file(pyfile, &file))
+		return NULL;
+	return read_string(fs, file, offset, size, 1);
+}
+
+
+/**
+ * Read data from an open file straight into a caller-provided buffer.
+ * @param fs The configured filesystem handle.
+ * @param file The file handle.
+ * @param buffer A writable buffer (bytearray, memoryview, mmap, array...),
+ * at most len(buffer) bytes are read into it.
+ * @return Returns the number of bytes read, NULL on error.
+ */
+static PyObject *
+hdfs_readinto(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	hdfsFS fs;
+	hdfsFile file;
+	Py_buffer buf;
+	tSize size;
+	tSize bytesread;
+
+	if (!PyArg_ParseTuple(args, "OOO&", &pyfs, &pyfile, convert_writable,
+			      &buf))
+		return NULL;
+	if (FILE_OWNS_STREAM(pyfile)) {
+		PyBuffer_Release(&buf);
+		return PyObject_CallMethod(pyfile, "readinto", "O",
+					   PyTuple_GET_ITEM(args, 2));
+	}
+	if (!convert_file(pyfile, &file)) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	size = buf.len > INT32_MAX ? INT32_MAX : (tSize)buf.len;
+
+	Py_BEGIN_ALLOW_THREADS
+	bytesread = hdfsRead(fs, file, buf.buf, size);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+
+	if (bytesread == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		return NULL;
+	}
+	return Py_BuildValue("i", bytesread);
+}
+
+
+static PyObject *
+hdfs_preadinto(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	PyObject *res;
+	hdfsFS fs;
+	hdfsFile file;
+	tOffset offset;
+	Py_buffer buf;
+	tSize size;
+	tSize bytesread;
+
+	if (!PyArg_ParseTuple(args, "OOLO&", &pyfs, &pyfile, &offset,
+			      convert_writable, &buf))
+		return NULL;
+
+	res = page_pread(pyfile, offset, buf.buf, buf.len);
+	if (res != Py_NotImplemented) {
+		PyBuffer_Release(&buf);
+		return res;
+	}
+	if (!convert_file(pyfile, &file)) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	size = buf.len > INT32_MAX ? INT32_MAX : (tSize)buf.len;
+
+	Py_BEGIN_ALLOW_THREADS
+	bytesread = hdfsPread(fs, file, offset, buf.buf, size);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+
+	if (bytesread == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		return NULL;
+	}
+	return Py_BuildValue("i", bytesread);
+}
+
+
+/**
+ * Vectored positional reads: the ranges are sorted and those less than
+ * gap bytes apart are merged in units, read in one go. Units are laid
+ * out back to back in one buffer and cut in pieces of at most
+ * PREADV_PIECE bytes, which a pool of workers reads with hdfsPread.
+ */
+struct preadv_range {
+	tOffset offset;
+	Py_ssize_t len;
+	Py_ssize_t index;	/* in the caller's list */
+	Py_ssize_t unit;
+};
+
+struct preadv_unit {
+	tOffset start;
+	tOffset end;
+	Py_ssize_t pos;		/* in the buffer */
+	Py_ssize_t valid;	/* bytes read before EOF */
+};
+
+struct preadv_piece {
+	tOffset offset;
+	char *dst;
+	Py_ssize_t len;
+	Py_ssize_t got;
+	Py_ssize_t unit;
+};
+
+struct preadv_job {
+	hdfsFS fs;
+	hdfsFile file;
+	struct preadv_piece *pieces;
+	Py_ssize_t npieces;
+	Py_ssize_t next;
+	int error;
+	pthread_mutex_t lock;
+};
+
+
+static void *
+preadv_worker(void *arg)
+{
+	struct preadv_job *job = arg;
+	struct preadv_piece *piece;
+	Py_ssize_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->error ? job->npieces : job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->npieces)
+			break;
+
+		piece = &job->pieces[i];
+		piece->got = pread_full(job->fs, job->file, piece->offset,
+					piece->dst, piece->len);
+		if (piece->got == -1) {
+			pthread_mutex_lock(&job->lock);
+			job->error = 1;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+	return NULL;
+}
+
+
+static int
+preadv_compare(const void *a, const void *b)
+{
+	const struct preadv_range *ra = a, *rb = b;
+
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+	return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+
+/**
+ * Parse the (offset, length) tuples of a sequence.
+ * @return Returns the ranges, NULL on error.
+ */
+static struct preadv_range *
+preadv_parse(PyObject *pyranges, Py_ssize_t *nranges)
+{
+	struct preadv_range *ranges;
+	PyObject *seq;
+	Py_ssize_t i;
+	PY_LONG_LONG offset;
+
+	seq = PySequence_Fast(pyranges, "ranges must be a sequence");
+	if (seq == NULL)
+		return NULL;
+	*nranges = PySequence_Fast_GET_SIZE(seq);
+	ranges = PyMem_Malloc((*nranges + 1) * sizeof(*ranges));
+	if (ranges == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for (i = 0; i < *nranges; i++) {
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i),
+				      "Ln;ranges must be (offset, length) tuples",
+				      &offset, &ranges[i].len))
+			break;
+		if (offset < 0 || ranges[i].len < 0) {
+			PyErr_SetString(PyExc_ValueError,
+					"Negative offset or length");
+			break;
+		}
+		ranges[i].offset = offset;
+		ranges[i].index = i;
+	}
+	Py_DECREF(seq);
+	if (i < *nranges) {
+		PyMem_Free(ranges);
+		return NULL;
+	}
+	return ranges;
+}
+
+
+/**
+ * Read many ranges of an open file at once.
+ * @param fs The configured filesystem handle.
+ * @param file The file handle.
+ * @param ranges A sequence of (offset, length) tuples.
+ * @param threads Number of reads done at once. (optional)
+ * @param gap Ranges less than gap bytes apart are read together.
+ * (optional)
+ * @return Returns a list of memoryviews of one buffer, holding the data
+ * of each range in order, shorter than asked at EOF. NULL on error.
+ */
+static PyObject *
+hdfs_preadv(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "file", "ranges", "threads", "gap", NULL};
+	struct preadv_job job;
+	struct preadv_range *ranges = NULL, *sorted = NULL, *r;
+	struct preadv_unit *units = NULL, *u;
+	PyObject *pyfs, *pyranges;
+	PyObject *buf = NULL, *view = NULL, *res = NULL, *item;
+	Py_ssize_t i, nranges, nunits = 0, total = 0, start, len;
+	Py_ssize_t gap = DEFAULT_PREADV_GAP;
+	tOffset off;
+	pthread_t *tids = NULL;
+	int nthreads = DEFAULT_THREADS;
+	int started;
+
+	memset(&job, 0, sizeof(job));
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO&O|in", kwlist, &pyfs,
+					 convert_file, &job.file, &pyranges,
+					 &nthreads, &gap))
+		return NULL;
+	job.fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	ranges = preadv_parse(pyranges, &nranges);
+	if (ranges == NULL)
+		return NULL;
+	sorted = PyMem_Malloc((nranges + 1) * sizeof(*sorted));
+	units = PyMem_Malloc((nranges + 1) * sizeof(*units));
+	if (sorted == NULL || units == NULL) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	memcpy(sorted, ranges, nranges * sizeof(*sorted));
+	qsort(sorted, nranges, sizeof(*sorted), preadv_compare);
+
+	for (i = 0; i < nranges; i++) {
+		r = &sorted[i];
+		u = &units[nunits - 1];
+		if (nunits == 0 || r->offset > u->end + gap) {
+			u = &units[nunits++];
+			u->start = r->offset;
+			u->end = r->offset;
+		}
+		if (r->offset + r->len > u->end)
+			u->end = r->offset + r->len;
+		ranges[r->index].unit = nunits - 1;
+	}
+	for (i = 0; i < nunits; i++) {
+		units[i].pos = total;
+		units[i].valid = 0;
+		total += units[i].end - units[i].start;
+		job.npieces += (units[i].end - units[i].start +
+				PREADV_PIECE - 1) / PREADV_PIECE;
+	}
+
+	buf = PyByteArray_FromStringAndSize(NULL, total);
+	job.pieces = PyMem_Malloc((job.npieces + 1) * sizeof(*job.pieces));
+	if (buf == NULL || job.pieces == NULL) {
+		if (buf != NULL)
+			PyErr_NoMemory();
+		goto done;
+	}
+	job.npieces = 0;
+	for (i = 0; i < nunits; i++) {
+		for (off = units[i].start; off < units[i].end; off += len) {
+			len = units[i].end - off < PREADV_PIECE ?
+				units[i].end - off : PREADV_PIECE;
+			job.pieces[job.npieces].offset = off;
+			job.pieces[job.npieces].dst = PyByteArray_AS_STRING(buf) +
+				units[i].pos + (off - units[i].start);
+			job.pieces[job.npieces].len = len;
+			job.pieces[job.npieces].unit = i;
+			job.npieces++;
+		}
+	}
+
+	if (nthreads > job.npieces)
+		nthreads = job.npieces;
+	if (nthreads < 1)
+		nthreads = 1;
+	tids = PyMem_Malloc(nthreads * sizeof(pthread_t));
+	if (tids == NULL) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_init(&job.lock, NULL);
+	started = nthreads > 1 ? start_threads(tids, nthreads, preadv_worker, &job) : 0;
+	if (started == 0)
+		preadv_worker(&job);
+	join_threads(tids, started);
+	pthread_mutex_destroy(&job.lock);
+	Py_END_ALLOW_THREADS
+	if (job.error) {
+		PyErr_SetString(PyExc_IOError, "Failed to read data from file");
+		goto done;
+	}
+
+	/* the data of a unit stops at its first short piece */
+	for (i = 0; i < job.npieces; i++) {
+		u = &units[job.pieces[i].unit];
+		if (u->valid == job.pieces[i].offset - u->start)
+			u->valid += job.pieces[i].got;
+	}
+
+	view = PyMemoryView_FromObject(buf);
+	res = view ? PyList_New(nranges) : NULL;
+	for (i = 0; res != NULL && i < nranges; i++) {
+		u = &units[ranges[i].unit];
+		start = ranges[i].offset - u->start;
+		len = u->valid - start;
+		if (len > ranges[i].len)
+			len = ranges[i].len;
+		if (len < 0)
+			len = 0;
+		item = PySequence_GetSlice(view, u->pos + start,
+					   u->pos + start + len);
+		if (item == NULL)
+			Py_CLEAR(res);
+		else
+			PyList_SET_ITEM(res, i, item);
+	}
+
+done:
+	Py_XDECREF(view);
+	Py_XDECREF(buf);
+	PyMem_Free(tids);
+	PyMem_Free(job.pieces);
+	PyMem_Free(units);
+	PyMem_Free(sorted);
+	PyMem_Free(ranges);
+	return res;
+}
+
+
+/**
+ * Write data into an open file.
+ * @param fs The configured filesystem handle.
+ * @param file The file handle.
+ * @param buffer The data, a string or any contiguous buffer object. It
+ * is handed to libhdfs as is, without a copy.
+ * @return Returns the number of bytes written, NULL on error.
+ */
+static PyObject *
+hdfs_write(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	hdfsFS fs;
+	hdfsFile file;
+	Py_buffer buf;
+	tSize written;
+	
+	if (!PyArg_ParseTuple(args, "OOs*", &pyfs, &pyfile, &buf))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	/* queue it behind the File's earlier writes */
+	if (FILE_OWNS_STREAM(pyfile)) {
+		PyBuffer_Release(&buf);
+		return PyObject_CallMethod(pyfile, "write", "O",
+					   PyTuple_GET_ITEM(args, 2));
+	}
+	if (!convert_file(pyfile, &file)) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+	
+	Py_BEGIN_ALLOW_THREADS
+	written = hdfsWrite(fs, file, buf.buf,
+			    buf.len > INT32_MAX ? INT32_MAX : buf.len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	
+	if (written == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to write data to file");
+		return NULL;
+	} else {
+		return Py_BuildValue("i", written);
+	}
+}
+
+
+/**
+ * Write a sequence of buffers to a raw handle. Runs of buffers smaller
+ * than DEFAULT_BUFFER_SIZE are gathered in one hdfsWrite, the others
+ * are written from where they are.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int
+writev_raw(hdfsFS fs, hdfsFile file, Py_buffer *bufs, Py_ssize_t nbufs)
+{
+	char *gather = NULL;
+	Py_ssize_t i, len = 0;
+	int ret = 0;
+
+	for (i = 0; i < nbufs && ret == 0; i++) {
+		if (bufs[i].len >= DEFAULT_BUFFER_SIZE) {
+			if (len > 0)
+				ret = write_full(fs, file, gather, len);
+			len = 0;
+			if (ret == 0)
+				ret = write_full(fs, file, bufs[i].buf, bufs[i].len);
+			continue;
+		}
+		if (len + bufs[i].len > DEFAULT_BUFFER_SIZE) {
+			ret = write_full(fs, file, gather, len);
+			len = 0;
+		}
+		if (gather == NULL)
+			gather = malloc(DEFAULT_BUFFER_SIZE);
+		if (gather == NULL) {
+			ret = -1;
+			break;
+		}
+		memcpy(gather + len, bufs[i].buf, bufs[i].len);
+		len += bufs[i].len;
+	}
+	if (ret == 0 && len > 0)
+		ret = write_full(fs, file, gather, len);
+	free(gather);
+	return ret;
+}
+
+
+/**
+ * Write a sequence of buffers into an open file, in one call.
+ * @param fs The configured filesystem handle.
+ * @param file The file handle.
+ * @param buffers A sequence of strings or contiguous buffer objects,
+ * e.g. a header, a body and a trailer.
+ * @return Returns the number of bytes written, NULL on error.
+ */
+static PyObject *
+hdfs_writev(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	PyObject *pybufs;
+	hdfsFS fs;
+	hdfsFile file;
+	Py_buffer *bufs;
+	Py_ssize_t i, nbufs, size = 0;
+	int ret;
+
+	if (!PyArg_ParseTuple(args, "OOO", &pyfs, &pyfile, &pybufs))
+		return NULL;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	/* coalesced in the File buffer, not written out around it */
+	if (HdfsFile_Check(pyfile))
+		return file_writev_impl((HdfsFileObject *)pyfile, pybufs);
+	if (!convert_file(pyfile, &file))
+		return NULL;
+
+	bufs = get_buffers(pybufs, &nbufs);
+	if (bufs == NULL)
+		return NULL;
+	for (i = 0; i < nbufs; i++)
+		size += bufs[i].len;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = writev_raw(fs, file, bufs, nbufs);
+	Py_END_ALLOW_THREADS
+	release_buffers(bufs, nbufs);
+
+	if (ret == -1) {
+		PyErr_SetString(PyExc_IOError, "Failed to write data to file");
+		return NULL;
+	}
+	return PyInt_FromSsize_t(size);
+}
+
+
+static PyObject *
+hdfs_flush(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	hdfsFS fs;
+	hdfsFile file;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pyfile))
+		return NULL;
+	if (FILE_OWNS_STREAM(pyfile))
+		return PyObject_CallMethod(pyfile, "flush", NULL);
+	if (!convert_file(pyfile, &file))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	Py_BEGIN_ALLOW_THREADS
+	ret = hdfsFlush(fs, file);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
+		Py_RETURN_NONE;
+	} else {
+		PyErr_SetString(PyExc_IOError, "Failed to close file");
+		return NULL;
+	}
+}
+
+
+static PyObject *
+hdfs_seek(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	hdfsFile file;
+	tOffset offset;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "OO&L", &pyfs, convert_file, &file, &offset))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	Py_BEGIN_ALLOW_THREADS
+	ret = hdfsSeek(fs, file, offset);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+
+static PyObject *
+hdfs_tell(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	hdfsFS fs;
+	hdfsFile file;
+	tOffset offset;
+	
+	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pyfile))
+		return NULL;
+	if (FILE_OWNS_STREAM(pyfile))
+		return PyObject_CallMethod(pyfile, "tell", NULL);
+	if (!convert_file(pyfile, &file))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	Py_BEGIN_ALLOW_THREADS
+	offset = hdfsTell(fs, file);
+	Py_END_ALLOW_THREADS
+	
+	if (offset != -1) {
+		return Py_BuildValue("L", offset);
+	} else {
+		return Py_BuildValue("L", -1);
+	}
+}
+
+
+static PyObject *
+hdfs_close(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *pyfile;
+	PyObject *res;
+	hdfsFS fs;
+	hdfsFile file;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pyfile))
+		return NULL;
+	
+	if (HdfsFile_Check(pyfile)) {
+		/* the File owns the handle, let it flush and forget it */
+		res = file_close((HdfsFileObject *)pyfile);
+		if (res == NULL) {
+			PyErr_Clear();
+			Py_RETURN_FALSE;
+		}
+		Py_DECREF(res);
+		Py_RETURN_TRUE;
+	}
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	file = (hdfsFile)PyLong_AsVoidPtr(pyfile);
+	
+	Py_BEGIN_ALLOW_THREADS
+	ret = hdfsCloseFile(fs, file);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+
+/**
+ * Disconnect from hdfs file system.
+ * @param fs The configured filesystem handle.
+ * @return Returns 0 on success, -1 on error.  
+ */
+static PyObject *
+hdfs_disconnect(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "O", &pyfs))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	meta_cache_drop(fs);
+	ret = hdfsDisconnect(fs);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+
+/**
+ * A parallel download: the file is cut into units (blocks, or smaller
+ * pieces when there are fewer blocks than threads) that the workers take
+ * in turn and copy with hdfsPread/pwrite through their own read handle.
+ */
+struct get_job {
+	hdfsFS fs;
+	const char *rpath;
+	int fd;
+	tOffset size;
+	tOffset unit;
+	tOffset next;		/* start of the next unit to hand out */
+	tOffset done;		/* bytes copied so far */
+	int running;		/* workers still running */
+	int error;		/* errno of the first failure */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+static void *
+get_worker(void *arg)
+{
+	struct get_job *job = arg;
+	hdfsFile file;
+	char *buf;
+	tOffset off, end;
+	tSize n;
+	int err = 0;
+
+	buf = malloc(DEFAULT_CHUNK_SIZE);
+	file = hdfsOpenFile(job->fs, job->rpath, O_RDONLY, 0, 0, 0);
+	if (buf == NULL || file == NULL)
+		err = errno ? errno : EIO;
+
+	while (!err) {
+		pthread_mutex_lock(&job->lock);
+		if (job->stop || job->next >= job->size) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		off = job->next;
+		job->next += job->unit;
+		pthread_mutex_unlock(&job->lock);
+
+		end = off + job->unit < job->size ? off + job->unit : job->size;
+		while (off < end && !err) {
+			n = hdfsPread(job->fs, file, off, buf,
+				      end - off < DEFAULT_CHUNK_SIZE ?
+				      end - off : DEFAULT_CHUNK_SIZE);
+			if (n <= 0)
+				err = n == 0 || !errno ? EIO : errno;
+			else if (pwrite_all(job->fd, buf, n, off) < 0)
+				err = errno;
+			else
+				off += n;
+
+			pthread_mutex_lock(&job->lock);
+			if (!err)
+				job->done += n;
+			if (job->stop)
+				err = -1;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	if (file != NULL)
+		hdfsCloseFile(job->fs, file);
+	free(buf);
+
+	pthread_mutex_lock(&job->lock);
+	if (err > 0 && !job->error)
+		job->error = err;
+	if (err)
+		job->stop = 1;
+	job->running--;
+	pthread_cond_signal(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+
+/**
+ * Wait for the workers of a get job, calling callback(done, total) every
+ * PROGRESS_INTERVAL_MS meanwhile. Called with the GIL released, which is
+ * taken back around the callback.
+ * @return Returns 0 on success, -1 if the callback raised.
+ */
+static int
+get_wait(struct get_job *job, PyObject *callback)
+{
+	struct timeval now;
+	struct timespec ts;
+	PyGILState_STATE gstate;
+	PyObject *res;
+	tOffset done;
+	int running, ret = 0;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		gettimeofday(&now, NULL);
+		ts.tv_sec = now.tv_sec;
+		ts.tv_nsec = now.tv_usec * 1000 + PROGRESS_INTERVAL_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		if (job->running > 0)
+			pthread_cond_timedwait(&job->cond, &job->lock, &ts);
+		done = job->done;
+		running = job->running;
+		pthread_mutex_unlock(&job->lock);
+
+		if (callback != NULL && ret == 0) {
+			gstate = PyGILState_Ensure();
+			res = PyObject_CallFunction(callback, "LL", done, job->size);
+			if (res == NULL)
+				ret = -1;
+			Py_XDECREF(res);
+			PyGILState_Release(gstate);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		if (ret == -1)
+			job->stop = 1;
+		if (running == 0)
+			break;
+	}
+	pthread_mutex_unlock(&job->lock);
+	return ret;
+}
+
+
+/**
+ * Copy a file from hdfs to local with several threads.
+ * @return Returns 0 on success, -1 on error, with errno set or a Python
+ * exception raised by the callback.
+ */
+static int
+get_parallel(hdfsFS fs, const char *rpath, const char *lpath, int nthreads,
+	     PyObject *callback)
+{
+	struct get_job job;
+	hdfsFileInfo *info;
+	pthread_t *tids;
+	struct stat st;
+	char *dst = NULL, *tmp;
+	tOffset nunits;
+	int ret = 0;
+
+	info = hdfsGetPathInfo(fs, rpath);
+	if (info == NULL)
+		return -1;
+	if (info->mKind == kObjectKindDirectory) {
+		hdfsFreeFileInfo(info, 1);
+		errno = EISDIR;
+		return -1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.fs = fs;
+	job.rpath = rpath;
+	job.size = info->mSize;
+	job.unit = info->mBlockSize > 0 ? info->mBlockSize : hdfsGetDefaultBlockSize(fs);
+	hdfsFreeFileInfo(info, 1);
+	if (job.unit <= 0)
+		job.unit = 64 * 1024 * 1024;
+
+	/* fewer blocks than threads, cut smaller pieces */
+	nunits = (job.size + job.unit - 1) / job.unit;
+	if (nunits < nthreads && job.size > 0) {
+		job.unit = (job.size + nthreads - 1) / nthreads;
+		job.unit = (job.unit + DEFAULT_CHUNK_SIZE - 1) / DEFAULT_CHUNK_SIZE * DEFAULT_CHUNK_SIZE;
+		nunits = (job.size + job.unit - 1) / job.unit;
+	}
+	if (nthreads > nunits)
+		nthreads = nunits > 0 ? nunits : 1;
+
+	/* like hdfsCopy, copy into a local directory under the same name */
+	if (stat(lpath, &st) == 0 && S_ISDIR(st.st_mode)) {
+		tmp = strdup(rpath);
+		dst = malloc(strlen(lpath) + strlen(rpath) + 2);
+		if (tmp == NULL || dst == NULL) {
+			free(tmp);
+			free(dst);
+			errno = ENOMEM;
+			return -1;
+		}
+		sprintf(dst, "%s/%s", lpath, basename(tmp));
+		free(tmp);
+		lpath = dst;
+	}
+
+	job.fd = open(lpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	tids = malloc(nthreads * sizeof(pthread_t));
+	if (job.fd < 0 || tids == NULL || ftruncate(job.fd, job.size) < 0) {
+		job.error = errno ? errno : ENOMEM;
+		goto out;
+	}
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	job.running = nthreads;
+	ret = start_threads(tids, nthreads, get_worker, &job);
+	pthread_mutex_lock(&job.lock);
+	job.running -= nthreads - ret;
+	if (ret == 0)
+		job.error = EAGAIN;
+	pthread_mutex_unlock(&job.lock);
+	nthreads = ret;
+	ret = 0;
+	if (get_wait(&job, callback) < 0)
+		ret = -1;
+	join_threads(tids, nthreads);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+
+out:
+	free(tids);
+	if (job.fd >= 0 && close(job.fd) < 0 && !job.error)
+		job.error = errno;
+	if (ret == -1 || job.error) {
+		if (job.fd >= 0)
+			unlink(lpath);
+		ret = -1;
+	}
+	free(dst);
+	errno = job.error;
+	return ret;
+}
+
+
+/**
+ * Copy file from hdfs to local.
+ * @param fs The handle to hdfs.
+ * @param rpath The path of hdfs file. 
+ * @param lpath The path of local file. 
+ * @param threads Number of parallel streams, each reading its own set of
+ * blocks with hdfsPread. (optional)
+ * @param callback Called as callback(bytes_done, bytes_total) while the
+ * file is copied, implies the parallel download. (optional)
+ * @return Returns None on success, NULL on error. 
+ */
+static PyObject *
+hdfs_get(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "rpath", "lpath", "threads", "callback", NULL};
+	PyObject *pyfs;
+	PyObject *callback = NULL;
+	hdfsFS fs, lfs = NULL;
+	const char *rpath, *lpath;
+	int nthreads = 1;
+	int ret = -1;
+	
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oss|iO", kwlist, &pyfs,
+					 &rpath, &lpath, &nthreads, &callback))
+		return NULL;
+	if (callback == Py_None)
+		callback = NULL;
+	if (nthreads < 1)
+		nthreads = 1;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	if (nthreads > 1 || callback != NULL) {
+		ret = get_parallel(fs, rpath, lpath, nthreads, callback);
+	} else {
+		lfs = local_fs_acquire();
+		if (lfs)
+			ret = hdfsCopy(fs, rpath, lfs, lpath);
+		local_fs_release(lfs);
+	}
+	Py_END_ALLOW_THREADS
+	
+	if (ret == -1 && PyErr_Occurred())
+		return NULL;
+
+	if (nthreads <= 1 && callback == NULL && !lfs) {
+		PyErr_SetString(PyExc_IOError, "Failed to connect to local fs");
+		return NULL;
+	}
+	
+	if (ret != -1) {
+		Py_RETURN_NONE;
+	} else {
+		PyErr_SetString(PyExc_IOError, "Failed to get file");
+		return NULL;
+	}
+}
+
+
+/**
+ * Copy file from local to hdfs.
+ * @param fs The handle to hdfs.
+ * @param lpath The path of local file. 
+ * @param rpath The path of hdfs file. 
+ * @return Returns None on success, NULL on error. 
+ */
+static PyObject *
+hdfs_put(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs, lfs;
+	const char *lpath, *rpath;
+	int ret = -1;
+	
+	if (!PyArg_ParseTuple(args, "Oss", &pyfs, &lpath, &rpath))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	lfs = local_fs_acquire();
+	if (lfs)
+		ret = hdfsCopy(lfs, lpath, fs, rpath);
+	local_fs_release(lfs);
+	meta_invalidate(fs, rpath);
+	Py_END_ALLOW_THREADS
+	
+	if (!lfs) {
+		PyErr_SetString(PyExc_IOError, "Failed to connect to local fs");
+		return NULL;
+	}
+	
+	if (ret != -1) {
+		Py_RETURN_NONE;
+	} else {
+		PyErr_SetString(PyExc_IOError, "Failed to put file");
+		return NULL;
+	}
+}
+
+
+/**
+ * Directory tree copies: the tree is walked once (creating the target
+ * directories on the way), the files found are then copied by a pool of
+ * workers with hdfsCopy. Failures are recorded per item, not raised.
+ */
+struct tree_item {
+	char *src;
+	char *dst;
+	int is_dir;
+	int error;		/* errno, 0 on success */
+};
+
+struct tree_job {
+	hdfsFS src_fs;
+	hdfsFS dst_fs;
+	struct tree_item *items;
+	size_t nitems;
+	size_t cap;
+	size_t next;		/* next item for the workers */
+	int error;		/* fatal error of the walk itself */
+	pthread_mutex_t lock;
+};
+
+
+static char *
+join_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir);
+	char *path = malloc(len + strlen(name) + 2);
+
+	if (path != NULL)
+		sprintf(path, "%s%s%s", dir,
+			len > 0 && dir[len - 1] == '/' ? "" : "/", name);
+	return path;
+}
+
+
+static struct tree_item *
+tree_add(struct tree_job *job, const char *src, const char *dst, int is_dir)
+{
+	struct tree_item *items, *item;
+
+	if (job->nitems == job->cap) {
+		job->cap = job->cap ? job->cap * 2 : 64;
+		items = realloc(job->items, job->cap * sizeof(*items));
+		if (items == NULL) {
+			job->error = ENOMEM;
+			return NULL;
+		}
+		job->items = items;
+	}
+	item = &job->items[job->nitems];
+	item->src = strdup(src);
+	item->dst = strdup(dst);
+	item->is_dir = is_dir;
+	item->error = 0;
+	if (item->src == NULL || item->dst == NULL) {
+		free(item->src);
+		free(item->dst);
+		job->error = ENOMEM;
+		return NULL;
+	}
+	job->nitems++;
+	return item;
+}
+
+
+static void
+tree_free(struct tree_job *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->nitems; i++) {
+		free(job->items[i].src);
+		free(job->items[i].dst);
+	}
+	free(job->items);
+}
+
+
+/**
+ * Walk a local directory, creating its directories on hdfs. Links to
+ * files are copied as files, links to directories are skipped.
+ */
+static void
+tree_walk_local(struct tree_job *job, const char *src, const char *dst)
+{
+	struct tree_item *item;
+	struct dirent *de;
+	struct stat st;
+	char *s, *d;
+	DIR *dir;
+
+	item = tree_add(job, src, dst, 1);
+	if (item == NULL)
+		return;
+	if (hdfsCreateDirectory(job->dst_fs, dst) == -1) {
+		item->error = errno ? errno : EIO;
+		return;
+	}
+	dir = opendir(src);
+	if (dir == NULL) {
+		item->error = errno;
+		return;
+	}
+	while (!job->error && (de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		s = join_path(src, de->d_name);
+		d = join_path(dst, de->d_name);
+		if (s == NULL || d == NULL)
+			job->error = ENOMEM;
+		else if (lstat(s, &st) == -1)
+			tree_add(job, s, d, 0);	/* the copy reports the error */
+		else if (S_ISDIR(st.st_mode))
+			tree_walk_local(job, s, d);
+		/* links to directories may loop back up the tree */
+		else if (!S_ISLNK(st.st_mode) || stat(s, &st) == -1 ||
+			 !S_ISDIR(st.st_mode))
+			tree_add(job, s, d, 0);
+		free(s);
+		free(d);
+	}
+	closedir(dir);
+}
+
+
+/**
+ * Walk a hdfs directory, creating its directories locally.
+ */
+static void
+tree_walk_remote(struct tree_job *job, const char *src, const char *dst)
+{
+	struct tree_item *item;
+	hdfsFileInfo *entries;
+	int i, num_entries = 0;
+	const char *name;
+	char *s, *d;
+
+	item = tree_add(job, src, dst, 1);
+	if (item == NULL)
+		return;
+	if (mkdir(dst, 0777) == -1 && errno != EEXIST) {
+		item->error = errno;
+		return;
+	}
+	errno = 0;
+	entries = hdfsListDirectory(job->src_fs, src, &num_entries);
+	if (entries == NULL) {
+		item->error = errno;
+		return;
+	}
+	for (i = 0; i < num_entries && !job->error; i++) {
+		name = strrchr(entries[i].mName, '/');
+		name = name ? name + 1 : entries[i].mName;
+		s = join_path(src, name);
+		d = join_path(dst, name);
+		if (s == NULL || d == NULL)
+			job->error = ENOMEM;
+		else if (entries[i].mKind == kObjectKindDirectory)
+			tree_walk_remote(job, s, d);
+		else
+			tree_add(job, s, d, 0);
+		free(s);
+		free(d);
+	}
+	hdfsFreeFileInfo(entries, num_entries);
+}
+
+
+static void *
+tree_worker(void *arg)
+{
+	struct tree_job *job = arg;
+	struct tree_item *item;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		while (job->next < job->nitems && job->items[job->next].is_dir)
+			job->next++;
+		item = job->next < job->nitems ? &job->items[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+		if (item == NULL)
+			break;
+
+		errno = 0;
+		if (hdfsCopy(job->src_fs, item->src, job->dst_fs, item->dst) == -1)
+			item->error = errno ? errno : EIO;
+	}
+	return NULL;
+}
+
+
+/**
+ * Copy the files of a walked tree with nthreads workers, and report
+ * [(src, dst, error or None), ...] for every file plus the directories
+ * that could not be created or listed.
+ */
+static PyObject *
+tree_copy(struct tree_job *job, int nthreads)
+{
+	PyObject *report, *entry;
+	struct tree_item *item;
+	pthread_t *tids;
+	size_t i;
+	int started = 0;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	tids = PyMem_Malloc(nthreads * sizeof(pthread_t));
+	if (tids == NULL)
+		return PyErr_NoMemory();
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_init(&job->lock, NULL);
+	job->next = 0;
+	started = start_threads(tids, nthreads, tree_worker, job);
+	if (started == 0)
+		tree_worker(job);
+	join_threads(tids, started);
+	pthread_mutex_destroy(&job->lock);
+	Py_END_ALLOW_THREADS
+	PyMem_Free(tids);
+
+	report = PyList_New(0);
+	for (i = 0; report != NULL && i < job->nitems; i++) {
+		item = &job->items[i];
+		if (item->is_dir && !item->error)
+			continue;
+		if (item->error)
+			entry = Py_BuildValue("(sss)", item->src, item->dst,
+					      strerror(item->error));
+		else
+			entry = Py_BuildValue("(ssO)", item->src, item->dst, Py_None);
+		if (entry == NULL || PyList_Append(report, entry) < 0)
+			Py_CLEAR(report);
+		Py_XDECREF(entry);
+	}
+	return report;
+}
+
+
+/**
+ * Copy a local directory tree to hdfs.
+ * @param fs The handle to hdfs.
+ * @param lpath The local directory, its content is copied.
+ * @param rpath The hdfs directory, created if needed.
+ * @param threads Number of files copied at once.
+ * @return Returns a list of (lpath, rpath, error) tuples, error is None
+ * for the files copied, NULL on error.
+ */
+static PyObject *
+hdfs_put_tree(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "lpath", "rpath", "threads", NULL};
+	struct tree_job job;
+	PyObject *pyfs;
+	PyObject *report;
+	const char *lpath, *rpath;
+	int nthreads = DEFAULT_THREADS;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oss|i", kwlist, &pyfs,
+					 &lpath, &rpath, &nthreads))
+		return NULL;
+
+	memset(&job, 0, sizeof(job));
+	job.dst_fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	Py_BEGIN_ALLOW_THREADS
+	job.src_fs = local_fs_acquire();
+	if (job.src_fs)
+		tree_walk_local(&job, lpath, rpath);
+	Py_END_ALLOW_THREADS
+
+	if (!job.src_fs) {
+		PyErr_SetString(PyExc_IOError, "Failed to connect to local fs");
+		return NULL;
+	}
+	if (job.error) {
+		errno = job.error;
+		report = PyErr_SetFromErrno(PyExc_IOError);
+	} else {
+		report = tree_copy(&job, nthreads);
+	}
+	tree_free(&job);
+	Py_BEGIN_ALLOW_THREADS
+	local_fs_release(job.src_fs);
+	meta_invalidate(job.dst_fs, rpath);
+	Py_END_ALLOW_THREADS
+	return report;
+}
+
+
+/**
+ * Copy a hdfs directory tree to local.
+ * @param fs The handle to hdfs.
+ * @param rpath The hdfs directory, its content is copied.
+ * @param lpath The local directory, created if needed.
+ * @param threads Number of files copied at once.
+ * @return Returns a list of (rpath, lpath, error) tuples, error is None
+ * for the files copied, NULL on error.
+ */
+static PyObject *
+hdfs_get_tree(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "rpath", "lpath", "threads", NULL};
+	struct tree_job job;
+	PyObject *pyfs;
+	PyObject *report;
+	const char *lpath, *rpath;
+	int nthreads = DEFAULT_THREADS;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oss|i", kwlist, &pyfs,
+					 &rpath, &lpath, &nthreads))
+		return NULL;
+
+	memset(&job, 0, sizeof(job));
+	job.src_fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	Py_BEGIN_ALLOW_THREADS
+	job.dst_fs = local_fs_acquire();
+	if (job.dst_fs)
+		tree_walk_remote(&job, rpath, lpath);
+	Py_END_ALLOW_THREADS
+
+	if (!job.dst_fs) {
+		PyErr_SetString(PyExc_IOError, "Failed to connect to local fs");
+		return NULL;
+	}
+	if (job.error) {
+		errno = job.error;
+		report = PyErr_SetFromErrno(PyExc_IOError);
+	} else {
+		report = tree_copy(&job, nthreads);
+	}
+	tree_free(&job);
+	Py_BEGIN_ALLOW_THREADS
+	local_fs_release(job.dst_fs);
+	Py_END_ALLOW_THREADS
+	return report;
+}
+
+
+/**
+ * Disconnect the local file system handle shared by get/put, it is
+ * connected again on next use.
+ */
+static PyObject *
+hdfs_disconnect_local(PyObject *self, PyObject *args)
+{
+	Py_BEGIN_ALLOW_THREADS
+	local_fs_teardown();
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+
+/**
+ * Checks if a given path exsits on the hdfs.
+ * @param fs The configured filesystem handle.
+ * @param path The path to look for
+ * @return Returns True on success, False else.
+ * int hdfsExists(hdfsFS fs, const char *path);
+ */
+static PyObject *
+hdfs_exists(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	const char *path;
+	struct meta_cache *cache;
+	struct meta_entry *cached;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	cache = meta_cache_get(fs);
+	if (cache != NULL) {
+		/* a stat entry answers both stat() and exists() */
+		cached = meta_fetch(cache, path, META_STAT);
+		ret = cached != NULL && cached->infos != NULL ? 0 : -1;
+		if (cached != NULL)
+			meta_release(cache, cached);
+		meta_cache_put(cache);
+	} else {
+		ret = hdfsExists(fs, path);
+	}
+	Py_END_ALLOW_THREADS
+	if (ret != -1) 
+		Py_RETURN_TRUE;
+	else
+		Py_RETURN_FALSE;
+}
+
+
+/**
+ * Rename a file (directory)
+ * @param fs The configured filesystem handle.
+ * @param oldPath The path of the source file. 
+ * @param newPath The path of the destination file. 
+ * @return Returns 0 on success, -1 on error. 
+ * int hdfsRename(hdfsFS fs, const char* oldPath, const char* newPath);
+ */
+static PyObject *
+hdfs_rename(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	const char *oldpath, *newpath;
+	int ret;
+	
+	
+	if (!PyArg_ParseTuple(args, "Oss", &pyfs, &oldpath, &newpath))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	ret = hdfsRename(fs, oldpath, newpath);
+	meta_invalidate(fs, oldpath);
+	meta_invalidate(fs, newpath);
+	Py_END_ALLOW_THREADS
+	if (ret != -1)
+		Py_RETURN_TRUE;
+	else
+		Py_RETURN_FALSE;
+}
+
+
+/**
+ * Delete a file (directory)
+ * @param fs The configured filesystem handle.
+ * @param path The path of the file.
+ * @return Returns True on success, False else.
+ */
+static PyObject *
+hdfs_delete(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	const char *path;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	ret = hdfsDelete(fs, path);
+	meta_invalidate(fs, path);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) 
+		Py_RETURN_TRUE;
+	else
+		Py_RETURN_FALSE;
+}
+
+
+static PyObject *
+stat_tuple(hdfsFileInfo *fileinfo)
+{
+	return Py_BuildValue("cLLL", fileinfo->mKind, fileinfo->mSize,
+			     (int64_t)fileinfo->mLastMod,
+			     (int64_t)fileinfo->mLastAccess);
+}
+
+
+static PyObject *
+hdfs_stat(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	PyObject *res;
+	hdfsFS fs;
+	const char *path;
+	hdfsFileInfo *fileinfo;
+	struct meta_cache *cache;
+	struct meta_entry *cached = NULL;
+	
+	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	cache = meta_cache_get(fs);
+	if (cache != NULL) {
+		cached = meta_fetch(cache, path, META_STAT);
+		fileinfo = cached ? cached->infos : NULL;
+	} else {
+		fileinfo = hdfsGetPathInfo(fs, path);
+	}
+	Py_END_ALLOW_THREADS
+	
+	if (fileinfo != NULL) {
+		res = stat_tuple(fileinfo);
+	} else {
+		res = Py_None;
+		Py_INCREF(res);
+	}
+	if (cached != NULL)
+		meta_release(cache, cached);
+	else if (fileinfo != NULL)
+		hdfsFreeFileInfo(fileinfo, 1);
+	meta_cache_put(cache);
+	return res;
+}
+
+
+/**
+ * Batched metadata lookups: the paths are split in batches claimed by a
+ * pool of workers, each result is stored at the index of its path.
+ */
+struct stat_job {
+	hdfsFS fs;
+	const char **paths;
+	Py_ssize_t npaths;
+	Py_ssize_t next;	/* first path of the next batch */
+	hdfsFileInfo **infos;	/* results of stat_many */
+	char *found;		/* results of exists_many */
+	pthread_mutex_t lock;
+};
+
+
+static void *
+stat_worker(void *arg)
+{
+	struct stat_job *job = arg;
+	Py_ssize_t i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next;
+		job->next += STAT_BATCH;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->npaths)
+			break;
+
+		end = i + STAT_BATCH < job->npaths ? i + STAT_BATCH : job->npaths;
+		for (; i < end; i++) {
+			if (job->infos != NULL)
+				job->infos[i] = hdfsGetPathInfo(job->fs, job->paths[i]);
+			else
+				job->found[i] = hdfsExists(job->fs, job->paths[i]) != -1;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Look up the paths of a sequence with nthreads workers, filling
+ * job->infos, or job->found if exists is set. Both are sized here, once
+ * the sequence is turned into a tuple, and freed by the caller.
+ * @return Returns a tuple holding the paths, which must be kept until the
+ * results are used, NULL on error.
+ */
+static PyObject *
+stat_run(struct stat_job *job, PyObject *pypaths, int nthreads, int exists)
+{
+	PyObject *paths;
+	pthread_t *tids;
+	Py_ssize_t i;
+	int started;
+
+	paths = PySequence_Tuple(pypaths);
+	if (paths == NULL)
+		return NULL;
+	job->npaths = PyTuple_GET_SIZE(paths);
+	job->paths = PyMem_Malloc((job->npaths + 1) * sizeof(char *));
+	if (exists)
+		job->found = PyMem_Malloc(job->npaths + 1);
+	else
+		job->infos = PyMem_Malloc((job->npaths + 1) *
+					  sizeof(hdfsFileInfo *));
+	if (job->paths == NULL || (job->found == NULL && job->infos == NULL)) {
+		PyMem_Free(job->paths);
+		Py_DECREF(paths);
+		return PyErr_NoMemory();
+	}
+	for (i = 0; i < job->npaths; i++) {
+		job->paths[i] = PyString_AsString(PyTuple_GET_ITEM(paths, i));
+		if (job->paths[i] == NULL) {
+			PyMem_Free(job->paths);
+			Py_DECREF(paths);
+			return NULL;
+		}
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > (job->npaths + STAT_BATCH - 1) / STAT_BATCH)
+		nthreads = (job->npaths + STAT_BATCH - 1) / STAT_BATCH;
+	tids = PyMem_Malloc((nthreads + 1) * sizeof(pthread_t));
+	if (tids == NULL) {
+		PyMem_Free(job->paths);
+		Py_DECREF(paths);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_init(&job->lock, NULL);
+	job->next = 0;
+	started = nthreads > 1 ? start_threads(tids, nthreads, stat_worker, job) : 0;
+	if (started == 0)
+		stat_worker(job);
+	join_threads(tids, started);
+	pthread_mutex_destroy(&job->lock);
+	Py_END_ALLOW_THREADS
+
+	PyMem_Free(tids);
+	PyMem_Free(job->paths);
+	return paths;
+}
+
+
+/**
+ * Get information about many paths at once.
+ * @param fs The configured filesystem handle.
+ * @param paths A sequence of paths.
+ * @param threads Number of lookups done at once. (optional)
+ * @return Returns a list with, for each path in order, the tuple returned
+ * by stat() or None if the path does not exist, NULL on error.
+ */
+static PyObject *
+hdfs_stat_many(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "paths", "threads", NULL};
+	struct stat_job job;
+	PyObject *pyfs, *pypaths;
+	PyObject *paths, *res, *item;
+	Py_ssize_t i;
+	int nthreads = DEFAULT_META_THREADS;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", kwlist, &pyfs,
+					 &pypaths, &nthreads))
+		return NULL;
+
+	memset(&job, 0, sizeof(job));
+	job.fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	paths = stat_run(&job, pypaths, nthreads, 0);
+	if (paths == NULL) {
+		PyMem_Free(job.infos);
+		return NULL;
+	}
+
+	res = PyList_New(job.npaths);
+	for (i = 0; i < job.npaths; i++) {
+		if (res != NULL) {
+			if (job.infos[i] != NULL) {
+				item = stat_tuple(job.infos[i]);
+			} else {
+				item = Py_None;
+				Py_INCREF(item);
+			}
+			if (item == NULL)
+				Py_CLEAR(res);
+			else
+				PyList_SET_ITEM(res, i, item);
+		}
+		if (job.infos[i] != NULL)
+			hdfsFreeFileInfo(job.infos[i], 1);
+	}
+	PyMem_Free(job.infos);
+	Py_DECREF(paths);
+	return res;
+}
+
+
+/**
+ * Check if many paths exist at once.
+ * @param fs The configured filesystem handle.
+ * @param paths A sequence of paths.
+ * @param threads Number of checks done at once. (optional)
+ * @return Returns a list of True or False, for each path in order, NULL
+ * on error.
+ */
+static PyObject *
+hdfs_exists_many(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "paths", "threads", NULL};
+	struct stat_job job;
+	PyObject *pyfs, *pypaths;
+	PyObject *paths, *res;
+	Py_ssize_t i;
+	int nthreads = DEFAULT_META_THREADS;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", kwlist, &pyfs,
+					 &pypaths, &nthreads))
+		return NULL;
+
+	memset(&job, 0, sizeof(job));
+	job.fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	paths = stat_run(&job, pypaths, nthreads, 1);
+	if (paths == NULL) {
+		PyMem_Free(job.found);
+		return NULL;
+	}
+
+	res = PyList_New(job.npaths);
+	for (i = 0; res != NULL && i < job.npaths; i++)
+		PyList_SET_ITEM(res, i, PyBool_FromLong(job.found[i]));
+	PyMem_Free(job.found);
+	Py_DECREF(paths);
+	return res;
+}
+
+
+static PyObject *
+hdfs_mkdir(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	const char *path;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+
+	Py_BEGIN_ALLOW_THREADS
+	disable_stderr();
+	ret = hdfsCreateDirectory(fs, path);
+	renable_stderr();
+	meta_invalidate(fs, path);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+
+static PyObject *
+hdfs_utime(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	hdfsFS fs;
+	const char *path;
+	int64_t mtime, atime;
+	int ret;
+	
+	if (!PyArg_ParseTuple(args, "OsLL", &pyfs, &path, &mtime, &atime))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	Py_BEGIN_ALLOW_THREADS
+	ret = hdfsUtime(fs, path, mtime, atime);
+	meta_invalidate(fs, path);
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
+		Py_RETURN_TRUE;
+	} else {
+		Py_RETURN_FALSE;
+	}
+}
+
+
+/**
+ * Get list of files/directories for a given path.
+ * hdfsFreeFileInfo should be called to deallocate memory.
+ * @param fs The configured filesystem handle.
+ * @param path The path of the directory.
+ * @return Returns a dynamically-allocated list of hdfsFileInfo
+ * objects; NULL on error.
+ */
+static PyObject *
+hdfs_listdir(PyObject *self, PyObject *args)
+{
+  	PyObject *pyfs;
+	hdfsFS fs;
+	const char *path;
+	char *realpath;
+	hdfsFileInfo *entries;
+	struct meta_cache *cache;
+	struct meta_entry *cached = NULL;
+	int i;
+	int num_entries;
+	int saved_errno = 0;
+
+	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+		return NULL;
+	
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	
+	Py_BEGIN_ALLOW_THREADS
+	realpath = hdfs_realpath(fs, path);
+	cache = meta_cache_get(fs);
+	if (realpath && cache) {
+		cached = meta_fetch(cache, realpath, META_LIST);
+		entries = cached ? cached->infos : NULL;
+		num_entries = cached ? cached->ninfos : 0;
+		saved_errno = cached ? cached->error : errno;
+	} else if (realpath) {
+		errno = 0;
+		entries = hdfsListDirectory(fs, realpath, &num_entries);
+		saved_errno = errno;
+	}
+	Py_END_ALLOW_THREADS
+	if (!realpath) {
+		meta_cache_put(cache);
+		Py_RETURN_NONE;
+	}
+	
+	errno = saved_errno;
+	if (!entries && errno) {
+		if (cached)
+			meta_release(cache, cached);
+		meta_cache_put(cache);
+		free(realpath);
+		return PyErr_SetFromErrno(PyExc_IOError);
+	} else {
+		PyObject *py_entries = PyList_New(num_entries);
+		for (i = 0; i < num_entries; i++) {
+			/* hdfs://host:port/path/name 
+			   we just keep this     ~~~~~ */
+			const char *name = remove_host_prefix(entries[i].mName) + strlen(realpath);
+			if (strcmp(realpath, "/"))
+				name++;			
+			
+			PyObject *fields = Py_BuildValue(
+				"{s:c,s:s,s:L,s:L,s:h,s:L,s:s,s:s,s:h,s:L}",
+				"kind", entries[i].mKind,
+				"name", name,
+				"last_mod", (int64_t)entries[i].mLastMod,
+				"size", entries[i].mSize,
+				"replication", entries[i].mReplication,
+				"block_size", entries[i].mBlockSize,
+				"owner", entries[i].mOwner,
+				"group", entries[i].mGroup,
+				"permissions", entries[i].mPermissions,
+				"last_access", (int64_t)entries[i].mLastAccess);
+			PyList_SetItem(py_entries, i, fields);
+		}
+		if (cached)
+			meta_release(cache, cached);
+		else
+			hdfsFreeFileInfo(entries, num_entries);
+		meta_cache_put(cache);
+		free(realpath);
+		return py_entries;
+	}
+}
+
+
+/**
+ * Enable, reconfigure or disable the metadata cache of a connection.
+ * @param fs The configured filesystem handle.
+ * @param ttl Seconds an entry is used for, <= 0 disables the cache.
+ * @param max_entries Number of entries kept at most. (optional)
+ * @return Returns None, NULL on error.
+ */
+static PyObject *
+hdfs_cache(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "ttl", "max_entries", NULL};
+	struct meta_cache *c;
+	PyObject *pyfs;
+	double ttl;
+	int max = DEFAULT_CACHE_ENTRIES;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Od|i", kwlist, &pyfs,
+					 &ttl, &max))
+		return NULL;
+	if (max < 1)
+		max = 1;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	if (ttl <= 0) {
+		Py_BEGIN_ALLOW_THREADS
+		meta_cache_drop(fs);
+		Py_END_ALLOW_THREADS
+		Py_RETURN_NONE;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return PyErr_NoMemory();
+	for (c->nbuckets = 16; c->nbuckets < (unsigned int)max; c->nbuckets *= 2)
+		;
+	c->buckets = calloc(c->nbuckets, sizeof(*c->buckets));
+	if (c->buckets == NULL) {
+		free(c);
+		return PyErr_NoMemory();
+	}
+	c->fs = fs;
+	c->ttl = ttl;
+	c->max = max;
+	pthread_mutex_init(&c->lock, NULL);
+
+	Py_BEGIN_ALLOW_THREADS
+	meta_cache_replace(fs, c);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+
+/**
+ * Get the counters of the metadata cache of a connection.
+ * @param fs The configured filesystem handle.
+ * @return Returns a dict, None if the connection has no cache.
+ */
+static PyObject *
+hdfs_cache_stats(PyObject *self, PyObject *args)
+{
+	struct meta_cache *c;
+	PyObject *pyfs, *res;
+
+	if (!PyArg_ParseTuple(args, "O", &pyfs))
+		return NULL;
+
+	c = meta_cache_get((hdfsFS)PyLong_AsVoidPtr(pyfs));
+	if (c == NULL)
+		Py_RETURN_NONE;
+	pthread_mutex_lock(&c->lock);
+	res = Py_BuildValue("{s:i,s:k,s:k,s:k,s:k}",
+			    "entries", c->count,
+			    "hits", c->hits,
+			    "misses", c->misses,
+			    "evictions", c->evictions,
+			    "invalidations", c->invalidations);
+	pthread_mutex_unlock(&c->lock);
+	meta_cache_put(c);
+	return res;
+}
+
+
+/**
+ * Drop cached metadata, after changes made by other clients.
+ * @param fs The configured filesystem handle.
+ * @param path Drop the entries of path, of the paths below it and of its
+ * parent directories, all entries if omitted. (optional)
+ * @return Returns None.
+ */
+static PyObject *
+hdfs_cache_invalidate(PyObject *self, PyObject *args)
+{
+	PyObject *pyfs;
+	const char *path = NULL;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTuple(args, "O|z", &pyfs, &path))
+		return NULL;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	meta_invalidate(fs, path);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+
+/**
+ * pyhdfs.DirEntry and pyhdfs.ScandirIterator - lazy directory listings,
+ * as returned by scandir().
+ *
+ * The hdfsFileInfo array of a listing is shared by the iterator and the
+ * entries it yields, the fields of an entry are only converted to Python
+ * objects when accessed. The array is freed once the iteration is over
+ * and no entry refers to it anymore.
+ */
+struct dir_listing {
+	hdfsFileInfo *entries;
+	int nentries;
+	size_t skip;		/* length of the directory part of the names */
+	int refs;		/* changed with the GIL held */
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct dir_listing *listing;
+	hdfsFileInfo *info;
+} DirEntryObject;
+
+typedef struct {
+	PyObject_HEAD
+	struct dir_listing *listing;	/* NULL once exhausted or closed */
+	int next;
+} ScandirIterObject;
+
+enum entry_field {
+	FIELD_KIND,
+	FIELD_NAME,
+	FIELD_PATH,
+	FIELD_LAST_MOD,
+	FIELD_SIZE,
+	FIELD_REPLICATION,
+	FIELD_BLOCK_SIZE,
+	FIELD_OWNER,
+	FIELD_GROUP,
+	FIELD_PERMISSIONS,
+	FIELD_LAST_ACCESS
+};
+
+
+static void
+listing_release(struct dir_listing *listing)
+{
+	if (--listing->refs == 0) {
+		hdfsFreeFileInfo(listing->entries, listing->nentries);
+		free(listing);
+	}
+}
+
+
+/**
+ * hdfs://host:port/path/name, the host part is dropped in place on
+ * first use.
+ */
+static const char *
+entry_path(hdfsFileInfo *info)
+{
+	return remove_host_prefix(info->mName);
+}
+
+
+static const char *
+entry_name(struct dir_listing *listing, hdfsFileInfo *info)
+{
+	const char *path = entry_path(info);
+
+	return strlen(path) >= listing->skip ? path + listing->skip : path;
+}
+
+
+static void
+entry_dealloc(DirEntryObject *self)
+{
+	listing_release(self->listing);
+	PyObject_Del(self);
+}
+
+
+static const char *entry_field_names[] = {
+	"kind", "name", "path", "last_mod", "size", "replication",
+	"block_size", "owner", "group", "permissions", "last_access", NULL
+};
+
+
+/**
+ * @return Returns the value of a string field, NULL for the other
+ * fields.
+ */
+static const char *
+entry_str(struct dir_listing *listing, hdfsFileInfo *info,
+	  enum entry_field field)
+{
+	switch (field) {
+	case FIELD_NAME:
+		return entry_name(listing, info);
+	case FIELD_PATH:
+		return entry_path(info);
+	case FIELD_OWNER:
+		return info->mOwner ? info->mOwner : "";
+	case FIELD_GROUP:
+		return info->mGroup ? info->mGroup : "";
+	default:
+		return NULL;
+	}
+}
+
+
+/**
+ * @return Returns the value of a numeric field, the character code for
+ * kind.
+ */
+static int64_t
+entry_int(hdfsFileInfo *info, enum entry_field field)
+{
+	switch (field) {
+	case FIELD_KIND:
+		return info->mKind;
+	case FIELD_LAST_MOD:
+		return (int64_t)info->mLastMod;
+	case FIELD_SIZE:
+		return info->mSize;
+	case FIELD_REPLICATION:
+		return info->mReplication;
+	case FIELD_BLOCK_SIZE:
+		return info->mBlockSize;
+	case FIELD_PERMISSIONS:
+		return info->mPermissions;
+	case FIELD_LAST_ACCESS:
+		return (int64_t)info->mLastAccess;
+	default:
+		return 0;
+	}
+}
+
+
+static PyObject *
+entry_get_field(DirEntryObject *self, void *closure)
+{
+	enum entry_field field = (enum entry_field)(intptr_t)closure;
+	const char *str;
+
+	str = entry_str(self->listing, self->info, field);
+	if (str != NULL)
+		return PyString_FromString(str);
+
+	switch (field) {
+	case FIELD_KIND:
+		return Py_BuildValue("c", self->info->mKind);
+	case FIELD_REPLICATION:
+	case FIELD_PERMISSIONS:
+		return PyInt_FromLong((long)entry_int(self->info, field));
+	default:
+		return PyLong_FromLongLong(entry_int(self->info, field));
+	}
+}
+
+
+static PyObject *
+entry_is_dir(DirEntryObject *self)
+{
+	return PyBool_FromLong(self->info->mKind == kObjectKindDirectory);
+}
+
+
+static PyObject *
+entry_is_file(DirEntryObject *self)
+{
+	return PyBool_FromLong(self->info->mKind == kObjectKindFile);
+}
+
+
+static PyObject *
+entry_repr(DirEntryObject *self)
+{
+	return PyString_FromFormat("<DirEntry '%s'>",
+				   entry_name(self->listing, self->info));
+}
+
+
+#define ENTRY_FIELD(name, field, doc) \
+	{name, (getter)entry_get_field, NULL, doc, (void *)(intptr_t)field}
+
+static PyGetSetDef DirEntryGetSet[] =
+{
+	ENTRY_FIELD("kind", FIELD_KIND, "'F' for a file, 'D' for a directory"),
+	ENTRY_FIELD("name", FIELD_NAME, "Name of the entry in its directory"),
+	ENTRY_FIELD("path", FIELD_PATH, "Absolute path of the entry"),
+	ENTRY_FIELD("last_mod", FIELD_LAST_MOD, "Last modification time"),
+	ENTRY_FIELD("size", FIELD_SIZE, "Size in bytes"),
+	ENTRY_FIELD("replication", FIELD_REPLICATION, "Replication factor"),
+	ENTRY_FIELD("block_size", FIELD_BLOCK_SIZE, "Block size in bytes"),
+	ENTRY_FIELD("owner", FIELD_OWNER, "Owner"),
+	ENTRY_FIELD("group", FIELD_GROUP, "Group"),
+	ENTRY_FIELD("permissions", FIELD_PERMISSIONS, "Permission bits"),
+	ENTRY_FIELD("last_access", FIELD_LAST_ACCESS, "Last access time"),
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+
+static PyMethodDef DirEntryMethods[] =
+{
+	{"is_dir", (PyCFunction)entry_is_dir, METH_NOARGS, "is_dir() -> True or False"},
+	{"is_file", (PyCFunction)entry_is_file, METH_NOARGS, "is_file() -> True or False"},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject DirEntryType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.DirEntry",		/* tp_name */
+	sizeof(DirEntryObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)entry_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	(reprfunc)entry_repr,		/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"An entry of a hdfs directory, see scandir()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	DirEntryMethods,		/* tp_methods */
+	0,				/* tp_members */
+	DirEntryGetSet,			/* tp_getset */
+};
+
+
+static void
+scandir_close_listing(ScandirIterObject *self)
+{
+	if (self->listing != NULL) {
+		listing_release(self->listing);
+		self->listing = NULL;
+	}
+}
+
+
+static void
+scandir_dealloc(ScandirIterObject *self)
+{
+	scandir_close_listing(self);
+	PyObject_Del(self);
+}
+
+
+static PyObject *
+scandir_iternext(ScandirIterObject *self)
+{
+	DirEntryObject *entry;
+
+	if (self->listing == NULL)
+		return NULL;
+	if (self->next >= self->listing->nentries) {
+		scandir_close_listing(self);
+		return NULL;
+	}
+
+	entry = PyObject_New(DirEntryObject, &DirEntryType);
+	if (entry == NULL)
+		return NULL;
+	entry->listing = self->listing;
+	entry->info = &self->listing->entries[self->next++];
+	self->listing->refs++;
+	return (PyObject *)entry;
+}
+
+
+static PyObject *
+scandir_close(ScandirIterObject *self)
+{
+	scandir_close_listing(self);
+	Py_RETURN_NONE;
+}
+
+
+static PyObject *
+scandir_enter(ScandirIterObject *self)
+{
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+
+static PyObject *
+scandir_exit(ScandirIterObject *self, PyObject *args)
+{
+	scandir_close_listing(self);
+	Py_RETURN_FALSE;
+}
+
+
+static PyMethodDef ScandirIterMethods[] =
+{
+	{"close", (PyCFunction)scandir_close, METH_NOARGS, "close() -> None \n\nStop the iteration, freeing the listing once no entry refers to it"},
+	{"__enter__", (PyCFunction)scandir_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)scandir_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject ScandirIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.ScandirIterator",	/* tp_name */
+	sizeof(ScandirIterObject),	/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)scandir_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"Iterator over the entries of a hdfs directory, see scandir()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	PyObject_SelfIter,		/* tp_iter */
+	(iternextfunc)scandir_iternext,	/* tp_iternext */
+	ScandirIterMethods,		/* tp_methods */
+};
+
+
+/**
+ * List a directory with hdfsListDirectory, with the GIL released.
+ * @param fs The configured filesystem handle.
+ * @param path The path of the directory, relative to the working
+ * directory if not absolute.
+ * @return Returns the listing with one reference, NULL on error with
+ * errno set.
+ */
+static struct dir_listing *
+listing_fetch(hdfsFS fs, const char *path)
+{
+	struct dir_listing *listing;
+	char *realpath;
+	int saved_errno;
+
+	realpath = hdfs_realpath(fs, path);
+	if (realpath == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	listing = malloc(sizeof(*listing));
+	if (listing == NULL) {
+		free(realpath);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	errno = 0;
+	listing->nentries = 0;
+	listing->entries = hdfsListDirectory(fs, realpath, &listing->nentries);
+	saved_errno = errno;
+	if (listing->entries == NULL && saved_errno) {
+		free(realpath);
+		free(listing);
+		errno = saved_errno;
+		return NULL;
+	}
+	if (listing->entries == NULL)
+		listing->nentries = 0;
+	listing->skip = strlen(realpath) + (strcmp(realpath, "/") ? 1 : 0);
+	listing->refs = 1;
+	free(realpath);
+	return listing;
+}
+
+
+/**
+ * Iterate over the entries of a directory.
+ * @param fs The configured filesystem handle.
+ * @param path The path of the directory.
+ * @return Returns a ScandirIterator yielding DirEntry objects, NULL on
+ * error.
+ */
+static PyObject *
+hdfs_scandir(PyObject *self, PyObject *args)
+{
+	ScandirIterObject *it;
+	struct dir_listing *listing;
+	PyObject *pyfs;
+	const char *path;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+		return NULL;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	listing = listing_fetch(fs, path);
+	Py_END_ALLOW_THREADS
+	if (listing == NULL)
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+
+	it = PyObject_New(ScandirIterObject, &ScandirIterType);
+	if (it == NULL) {
+		listing_release(listing);
+		return NULL;
+	}
+	it->listing = listing;
+	it->next = 0;
+	return (PyObject *)it;
+}
+
+
+/**
+ * pyhdfs.Column - one field of a directory listing for all its entries,
+ * as returned by listdir_columns().
+ *
+ * Numeric fields are packed in an int64 array exposed through the buffer
+ * protocol. String fields are stored back to back in the data string,
+ * the array then holds the n + 1 offsets of the strings in data.
+ */
+typedef struct {
+	PyObject_HEAD
+	int64_t *values;
+	Py_ssize_t nvalues;	/* n, n + 1 for a string column */
+	Py_ssize_t n;		/* number of entries */
+	PyObject *data;		/* NULL for a numeric column */
+} ColumnObject;
+
+
+static void
+column_dealloc(ColumnObject *self)
+{
+	PyMem_Free(self->values);
+	Py_XDECREF(self->data);
+	PyObject_Del(self);
+}
+
+
+static Py_ssize_t
+column_length(ColumnObject *self)
+{
+	return self->n;
+}
+
+
+static PyObject *
+column_item(ColumnObject *self, Py_ssize_t i)
+{
+	if (i < 0 || i >= self->n) {
+		PyErr_SetString(PyExc_IndexError, "Column index out of range");
+		return NULL;
+	}
+	if (self->data != NULL)
+		return PyString_FromStringAndSize(
+			PyString_AS_STRING(self->data) + self->values[i],
+			self->values[i + 1] - self->values[i]);
+	return PyLong_FromLongLong(self->values[i]);
+}
+
+
+static int
+column_getbuffer(ColumnObject *self, Py_buffer *view, int flags)
+{
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "Column is read-only");
+		return -1;
+	}
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->buf = self->values;
+	view->len = self->nvalues * sizeof(int64_t);
+	view->readonly = 1;
+	view->itemsize = sizeof(int64_t);
+	view->format = (flags & PyBUF_FORMAT) == PyBUF_FORMAT ? "q" : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &self->nvalues : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+		&view->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+
+static PyObject *
+column_sum(ColumnObject *self)
+{
+	int64_t total = 0;
+	Py_ssize_t i;
+
+	if (self->data != NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot sum a string column");
+		return NULL;
+	}
+	for (i = 0; i < self->n; i++)
+		total += self->values[i];
+	return PyLong_FromLongLong(total);
+}
+
+
+static PyObject *
+column_get_offsets(ColumnObject *self, void *closure)
+{
+	ColumnObject *offsets;
+
+	if (self->data == NULL)
+		Py_RETURN_NONE;
+	offsets = PyObject_New(ColumnObject, Py_TYPE(self));
+	if (offsets == NULL)
+		return NULL;
+	offsets->values = PyMem_Malloc(self->nvalues * sizeof(int64_t));
+	offsets->nvalues = offsets->n = self->nvalues;
+	offsets->data = NULL;
+	if (offsets->values == NULL) {
+		Py_DECREF(offsets);
+		return PyErr_NoMemory();
+	}
+	memcpy(offsets->values, self->values, self->nvalues * sizeof(int64_t));
+	return (PyObject *)offsets;
+}
+
+
+static PyObject *
+column_get_data(ColumnObject *self, void *closure)
+{
+	PyObject *data = self->data ? self->data : Py_None;
+
+	Py_INCREF(data);
+	return data;
+}
+
+
+static PyMethodDef ColumnMethods[] =
+{
+	{"sum", (PyCFunction)column_sum, METH_NOARGS, "sum() -> int \n\nSum of the values of a numeric column"},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyGetSetDef ColumnGetSet[] =
+{
+	{"offsets", (getter)column_get_offsets, NULL, "Offsets of the strings in data, as a numeric Column of n + 1 values. None for a numeric column", NULL},
+	{"data", (getter)column_get_data, NULL, "The strings back to back, None for a numeric column", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+
+static PySequenceMethods ColumnAsSequence = {
+	(lenfunc)column_length,		/* sq_length */
+	0,				/* sq_concat */
+	0,				/* sq_repeat */
+	(ssizeargfunc)column_item,	/* sq_item */
+};
+
+
+static PyBufferProcs ColumnAsBuffer = {
+	.bf_getbuffer = (getbufferproc)column_getbuffer,
+	.bf_releasebuffer = NULL,
+};
+
+
+static PyTypeObject ColumnType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.Column",		/* tp_name */
+	sizeof(ColumnObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)column_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	&ColumnAsSequence,		/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	&ColumnAsBuffer,		/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,	/* tp_flags */
+	"A field of a directory listing, see listdir_columns()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	ColumnMethods,			/* tp_methods */
+	0,				/* tp_members */
+	ColumnGetSet,			/* tp_getset */
+};
+
+
+/**
+ * Pack a field of every entry of a listing in a new Column.
+ */
+static PyObject *
+column_build(struct dir_listing *listing, enum entry_field field)
+{
+	ColumnObject *col;
+	hdfsFileInfo *info;
+	const char *str;
+	Py_ssize_t i, n = listing->nentries, size = 0, len;
+	char *dst;
+	int is_str = field == FIELD_NAME || field == FIELD_PATH ||
+		field == FIELD_OWNER || field == FIELD_GROUP;
+
+	col = PyObject_New(ColumnObject, &ColumnType);
+	if (col == NULL)
+		return NULL;
+	col->n = n;
+	col->nvalues = is_str ? n + 1 : n;
+	col->data = NULL;
+	col->values = PyMem_Malloc((col->nvalues + 1) * sizeof(int64_t));
+	if (col->values == NULL) {
+		Py_DECREF(col);
+		return PyErr_NoMemory();
+	}
+
+	if (!is_str) {
+		for (i = 0; i < n; i++)
+			col->values[i] = entry_int(&listing->entries[i], field);
+		return (PyObject *)col;
+	}
+
+	for (i = 0; i < n; i++) {
+		col->values[i] = size;
+		size += strlen(entry_str(listing, &listing->entries[i], field));
+	}
+	col->values[n] = size;
+	col->data = PyString_FromStringAndSize(NULL, size);
+	if (col->data == NULL) {
+		Py_DECREF(col);
+		return NULL;
+	}
+	dst = PyString_AS_STRING(col->data);
+	for (i = 0; i < n; i++) {
+		info = &listing->entries[i];
+		str = entry_str(listing, info, field);
+		len = col->values[i + 1] - col->values[i];
+		memcpy(dst + col->values[i], str, len);
+	}
+	return (PyObject *)col;
+}
+
+
+/**
+ * List a directory as columns.
+ * @param fs The configured filesystem handle.
+ * @param path The path of the directory.
+ * @param fields The names of the fields wanted, among the keys of the
+ * dicts returned by listdir plus path. (optional)
+ * @return Returns a dict {field: Column}, NULL on error.
+ */
+static PyObject *
+hdfs_listdir_columns(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "path", "fields", NULL};
+	static const int default_fields[] = {FIELD_NAME, FIELD_SIZE,
+					     FIELD_LAST_MOD, FIELD_REPLICATION};
+	struct dir_listing *listing;
+	PyObject *pyfs, *pyfields = NULL;
+	PyObject *seq = NULL, *res, *col;
+	const char *path, *name;
+	Py_ssize_t i, nfields = 4;
+	int *fields, field;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|O", kwlist, &pyfs,
+					 &path, &pyfields))
+		return NULL;
+
+	if (pyfields != NULL) {
+		seq = PySequence_Fast(pyfields, "fields must be a sequence");
+		if (seq == NULL)
+			return NULL;
+		nfields = PySequence_Fast_GET_SIZE(seq);
+	}
+	fields = PyMem_Malloc((nfields + 1) * sizeof(int));
+	if (fields == NULL) {
+		Py_XDECREF(seq);
+		return PyErr_NoMemory();
+	}
+	for (i = 0; i < nfields; i++) {
+		if (pyfields == NULL) {
+			fields[i] = default_fields[i];
+			continue;
+		}
+		name = PyString_AsString(PySequence_Fast_GET_ITEM(seq, i));
+		if (name == NULL)
+			break;
+		for (field = 0; entry_field_names[field]; field++) {
+			if (!strcmp(name, entry_field_names[field]))
+				break;
+		}
+		if (entry_field_names[field] == NULL) {
+			PyErr_Format(PyExc_ValueError, "Unknown field '%s'", name);
+			break;
+		}
+		fields[i] = field;
+	}
+	Py_XDECREF(seq);
+	if (i < nfields) {
+		PyMem_Free(fields);
+		return NULL;
+	}
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	listing = listing_fetch(fs, path);
+	Py_END_ALLOW_THREADS
+	if (listing == NULL) {
+		PyMem_Free(fields);
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+	}
+
+	res = PyDict_New();
+	for (i = 0; res != NULL && i < nfields; i++) {
+		col = column_build(listing, (enum entry_field)fields[i]);
+		if (col == NULL || PyDict_SetItemString(res,
+				entry_field_names[fields[i]], col) < 0)
+			Py_CLEAR(res);
+		Py_XDECREF(col);
+	}
+	listing_release(listing);
+	PyMem_Free(fields);
+	return res;
+}
+
+
+/**
+ * Recursive traversals: a pool of workers takes directories from a
+ * shared queue, lists them and queues their subdirectories, until the
+ * queue is empty and no worker is busy. walk() hands the listings to
+ * Python as they are done, du() and count() only add them up.
+ */
+struct walk_dir {
+	char *path;
+	int depth;
+	hdfsFileInfo *entries;
+	int nentries;
+	struct walk_dir *next;
+};
+
+struct walk_queue {
+	struct walk_dir *head;
+	struct walk_dir *tail;
+	int count;
+};
+
+struct walk_job {
+	hdfsFS fs;
+	int max_depth;		/* negative for no limit */
+	int keep;		/* queue the listings for walk() */
+	struct walk_queue todo;
+	struct walk_queue done;
+	int busy;		/* workers listing a directory */
+	int finished;
+	int stop;
+	int error;		/* errno of the root */
+	int64_t dirs;
+	int64_t files;
+	int64_t bytes;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* todo, busy or done changed */
+};
+
+
+static void
+walk_push(struct walk_queue *q, struct walk_dir *d)
+{
+	d->next = NULL;
+	if (q->tail != NULL)
+		q->tail->next = d;
+	else
+		q->head = d;
+	q->tail = d;
+	q->count++;
+}
+
+
+static struct walk_dir *
+walk_pop(struct walk_queue *q)
+{
+	struct walk_dir *d = q->head;
+
+	if (d != NULL) {
+		q->head = d->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		q->count--;
+	}
+	return d;
+}
+
+
+static struct walk_dir *
+walk_dir_new(const char *path, int depth)
+{
+	struct walk_dir *d = calloc(1, sizeof(*d));
+
+	if (d != NULL) {
+		d->path = strdup(path);
+		d->depth = depth;
+		if (d->path == NULL) {
+			free(d);
+			d = NULL;
+		}
+	}
+	return d;
+}
+
+
+static void
+walk_dir_free(struct walk_dir *d)
+{
+	if (d->entries != NULL)
+		hdfsFreeFileInfo(d->entries, d->nentries);
+	free(d->path);
+	free(d);
+}
+
+
+static void *
+walk_worker(void *arg)
+{
+	struct walk_job *job = arg;
+	struct walk_queue children;
+	struct walk_dir *d, *child;
+	hdfsFileInfo *info;
+	int64_t files, bytes;
+	int i;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (!job->stop && job->todo.count == 0 && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		/* walk() reads the listings as they come, do not run ahead */
+		while (!job->stop && job->keep && job->done.count >= WALK_PENDING)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->stop || (job->todo.count == 0 && job->busy == 0)) {
+			job->finished = 1;
+			pthread_cond_broadcast(&job->cond);
+			break;
+		}
+		if (job->todo.count == 0)
+			continue;
+		d = walk_pop(&job->todo);
+		job->busy++;
+		pthread_mutex_unlock(&job->lock);
+
+		memset(&children, 0, sizeof(children));
+		files = bytes = 0;
+		errno = 0;
+		d->entries = hdfsListDirectory(job->fs, d->path, &d->nentries);
+		/* an empty directory is NULL with errno unset */
+		if (d->entries == NULL) {
+			d->nentries = 0;
+			if (d->depth == 0 && errno != 0)
+				job->error = errno;
+		}
+		for (i = 0; i < d->nentries; i++) {
+			info = &d->entries[i];
+			if (info->mKind != kObjectKindDirectory) {
+				files++;
+				bytes += info->mSize;
+			} else if (job->max_depth < 0 || d->depth < job->max_depth) {
+				child = walk_dir_new(entry_path(info), d->depth + 1);
+				if (child != NULL)
+					walk_push(&children, child);
+			}
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->dirs++;
+		job->files += files;
+		job->bytes += bytes;
+		if (children.head != NULL) {
+			if (job->todo.tail != NULL)
+				job->todo.tail->next = children.head;
+			else
+				job->todo.head = children.head;
+			job->todo.tail = children.tail;
+			job->todo.count += children.count;
+		}
+		if (job->keep)
+			walk_push(&job->done, d);
+		else
+			walk_dir_free(d);
+		job->busy--;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+
+static void
+walk_job_free(struct walk_job *job)
+{
+	struct walk_dir *d;
+
+	while ((d = walk_pop(&job->todo)) != NULL)
+		walk_dir_free(d);
+	while ((d = walk_pop(&job->done)) != NULL)
+		walk_dir_free(d);
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
 }
 
 
 /**
- * Copy file from hdfs to local.
- * @param fs The handle to hdfs.
- * @param rpath The path of hdfs file. 
- * @param lpath The path of local file. 
- * @return Returns None on success, NULL on error. 
+ * Prepare the traversal of the directory root, with the GIL released.
+ * @return Returns the job, NULL on error with errno set. ENOTDIR is set
+ * for a file, whose info is then returned in *file if not NULL.
+ */
+static struct walk_job *
+walk_job_new(hdfsFS fs, const char *root, int max_depth, int keep,
+	     hdfsFileInfo **file)
+{
+	struct walk_job *job;
+	struct walk_dir *d;
+	hdfsFileInfo *info;
+	char *realpath;
+
+	realpath = hdfs_realpath(fs, root);
+	if (realpath == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	errno = 0;
+	info = hdfsGetPathInfo(fs, realpath);
+	if (info == NULL) {
+		if (!errno)
+			errno = ENOENT;
+		free(realpath);
+		return NULL;
+	}
+	if (info->mKind != kObjectKindDirectory) {
+		if (file != NULL)
+			*file = info;
+		else
+			hdfsFreeFileInfo(info, 1);
+		free(realpath);
+		errno = ENOTDIR;
+		return NULL;
+	}
+	hdfsFreeFileInfo(info, 1);
+
+	job = calloc(1, sizeof(*job));
+	d = walk_dir_new(realpath, 0);
+	free(realpath);
+	if (job == NULL || d == NULL) {
+		free(job);
+		if (d != NULL)
+			walk_dir_free(d);
+		errno = ENOMEM;
+		return NULL;
+	}
+	job->fs = fs;
+	job->max_depth = max_depth;
+	job->keep = keep;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	walk_push(&job->todo, d);
+	return job;
+}
+
+
+/**
+ * pyhdfs.WalkIterator - yields (dirpath, dirnames, filenames) for the
+ * directories of a tree, as returned by walk().
+ */
+typedef struct {
+	PyObject_HEAD
+	struct walk_job *job;
+	pthread_t *tids;
+	int nthreads;
+} WalkIterObject;
+
+
+static void
+walkiter_stop(WalkIterObject *self)
+{
+	if (self->job == NULL)
+		return;
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->job->lock);
+	self->job->stop = 1;
+	pthread_cond_broadcast(&self->job->cond);
+	pthread_mutex_unlock(&self->job->lock);
+	join_threads(self->tids, self->nthreads);
+	walk_job_free(self->job);
+	Py_END_ALLOW_THREADS
+	self->job = NULL;
+}
+
+
+static void
+walkiter_dealloc(WalkIterObject *self)
+{
+	walkiter_stop(self);
+	PyMem_Free(self->tids);
+	PyObject_Del(self);
+}
+
+
+static PyObject *
+walkiter_result(struct walk_dir *d)
+{
+	PyObject *dirs, *files, *name, *res = NULL;
+	hdfsFileInfo *info;
+	const char *base;
+	int i;
+
+	dirs = PyList_New(0);
+	files = PyList_New(0);
+	for (i = 0; dirs != NULL && files != NULL && i < d->nentries; i++) {
+		info = &d->entries[i];
+		base = strrchr(entry_path(info), '/');
+		name = PyString_FromString(base ? base + 1 : info->mName);
+		if (name == NULL ||
+		    PyList_Append(info->mKind == kObjectKindDirectory ?
+				  dirs : files, name) < 0) {
+			Py_XDECREF(name);
+			goto error;
+		}
+		Py_DECREF(name);
+	}
+	if (dirs != NULL && files != NULL)
+		res = Py_BuildValue("(sOO)", d->path, dirs, files);
+error:
+	Py_XDECREF(dirs);
+	Py_XDECREF(files);
+	return res;
+}
+
+
+static PyObject *
+walkiter_iternext(WalkIterObject *self)
+{
+	struct walk_job *job = self->job;
+	struct walk_dir *d;
+	PyObject *res;
+	int error;
+
+	if (job == NULL)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&job->lock);
+	while (job->done.count == 0 && !job->finished)
+		pthread_cond_wait(&job->cond, &job->lock);
+	d = walk_pop(&job->done);
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	Py_END_ALLOW_THREADS
+
+	if (d == NULL) {
+		error = job->error;
+		walkiter_stop(self);
+		if (error) {
+			errno = error;
+			return PyErr_SetFromErrno(PyExc_IOError);
+		}
+		return NULL;
+	}
+	res = walkiter_result(d);
+	Py_BEGIN_ALLOW_THREADS
+	walk_dir_free(d);
+	Py_END_ALLOW_THREADS
+	return res;
+}
+
+
+static PyTypeObject WalkIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"pyhdfs.WalkIterator",		/* tp_name */
+	sizeof(WalkIterObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)walkiter_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"Iterator over the directories of a hdfs tree, see walk()",	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	PyObject_SelfIter,		/* tp_iter */
+	(iternextfunc)walkiter_iternext,	/* tp_iternext */
+};
+
+
+/**
+ * Walk a directory tree.
+ * @param fs The configured filesystem handle.
+ * @param root The top directory.
+ * @param threads Number of directories listed at once. (optional)
+ * @param max_depth Do not descend deeper than max_depth levels below
+ * root, negative for no limit. (optional)
+ * @return Returns a WalkIterator yielding (dirpath, dirnames, filenames)
+ * for root and every directory below it, in no particular order. NULL
+ * on error.
+ */
+static PyObject *
+hdfs_walk(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "root", "threads", "max_depth", NULL};
+	WalkIterObject *it;
+	struct walk_job *job;
+	PyObject *pyfs, *empty;
+	const char *root;
+	int nthreads = DEFAULT_META_THREADS;
+	int max_depth = -1;
+	int saved_errno;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|ii", kwlist, &pyfs,
+					 &root, &nthreads, &max_depth))
+		return NULL;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	it = PyObject_New(WalkIterObject, &WalkIterType);
+	if (it == NULL)
+		return NULL;
+	it->job = NULL;
+	it->nthreads = 0;
+	it->tids = PyMem_Malloc(nthreads * sizeof(pthread_t));
+	if (it->tids == NULL) {
+		Py_DECREF(it);
+		return PyErr_NoMemory();
+	}
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	job = walk_job_new(fs, root, max_depth, 1, NULL);
+	saved_errno = errno;
+	if (job != NULL)
+		it->nthreads = start_threads(it->tids, nthreads, walk_worker, job);
+	Py_END_ALLOW_THREADS
+
+	if (job == NULL) {
+		Py_DECREF(it);
+		if (saved_errno == ENOTDIR) {
+			/* nothing to walk, like os.walk */
+			empty = PyTuple_New(0);
+			it = empty ? (WalkIterObject *)PyObject_GetIter(empty) : NULL;
+			Py_XDECREF(empty);
+			return (PyObject *)it;
+		}
+		errno = saved_errno;
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)root);
+	}
+	it->job = job;
+	if (it->nthreads == 0) {
+		Py_DECREF(it);
+		PyErr_SetString(PyExc_RuntimeError, "Failed to start threads");
+		return NULL;
+	}
+	return (PyObject *)it;
+}
+
+
+/**
+ * Add up a directory tree with nthreads workers.
+ * @return Returns 0 on success, -1 on error with errno set.
+ */
+static int
+walk_sum(hdfsFS fs, const char *root, int nthreads, int64_t *dirs,
+	 int64_t *files, int64_t *bytes)
+{
+	struct walk_job *job;
+	hdfsFileInfo *file = NULL;
+	pthread_t *tids;
+	int started, error;
+
+	job = walk_job_new(fs, root, -1, 0, &file);
+	if (job == NULL) {
+		if (file == NULL)
+			return -1;
+		*dirs = 0;
+		*files = 1;
+		*bytes = file->mSize;
+		hdfsFreeFileInfo(file, 1);
+		return 0;
+	}
+
+	tids = malloc(nthreads * sizeof(pthread_t));
+	started = tids ? start_threads(tids, nthreads, walk_worker, job) : 0;
+	if (started == 0)
+		walk_worker(job);
+	join_threads(tids, started);
+	free(tids);
+
+	*dirs = job->dirs;
+	*files = job->files;
+	*bytes = job->bytes;
+	error = job->error;
+	walk_job_free(job);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Get the space used by a directory tree.
+ * @param fs The configured filesystem handle.
+ * @param root The top directory, or a file.
+ * @param threads Number of directories listed at once. (optional)
+ * @return Returns the total size of the files in bytes, NULL on error.
  */
 static PyObject *
-hdfs_get(PyObject *self, PyObject *args)
+hdfs_du(PyObject *self, PyObject *args, PyObject *kwds)
 {
+	static char *kwlist[] = {"fs", "root", "threads", NULL};
 	PyObject *pyfs;
-	hdfsFS fs, lfs;
-	const char *rpath, *lpath;
-	
-	if (!PyArg_ParseTuple(args, "Oss", &pyfs, &rpath, &lpath))
+	const char *root;
+	int nthreads = DEFAULT_META_THREADS;
+	int64_t dirs, files, bytes;
+	hdfsFS fs;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|i", kwlist, &pyfs,
+					 &root, &nthreads))
 		return NULL;
-	
+	if (nthreads < 1)
+		nthreads = 1;
+
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	lfs = hdfsConnect(NULL, 0);	/* connect to local fs */
-	
-	if (!lfs) {
+	Py_BEGIN_ALLOW_THREADS
+	ret = walk_sum(fs, root, nthreads, &dirs, &files, &bytes);
+	Py_END_ALLOW_THREADS
+
+	if (ret == -1)
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)root);
+	return PyLong_FromLongLong(bytes);
+}
+
+
+/**
+ * Count the directories, files and bytes of a directory tree.
+ * @param fs The configured filesystem handle.
+ * @param root The top directory, or a file.
+ * @param threads Number of directories listed at once. (optional)
+ * @return Returns a (dirs, files, bytes) tuple, root included in dirs,
+ * NULL on error.
+ */
+static PyObject *
+hdfs_count(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"fs", "root", "threads", NULL};
+	PyObject *pyfs;
+	const char *root;
+	int nthreads = DEFAULT_META_THREADS;
+	int64_t dirs, files, bytes;
+	hdfsFS fs;
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|i", kwlist, &pyfs,
+					 &root, &nthreads))
 		return NULL;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	ret = walk_sum(fs, root, nthreads, &dirs, &files, &bytes);
+	Py_END_ALLOW_THREADS
+
+	if (ret == -1)
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)root);
+	return Py_BuildValue("(LLL)", dirs, files, bytes);
+}
+
+
+/**
+ * Glob expansion: the pattern is split in one level per path component,
+ * each level holding the alternatives of its {a,b} groups. Levels
+ * without wildcards are appended to the path as is, the others list the
+ * directory and match the names in C. Directories of a level are listed
+ * in parallel by a pool of workers taking them from a shared queue, like
+ * walk(). {a,b} groups spanning several components are expanded first,
+ * each expansion being globbed in turn.
+ */
+struct glob_level {
+	char **alts;
+	int nalts;
+	int magic;		/* some alternative has a wildcard */
+};
+
+struct glob_job {
+	hdfsFS fs;
+	struct glob_level *levels;
+	int nlevels;
+	int dirs_only;		/* the pattern ends with a / */
+	struct walk_queue todo;
+	int busy;
+	int error;		/* ENOMEM */
+	char **found;
+	size_t nfound;
+	size_t cap;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+static int
+glob_add(struct glob_job *job, char *path)
+{
+	char **found;
+
+	if (job->nfound == job->cap) {
+		job->cap = job->cap ? job->cap * 2 : 64;
+		found = realloc(job->found, job->cap * sizeof(*found));
+		if (found == NULL) {
+			free(path);
+			return -1;
+		}
+		job->found = found;
+	}
+	job->found[job->nfound++] = path;
+	return 0;
+}
+
+
+/**
+ * Find the {a,b} group starting at p.
+ * @return Returns the closing brace, NULL if p does not start a group
+ * with at least one comma. *slash tells if the group holds a /.
+ */
+static const char *
+glob_brace_end(const char *p, int *slash)
+{
+	int depth = 0, commas = 0;
+
+	*slash = 0;
+	for (; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0') {
+			p++;
+		} else if (*p == '{') {
+			depth++;
+		} else if (*p == '}') {
+			if (--depth == 0)
+				return commas ? p : NULL;
+		} else if (*p == ',' && depth == 1) {
+			commas++;
+		} else if (*p == '/') {
+			*slash = 1;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Expand the {a,b} groups of pat into list, only the ones holding a /
+ * if slash_only.
+ * @return Returns 0 on success, -1 if out of memory.
+ */
+static int
+glob_expand(const char *pat, int slash_only, char ***list, int *n)
+{
+	const char *p, *end, *alt, *q;
+	char **items, *s;
+	int slash, depth, ret;
+
+	for (p = pat; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0') {
+			p++;
+			continue;
+		}
+		if (*p != '{')
+			continue;
+		end = glob_brace_end(p, &slash);
+		if (end != NULL && (slash || !slash_only))
+			break;
+	}
+	if (*p == '\0') {
+		items = realloc(*list, (*n + 1) * sizeof(char *));
+		if (items == NULL)
+			return -1;
+		*list = items;
+		items[*n] = strdup(pat);
+		if (items[*n] == NULL)
+			return -1;
+		(*n)++;
+		return 0;
+	}
+
+	depth = 0;
+	for (alt = q = p + 1; q <= end; q++) {
+		if (*q == '\\' && q[1] != '\0') {
+			q++;
+			continue;
+		}
+		if (*q == '{') {
+			depth++;
+			continue;
+		}
+		if (*q == '}' && q != end) {
+			depth--;
+			continue;
+		}
+		if (depth > 0 || (*q != ',' && q != end))
+			continue;
+		s = malloc(strlen(pat) + 1);
+		if (s == NULL)
+			return -1;
+		sprintf(s, "%.*s%.*s%s", (int)(p - pat), pat, (int)(q - alt),
+			alt, end + 1);
+		ret = glob_expand(s, slash_only, list, n);
+		free(s);
+		if (ret == -1)
+			return -1;
+		alt = q + 1;
+	}
+	return 0;
+}
+
+
+static int
+glob_is_magic(const char *p)
+{
+	for (; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		else if (*p == '*' || *p == '?' || *p == '[')
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Drop the backslashes of a literal component, in place.
+ */
+static char *
+glob_unescape(char *s)
+{
+	char *src, *dst;
+
+	for (src = dst = s; *src != '\0'; src++) {
+		if (*src == '\\' && src[1] != '\0')
+			src++;
+		*dst++ = *src;
+	}
+	*dst = '\0';
+	return s;
+}
+
+
+/**
+ * Match c against the [...] class starting after the [ at p.
+ * @return Returns the end of the class, NULL if it is not closed.
+ */
+static const char *
+glob_class(const char *p, unsigned char c, int *matched)
+{
+	unsigned char lo, hi;
+	int negate = 0, ok = 0;
+
+	if (*p == '!' || *p == '^') {
+		negate = 1;
+		p++;
+	}
+	do {
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		if (*p == '\0')
+			return NULL;
+		lo = hi = *p++;
+		if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+			p++;
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			hi = *p++;
+		}
+		if (c >= lo && c <= hi)
+			ok = 1;
+	} while (*p != ']');
+	*matched = ok != negate;
+	return p + 1;
+}
+
+
+/**
+ * Match a name against a pattern of *, ? and [...] wildcards.
+ */
+static int
+glob_match(const char *p, const char *s)
+{
+	const char *star_p = NULL, *star_s = NULL, *next;
+	int matched;
+
+	while (*s != '\0') {
+		switch (*p) {
+		case '*':
+			star_p = ++p;
+			star_s = s;
+			continue;
+		case '?':
+			p++;
+			s++;
+			continue;
+		case '[':
+			next = glob_class(p + 1, *s, &matched);
+			if (next == NULL)
+				break;
+			if (!matched)
+				goto backtrack;
+			p = next;
+			s++;
+			continue;
+		case '\\':
+			if (p[1] != '\0')
+				p++;
+			break;
+		}
+		if (*p == *s) {
+			p++;
+			s++;
+			continue;
+		}
+	backtrack:
+		if (star_p == NULL)
+			return 0;
+		p = star_p;
+		s = ++star_s;
+	}
+	while (*p == '*')
+		p++;
+	return *p == '\0';
+}
+
+
+static void
+glob_levels_free(struct glob_level *levels, int nlevels)
+{
+	int i, j;
+
+	for (i = 0; i < nlevels; i++) {
+		for (j = 0; j < levels[i].nalts; j++)
+			free(levels[i].alts[j]);
+		free(levels[i].alts);
+	}
+	free(levels);
+}
+
+
+/**
+ * Split a pattern without / in its {a,b} groups in levels.
+ * @return Returns 0 on success, -1 if out of memory.
+ */
+static int
+glob_split(struct glob_job *job, const char *pat)
+{
+	struct glob_level *level;
+	const char *p, *end;
+	char *comp;
+	int i, ret;
+
+	job->levels = calloc(strlen(pat) / 2 + 1, sizeof(*job->levels));
+	if (job->levels == NULL)
+		return -1;
+	for (p = pat; *p != '\0'; p = end) {
+		while (*p == '/')
+			p++;
+		end = strchrnul(p, '/');
+		if (end == p || (end - p == 1 && *p == '.'))
+			continue;
+		comp = strndup(p, end - p);
+		if (comp == NULL)
+			return -1;
+		level = &job->levels[job->nlevels++];
+		ret = glob_expand(comp, 0, &level->alts, &level->nalts);
+		free(comp);
+		if (ret == -1)
+			return -1;
+		for (i = 0; i < level->nalts; i++) {
+			if (glob_is_magic(level->alts[i]))
+				level->magic = 1;
+		}
+		if (!level->magic) {
+			for (i = 0; i < level->nalts; i++)
+				glob_unescape(level->alts[i]);
+		}
+	}
+	job->dirs_only = *pat != '\0' && pat[strlen(pat) - 1] == '/';
+	return 0;
+}
+
+
+/**
+ * Expand the level of d into children to queue and matches to add.
+ */
+static void
+glob_step(struct glob_job *job, struct walk_dir *d,
+	  struct walk_queue *children, struct glob_job *matches)
+{
+	struct glob_level *level = &job->levels[d->depth];
+	int last = d->depth == job->nlevels - 1;
+	hdfsFileInfo *info;
+	struct walk_dir *child;
+	const char *path, *name;
+	char *s;
+	int i, j;
+
+	if (!level->magic) {
+		for (i = 0; i < level->nalts; i++) {
+			s = join_path(d->path, level->alts[i]);
+			if (s == NULL) {
+				matches->error = ENOMEM;
+				return;
+			}
+			if (!last) {
+				child = walk_dir_new(s, d->depth + 1);
+				if (child == NULL)
+					matches->error = ENOMEM;
+				else
+					walk_push(children, child);
+				free(s);
+				continue;
+			}
+			info = hdfsGetPathInfo(job->fs, s);
+			if (info != NULL && (!job->dirs_only ||
+					     info->mKind == kObjectKindDirectory)) {
+				if (glob_add(matches, s) == -1)
+					matches->error = ENOMEM;
+			} else {
+				free(s);
+			}
+			if (info != NULL)
+				hdfsFreeFileInfo(info, 1);
+		}
+		return;
+	}
+
+	d->entries = hdfsListDirectory(job->fs, d->path, &d->nentries);
+	if (d->entries == NULL)
+		d->nentries = 0;
+	for (i = 0; i < d->nentries; i++) {
+		info = &d->entries[i];
+		if (!last || job->dirs_only) {
+			if (info->mKind != kObjectKindDirectory)
+				continue;
+		}
+		path = entry_path(info);
+		name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+		for (j = 0; j < level->nalts; j++) {
+			if (glob_match(level->alts[j], name))
+				break;
+		}
+		if (j == level->nalts)
+			continue;
+		if (last) {
+			s = strdup(path);
+			if (s == NULL || glob_add(matches, s) == -1)
+				matches->error = ENOMEM;
+		} else {
+			child = walk_dir_new(path, d->depth + 1);
+			if (child == NULL)
+				matches->error = ENOMEM;
+			else
+				walk_push(children, child);
+		}
+	}
+}
+
+
+static void *
+glob_worker(void *arg)
+{
+	struct glob_job *job = arg;
+	struct glob_job matches;
+	struct walk_queue children;
+	struct walk_dir *d;
+	size_t i;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (job->todo.count == 0 && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->todo.count == 0 || job->error) {
+			pthread_cond_broadcast(&job->cond);
+			break;
+		}
+		d = walk_pop(&job->todo);
+		job->busy++;
+		pthread_mutex_unlock(&job->lock);
+
+		memset(&children, 0, sizeof(children));
+		memset(&matches, 0, sizeof(matches));
+		glob_step(job, d, &children, &matches);
+		walk_dir_free(d);
+
+		pthread_mutex_lock(&job->lock);
+		if (children.head != NULL) {
+			if (job->todo.tail != NULL)
+				job->todo.tail->next = children.head;
+			else
+				job->todo.head = children.head;
+			job->todo.tail = children.tail;
+			job->todo.count += children.count;
+		}
+		for (i = 0; i < matches.nfound; i++) {
+			if (glob_add(job, matches.found[i]) == -1)
+				matches.error = ENOMEM;
+		}
+		free(matches.found);
+		if (matches.error)
+			job->error = matches.error;
+		job->busy--;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+
+/**
+ * Add the matches of a pattern without / in its {a,b} groups to found,
+ * with nthreads workers.
+ * @return Returns 0 on success, -1 on error with errno set.
+ */
+static int
+glob_run(hdfsFS fs, const char *root, const char *pat, int nthreads,
+	 struct glob_job *found)
+{
+	struct glob_job job;
+	struct walk_dir *d;
+	pthread_t *tids;
+	hdfsFileInfo *info;
+	char *s;
+	size_t i;
+	int started;
+
+	memset(&job, 0, sizeof(job));
+	job.fs = fs;
+	if (glob_split(&job, pat) == -1) {
+		glob_levels_free(job.levels, job.nlevels);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (job.nlevels == 0) {
+		/* the root itself */
+		info = hdfsGetPathInfo(fs, root);
+		glob_levels_free(job.levels, job.nlevels);
+		if (info == NULL)
+			return 0;
+		hdfsFreeFileInfo(info, 1);
+		s = strdup(root);
+		if (s == NULL || glob_add(found, s) == -1) {
+			errno = ENOMEM;
+			return -1;
+		}
+		return 0;
+	}
+
+	d = walk_dir_new(root, 0);
+	if (d == NULL) {
+		glob_levels_free(job.levels, job.nlevels);
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	walk_push(&job.todo, d);
+
+	tids = malloc(nthreads * sizeof(pthread_t));
+	started = tids ? start_threads(tids, nthreads, glob_worker, &job) : 0;
+	if (started == 0)
+		glob_worker(&job);
+	join_threads(tids, started);
+	free(tids);
+
+	while ((d = walk_pop(&job.todo)) != NULL)
+		walk_dir_free(d);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+	glob_levels_free(job.levels, job.nlevels);
+
+	for (i = 0; i < job.nfound; i++) {
+		if (!job.error && glob_add(found, job.found[i]) == -1)
+			job.error = ENOMEM;
+		else if (job.error)
+			free(job.found[i]);
 	}
-	
-	if (hdfsCopy(fs, rpath, lfs, lpath) != -1) {
-		Py_RETURN_NONE;
-	} else {
-		PyErr_SetString(PyExc_IOError, "Failed to get file");
-		return NULL;
+	free(job.found);
+	if (job.error) {
+		errno = job.error;
+		return -1;
 	}
+	return 0;
+}
+
+
+static int
+glob_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
 }
 
 
 /**
- * Copy file from local to hdfs.
- * @param fs The handle to hdfs.
- * @param lpath The path of local file. 
- * @param rpath The path of hdfs file. 
- * @return Returns None on success, NULL on error. 
+ * Expand a glob pattern, with the GIL released.
+ * @return Returns 0 on success with the sorted matches in found, -1 on
+ * error with errno set.
  */
-static PyObject *
-hdfs_put(PyObject *self, PyObject *args)
+static int
+glob_paths(hdfsFS fs, const char *pattern, int nthreads,
+	   struct glob_job *found)
 {
-	PyObject *pyfs;
-	hdfsFS fs, lfs;
-	const char *lpath, *rpath;
-	
-	if (!PyArg_ParseTuple(args, "Oss", &pyfs, &lpath, &rpath))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	lfs = hdfsConnect(NULL, 0);	/* connect to local fs */
-	
-	if (!lfs) {
-		return NULL;
+	char **pats = NULL;
+	char *root;
+	size_t i, j;
+	int k, npats = 0, ret = 0;
+
+	if (*pattern == '\0')
+		return 0;
+	root = hdfs_realpath(fs, *pattern == '/' ? "/" : ".");
+	if (root == NULL) {
+		errno = ENOENT;
+		return -1;
 	}
-	
-	if (hdfsCopy(lfs, lpath, fs, rpath) != -1) {
-		Py_RETURN_NONE;
-	} else {
-		PyErr_SetString(PyExc_IOError, "Failed to put file");
-		return NULL;
+	if (glob_expand(pattern, 1, &pats, &npats) == -1) {
+		errno = ENOMEM;
+		ret = -1;
+	}
+	for (k = 0; k < npats; k++) {
+		if (ret == 0)
+			ret = glob_run(fs, root, pats[k], nthreads, found);
+		free(pats[k]);
+	}
+	free(pats);
+	free(root);
+
+	if (found->nfound > 1) {
+		qsort(found->found, found->nfound, sizeof(char *), glob_compare);
+		for (i = j = 1; i < found->nfound; i++) {
+			if (strcmp(found->found[i], found->found[j - 1]) == 0)
+				free(found->found[i]);
+			else
+				found->found[j++] = found->found[i];
+		}
+		found->nfound = j;
 	}
+	return ret;
 }
 
 
 /**
- * Checks if a given path exsits on the hdfs.
+ * Find the paths matching a pattern.
  * @param fs The configured filesystem handle.
- * @param path The path to look for
- * @return Returns True on success, False else.
- * int hdfsExists(hdfsFS fs, const char *path);
+ * @param pattern The pattern, with *, ?, [...] and {a,b} wildcards.
+ * @param threads Number of directories listed at once. (optional)
+ * @return Returns the sorted list of the matching absolute paths, NULL
+ * on error.
  */
 static PyObject *
-hdfs_exists(PyObject *self, PyObject *args)
+hdfs_glob(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	PyObject *pyfs;
+	static char *kwlist[] = {"fs", "pattern", "threads", NULL};
+	struct glob_job found;
+	PyObject *pyfs, *res, *item;
+	const char *pattern;
+	int nthreads = DEFAULT_META_THREADS;
+	size_t i;
 	hdfsFS fs;
-	const char *path;
-	
-	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+	int ret;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|i", kwlist, &pyfs,
+					 &pattern, &nthreads))
 		return NULL;
-	
+	if (nthreads < 1)
+		nthreads = 1;
+
+	memset(&found, 0, sizeof(found));
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	if (hdfsExists(fs, path) != -1) 
-		Py_RETURN_TRUE;
-	else
-		Py_RETURN_FALSE;
+	Py_BEGIN_ALLOW_THREADS
+	ret = glob_paths(fs, pattern, nthreads, &found);
+	Py_END_ALLOW_THREADS
+
+	res = ret == -1 ? NULL : PyList_New(found.nfound);
+	if (ret == -1)
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)pattern);
+	for (i = 0; i < found.nfound; i++) {
+		if (res != NULL) {
+			item = PyString_FromString(found.found[i]);
+			if (item == NULL)
+				Py_CLEAR(res);
+			else
+				PyList_SET_ITEM(res, i, item);
+		}
+		free(found.found[i]);
+	}
+	free(found.found);
+	return res;
 }
 
 
 /**
- * Rename a file (directory)
- * @param fs The configured filesystem handle.
- * @param oldPath The path of the source file. 
- * @param newPath The path of the destination file. 
- * @return Returns 0 on success, -1 on error. 
- * int hdfsRename(hdfsFS fs, const char* oldPath, const char* newPath);
+ * The blocks of a file overlapping a byte range and their hosts, as
+ * fetched by block_fetch.
  */
-static PyObject *
-hdfs_rename(PyObject *self, PyObject *args)
+struct block_list {
+	tOffset size;		/* of the file */
+	tOffset block_size;
+	tOffset first;		/* offset of the first block */
+	char ***hosts;		/* NULL if the range is empty */
+	int error;		/* errno, 0 on success */
+};
+
+
+/**
+ * Fetch the blocks of path overlapping [start, start + length), length
+ * negative meaning up to the end of the file. Called with the GIL
+ * released.
+ */
+static void
+block_fetch(hdfsFS fs, const char *path, tOffset start, tOffset length,
+	    struct block_list *bl)
 {
-	PyObject *pyfs;
-	hdfsFS fs;
-	const char *oldpath, *newpath;
-	
-	
-	if (!PyArg_ParseTuple(args, "Oss", &pyfs, &oldpath, &newpath))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	if (hdfsRename(fs, oldpath, newpath) != -1)
-		Py_RETURN_TRUE;
-	else
-		Py_RETURN_FALSE;
+	hdfsFileInfo *info;
+	tOffset end;
+
+	memset(bl, 0, sizeof(*bl));
+	errno = 0;
+	info = hdfsGetPathInfo(fs, path);
+	if (info == NULL) {
+		bl->error = errno ? errno : ENOENT;
+		return;
+	}
+	bl->size = info->mSize;
+	bl->block_size = info->mBlockSize;
+	if (info->mKind == kObjectKindDirectory)
+		bl->error = EISDIR;
+	hdfsFreeFileInfo(info, 1);
+
+	if (start < 0)
+		start = 0;
+	end = length < 0 || length > bl->size - start ? bl->size : start + length;
+	if (bl->error || start >= end || bl->block_size <= 0)
+		return;
+
+	bl->first = start / bl->block_size * bl->block_size;
+	errno = 0;
+	bl->hosts = hdfsGetHosts(fs, path, start, end - start);
+	if (bl->hosts == NULL)
+		bl->error = errno ? errno : EIO;
+}
+
+
+static tOffset
+block_length(struct block_list *bl, tOffset offset)
+{
+	return bl->size - offset < bl->block_size ? bl->size - offset :
+		bl->block_size;
 }
 
 
 /**
- * Delete a file (directory)
- * @param fs The configured filesystem handle.
- * @param path The path of the file.
- * @return Returns True on success, False else.
+ * Get the string of a host name, shared through the names dict: a
+ * cluster has far fewer hosts than blocks.
+ * @return Returns a borrowed reference, NULL on error.
  */
 static PyObject *
-hdfs_delete(PyObject *self, PyObject *args)
+host_name(const char *host, PyObject *names)
 {
-	PyObject *pyfs;
-	hdfsFS fs;
-	const char *path;
-	
-	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+	PyObject *name, *shared;
+
+	name = PyString_FromString(host);
+	if (name == NULL)
 		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	if (hdfsDelete(fs, path) != -1) 
-		Py_RETURN_TRUE;
-	else
-		Py_RETURN_FALSE;
+	shared = PyDict_GetItem(names, name);
+	if (shared == NULL) {
+		if (PyDict_SetItem(names, name, name) < 0)
+			shared = NULL;
+		else
+			shared = name;
+	}
+	Py_DECREF(name);
+	return shared;
 }
 
 
 static PyObject *
-hdfs_stat(PyObject *self, PyObject *args)
+block_hosts(char **hosts, PyObject *names)
 {
-	PyObject *pyfs;
-	hdfsFS fs;
-	const char *path;
-	
-	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
-		return NULL;
-	
-	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	hdfsFileInfo *fileinfo = hdfsGetPathInfo(fs, path);
-	
-	if (fileinfo != NULL) {
-		PyObject *res = Py_BuildValue("cLLL", fileinfo->mKind,
-					      fileinfo->mSize,
-					      (int64_t)fileinfo->mLastMod,
-					      (int64_t)fileinfo->mLastAccess);
-		hdfsFreeFileInfo(fileinfo, 1);
-		return res;
-	} else {
-		Py_RETURN_NONE;
+	PyObject *res, *name;
+	Py_ssize_t i, n;
+
+	for (n = 0; hosts[n] != NULL; n++)
+		;
+	res = PyTuple_New(n);
+	for (i = 0; res != NULL && i < n; i++) {
+		name = host_name(hosts[i], names);
+		if (name == NULL) {
+			Py_CLEAR(res);
+			break;
+		}
+		Py_INCREF(name);
+		PyTuple_SET_ITEM(res, i, name);
 	}
+	return res;
 }
 
 
+/**
+ * Get the locations of the blocks of a file.
+ * @param fs The configured filesystem handle.
+ * @param path The path of the file.
+ * @param start Offset of the first byte of interest. (optional)
+ * @param length Number of bytes of interest, None for up to the end of
+ * the file. (optional)
+ * @return Returns a list of (offset, length, (host, ...)) tuples, one per
+ * block overlapping the range, NULL on error.
+ */
 static PyObject *
-hdfs_mkdir(PyObject *self, PyObject *args)
+hdfs_block_locations(PyObject *self, PyObject *args, PyObject *kwds)
 {
+	static char *kwlist[] = {"fs", "path", "start", "length", NULL};
+	struct block_list bl;
 	PyObject *pyfs;
-	hdfsFS fs;
+	PyObject *pylength = Py_None;
+	PyObject *res, *names, *hosts, *block;
 	const char *path;
-	
-	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+	tOffset start = 0, length = -1, offset;
+	hdfsFS fs;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|LO", kwlist, &pyfs,
+					 &path, &start, &pylength))
 		return NULL;
-	
+	if (pylength != Py_None) {
+		length = PyLong_AsLongLong(pylength);
+		if (length == -1 && PyErr_Occurred())
+			return NULL;
+	}
+
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
+	Py_BEGIN_ALLOW_THREADS
+	block_fetch(fs, path, start, length, &bl);
+	Py_END_ALLOW_THREADS
 
-	disable_stderr();
-	if (hdfsCreateDirectory(fs, path) != -1) {
-		renable_stderr();
-		Py_RETURN_TRUE;
-	} else {
-		renable_stderr();
-		Py_RETURN_FALSE;
+	if (bl.error) {
+		errno = bl.error;
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+	}
+
+	res = PyList_New(0);
+	names = PyDict_New();
+	offset = bl.first;
+	for (i = 0; res != NULL && names != NULL && bl.hosts && bl.hosts[i]; i++) {
+		hosts = block_hosts(bl.hosts[i], names);
+		block = hosts ? Py_BuildValue("(LLN)", offset,
+					      block_length(&bl, offset), hosts) : NULL;
+		if (block == NULL || PyList_Append(res, block) < 0)
+			Py_CLEAR(res);
+		Py_XDECREF(block);
+		offset += bl.block_size;
 	}
+	if (names == NULL)
+		Py_CLEAR(res);
+	Py_XDECREF(names);
+	if (bl.hosts != NULL)
+		hdfsFreeHosts(bl.hosts);
+	return res;
 }
 
 
+/**
+ * Cut a file into splits of whole blocks for open_split().
+ * @param fs The configured filesystem handle.
+ * @param path The path of the file.
+ * @param target_size Wanted size of the splits, rounded to a number of
+ * blocks, one block by default. (optional)
+ * @return Returns a list of (offset, length, (host, ...)) tuples, the
+ * hosts being those of the first block of the split, NULL on error.
+ */
 static PyObject *
-hdfs_utime(PyObject *self, PyObject *args)
+hdfs_splits(PyObject *self, PyObject *args, PyObject *kwds)
 {
+	static char *kwlist[] = {"fs", "path", "target_size", NULL};
+	struct block_list bl;
 	PyObject *pyfs;
-	hdfsFS fs;
+	PyObject *pytarget = Py_None;
+	PyObject *res, *names, *hosts, *split;
 	const char *path;
-	int64_t mtime, atime;
-	
-	if (!PyArg_ParseTuple(args, "OsLL", &pyfs, &path, &mtime, &atime))
+	tOffset target = 0, size, offset, length, nblocks, nhosts;
+	hdfsFS fs;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|O", kwlist, &pyfs,
+					 &path, &pytarget))
 		return NULL;
-	
+	if (pytarget != Py_None) {
+		target = PyLong_AsLongLong(pytarget);
+		if (target == -1 && PyErr_Occurred())
+			return NULL;
+		if (target <= 0) {
+			PyErr_SetString(PyExc_ValueError,
+					"target_size must be positive");
+			return NULL;
+		}
+	}
+
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	
-	if (hdfsUtime(fs, path, mtime, atime) != -1) {
-		Py_RETURN_TRUE;
-	} else {
-		Py_RETURN_FALSE;
+	Py_BEGIN_ALLOW_THREADS
+	block_fetch(fs, path, 0, -1, &bl);
+	Py_END_ALLOW_THREADS
+
+	if (bl.error) {
+		errno = bl.error;
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+	}
+
+	/* without blocks the whole file is one split */
+	if (bl.block_size <= 0)
+		bl.block_size = bl.size > 0 ? bl.size : 1;
+	nblocks = target ? (target + bl.block_size / 2) / bl.block_size : 1;
+	if (nblocks < 1)
+		nblocks = 1;
+	size = nblocks * bl.block_size;
+	/* libhdfs may list fewer blocks than the size spans */
+	for (nhosts = 0; bl.hosts != NULL && bl.hosts[nhosts] != NULL; nhosts++)
+		;
+
+	res = PyList_New(0);
+	names = PyDict_New();
+	for (offset = 0; res != NULL && names != NULL && offset < bl.size;
+	     offset += length) {
+		/* like Hadoop, a tail of up to a tenth of a split is kept */
+		length = bl.size - offset;
+		if (length > size + size / 10)
+			length = size;
+		if (offset / bl.block_size < nhosts)
+			hosts = block_hosts(bl.hosts[offset / bl.block_size], names);
+		else
+			hosts = PyTuple_New(0);
+		split = hosts ? Py_BuildValue("(LLN)", offset, length, hosts) : NULL;
+		if (split == NULL || PyList_Append(res, split) < 0)
+			Py_CLEAR(res);
+		Py_XDECREF(split);
 	}
+	if (names == NULL)
+		Py_CLEAR(res);
+	Py_XDECREF(names);
+	if (bl.hosts != NULL)
+		hdfsFreeHosts(bl.hosts);
+	return res;
 }
 
 
 /**
- * Get list of files/directories for a given path.
- * hdfsFreeFileInfo should be called to deallocate memory.
+ * Assign a block to the least loaded of its hosts and append it to the
+ * ranges of that host, merging it with the previous range of the same
+ * file when they are contiguous.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int
+group_block(PyObject *groups, PyObject *load, PyObject *names,
+	    PyObject *path, char **hosts, tOffset offset, tOffset length)
+{
+	PyObject *host = Py_None, *name, *bytes, *ranges, *last, *range;
+	tOffset best = -1, n, prev_off, prev_len;
+	int i;
+
+	for (i = 0; hosts[i] != NULL; i++) {
+		name = host_name(hosts[i], names);
+		if (name == NULL)
+			return -1;
+		bytes = PyDict_GetItem(load, name);
+		n = bytes ? PyLong_AsLongLong(bytes) : 0;
+		if (best == -1 || n < best) {
+			best = n;
+			host = name;
+		}
+	}
+
+	if (host != Py_None) {
+		bytes = PyLong_FromLongLong(best + length);
+		if (bytes == NULL || PyDict_SetItem(load, host, bytes) < 0) {
+			Py_XDECREF(bytes);
+			return -1;
+		}
+		Py_DECREF(bytes);
+	}
+
+	ranges = PyDict_GetItem(groups, host);
+	if (ranges == NULL) {
+		ranges = PyList_New(0);
+		if (ranges == NULL || PyDict_SetItem(groups, host, ranges) < 0) {
+			Py_XDECREF(ranges);
+			return -1;
+		}
+		Py_DECREF(ranges);
+	}
+
+	n = PyList_GET_SIZE(ranges);
+	if (n > 0) {
+		last = PyList_GET_ITEM(ranges, n - 1);
+		prev_off = PyLong_AsLongLong(PyTuple_GET_ITEM(last, 1));
+		prev_len = PyLong_AsLongLong(PyTuple_GET_ITEM(last, 2));
+		if (PyTuple_GET_ITEM(last, 0) == path &&
+		    prev_off + prev_len == offset) {
+			range = Py_BuildValue("(OLL)", path, prev_off,
+					      prev_len + length);
+			if (range == NULL)
+				return -1;
+			return PyList_SetItem(ranges, n - 1, range);
+		}
+	}
+	range = Py_BuildValue("(OLL)", path, offset, length);
+	if (range == NULL || PyList_Append(ranges, range) < 0) {
+		Py_XDECREF(range);
+		return -1;
+	}
+	Py_DECREF(range);
+	return 0;
+}
+
+
+/**
+ * Group the blocks of files by host, for locality-aware scheduling.
  * @param fs The configured filesystem handle.
- * @param path The path of the directory.
- * @return Returns a dynamically-allocated list of hdfsFileInfo
- * objects; NULL on error.
+ * @param paths A sequence of file paths.
+ * @return Returns a dict {host: [(path, offset, length), ...]}, every
+ * block being assigned to the replica host with the fewest bytes so far.
+ * Contiguous blocks of a file on one host are merged in one range. Blocks
+ * without a known host are grouped under None. NULL on error.
  */
 static PyObject *
-hdfs_listdir(PyObject *self, PyObject *args)
+hdfs_group_by_host(PyObject *self, PyObject *args)
 {
-  	PyObject *pyfs;
+	struct block_list bl;
+	PyObject *pyfs, *pypaths;
+	PyObject *seq, *path;
+	PyObject *groups, *load, *names;
+	Py_ssize_t i;
+	const char *cpath;
+	tOffset offset;
 	hdfsFS fs;
-	const char *path;
-	char *realpath;
-	hdfsFileInfo *entries;
-	int i;
-	int num_entries;
+	int j, ret = 0;
 
-	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
+	if (!PyArg_ParseTuple(args, "OO", &pyfs, &pypaths))
 		return NULL;
-	
+
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	
-	realpath = hdfs_realpath(fs, path);
-	if (!realpath) {
-		Py_RETURN_NONE;
-	}
-	
-	entries = hdfsListDirectory(fs, realpath, &num_entries);
-	if (!entries && errno) {
-		free(realpath);
-		return PyErr_SetFromErrno(PyExc_IOError);
-	} else {
-		PyObject *py_entries = PyList_New(num_entries);
-		for (i = 0; i < num_entries; i++) {
-			/* hdfs://host:port/path/name 
-			   we just keep this     ~~~~~ */
-			const char *name = remove_host_prefix(entries[i].mName) + strlen(realpath);
-			if (strcmp(realpath, "/"))
-				name++;			
-			
-			PyObject *fields = Py_BuildValue(
-				"{s:c,s:s,s:L,s:L,s:h,s:L,s:s,s:s,s:h,s:L}",
-				"kind", entries[i].mKind,
-				"name", name,
-				"last_mod", (int64_t)entries[i].mLastMod,
-				"size", entries[i].mSize,
-				"replication", entries[i].mReplication,
-				"block_size", entries[i].mBlockSize,
-				"owner", entries[i].mOwner,
-				"group", entries[i].mGroup,
-				"permissions", entries[i].mPermissions,
-				"last_access", (int64_t)entries[i].mLastAccess);
-			PyList_SetItem(py_entries, i, fields);
+	seq = PySequence_Fast(pypaths, "paths must be a sequence");
+	if (seq == NULL)
+		return NULL;
+	groups = PyDict_New();
+	load = PyDict_New();
+	names = PyDict_New();
+	if (groups == NULL || load == NULL || names == NULL)
+		ret = -1;
+
+	for (i = 0; ret == 0 && i < PySequence_Fast_GET_SIZE(seq); i++) {
+		path = PySequence_Fast_GET_ITEM(seq, i);
+		cpath = PyString_AsString(path);
+		if (cpath == NULL) {
+			ret = -1;
+			break;
 		}
-		hdfsFreeFileInfo(entries, num_entries);
-		free(realpath);
-		return py_entries;
+
+		Py_BEGIN_ALLOW_THREADS
+		block_fetch(fs, cpath, 0, -1, &bl);
+		Py_END_ALLOW_THREADS
+
+		if (bl.error) {
+			errno = bl.error;
+			PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)cpath);
+			ret = -1;
+			break;
+		}
+		offset = bl.first;
+		for (j = 0; ret == 0 && bl.hosts && bl.hosts[j]; j++) {
+			ret = group_block(groups, load, names, path, bl.hosts[j],
+					  offset, block_length(&bl, offset));
+			offset += bl.block_size;
+		}
+		if (bl.hosts != NULL)
+			hdfsFreeHosts(bl.hosts);
 	}
+
+	Py_DECREF(seq);
+	Py_XDECREF(load);
+	Py_XDECREF(names);
+	if (ret == -1)
+		Py_CLEAR(groups);
+	return groups;
 }
 
 
@@ -749,6 +9781,7 @@ hdfs_getcwd(PyObject *self, PyObject *args)
 	hdfsFS fs;
 	void *buf;
 	int size = 512;
+	char *cwd;
 	PyObject *res = NULL;
 	
 	if (!PyArg_ParseTuple(args, "O", &pyfs))
@@ -759,7 +9792,10 @@ hdfs_getcwd(PyObject *self, PyObject *args)
 		return PyErr_NoMemory();
 	
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
-	if (hdfsGetWorkingDirectory(fs, buf, size) != NULL) {
+	Py_BEGIN_ALLOW_THREADS
+	cwd = hdfsGetWorkingDirectory(fs, buf, size);
+	Py_END_ALLOW_THREADS
+	if (cwd != NULL) {
 		res = Py_BuildValue("s", remove_host_prefix(buf));
 		PyMem_Free(buf); 
 		return res;
@@ -780,18 +9816,21 @@ hdfs_chdir(PyObject *self, PyObject *args)
 	PyObject *pyfs;
 	hdfsFS fs;
 	const char *path;
+	int ret;
 
 	if (!PyArg_ParseTuple(args, "Os", &pyfs, &path))
 		return NULL;
 	
 	fs = (hdfsFS)PyLong_AsVoidPtr(pyfs);
 	
+	Py_BEGIN_ALLOW_THREADS
 	disable_stderr();
-	if (hdfsSetWorkingDirectory(fs, path) != -1) {
-		renable_stderr();
+	ret = hdfsSetWorkingDirectory(fs, path);
+	renable_stderr();
+	Py_END_ALLOW_THREADS
+	if (ret != -1) {
 		Py_RETURN_TRUE;
 	} else {
-		renable_stderr();		
 		Py_RETURN_FALSE;
 	}
 }
@@ -800,24 +9839,54 @@ hdfs_chdir(PyObject *self, PyObject *args)
 static PyMethodDef HdfsMethods[] =
 {
 	{"connect", hdfs_connect, METH_VARARGS, "connect(host, port) -> fs \n\nConnect to a hdfs file system"},
-	{"open", hdfs_open, METH_VARARGS, "open(fs, path[, mode[, bufsize[, replication[, blksiz]]]]) -> hdfs-file \n\nOpen a hdfs file in given mode (\"r\" or \"w\"), default is read-only"},
-	{"write", hdfs_write, METH_VARARGS, "write(fs, hdfsfile, str) -> byteswritten \n\nWrite data into an open file"},
+	{"connect_as_user", (PyCFunction)hdfs_connect_as_user, METH_VARARGS | METH_KEYWORDS, "connect_as_user(host, port, user[, groups]) -> fs \n\nConnect to a hdfs file system as the given user, member of the given groups. See pool() to reuse the connections of many users"},
+	{"pool", (PyCFunction)hdfs_pool, METH_VARARGS | METH_KEYWORDS, "pool(host, port[, user[, max[, idle_timeout]]]) -> Pool \n\nCreate a pool of up to max (8) connections to a hdfs file system, shared by threads: fs = pool.acquire() ... pool.release(fs), or with pool.lease() as fs: ... Connections are kept per user, pool.acquire(user=name) reuses an idle connection of that user or replaces the idle ones of the least recently used user. The connections of a user are disconnected together, once all of them have been idle for idle_timeout (60) seconds, pool.stats() counts the hits and misses"},
+	{"open", (PyCFunction)hdfs_open, METH_VARARGS | METH_KEYWORDS, "open(fs, path[, mode[, bufsize[, replication[, blksiz[, buffering[, readahead[, async_writes[, compression]]]]]]]]) -> File \n\nOpen a hdfs file in given mode (\"r\", \"w\" or \"a\" to append), default is read-only. The File can be passed as hdfsfile to the functions below, or used directly as a buffered file object. With readahead=N, a thread keeps the next N 1M chunks of the file in memory for sequential reads. With async_writes=N, full buffers (of 64K at least) are written by a thread, up to N at a time; flush() and close() wait for them and report their errors. With compression=\"gzip\", \"zstd\", \"lz4\" or \"auto\", data is compressed on write and decompressed on read, on a thread of its own; such files cannot seek"},
+	{"rolling", (PyCFunction)hdfs_rolling, METH_VARARGS | METH_KEYWORDS, "rolling(fs, path[, max_size[, max_age[, flush_interval[, buffering]]]]) -> RollingFile \n\nOpen path for appending records. Records are batched and flushed every flush_interval (1.0) seconds by a thread, with hflush where libhdfs has it; the hdfsFlush of libhdfs 0.20 does not make them visible to readers. Before a record is written, the file is renamed to path.YYYYmmdd-HHMMSS and started again once it has max_size bytes or is max_age seconds old"},
+	{"write", hdfs_write, METH_VARARGS, "write(fs, hdfsfile, buffer) -> byteswritten \n\nWrite a string or any contiguous buffer (bytearray, memoryview, numpy array...) into an open file, without copying it"},
+	{"writev", hdfs_writev, METH_VARARGS, "writev(fs, hdfsfile, buffers) -> byteswritten \n\nWrite a sequence of strings or buffers into an open file in one call. Small buffers are gathered before they are handed to libhdfs, large ones are written from where they are"},
 	{"flush", hdfs_flush, METH_VARARGS, "flush(fs, hdfsfile) -> None \n\nFlush the data"},
-	{"read", hdfs_read, METH_VARARGS, "read(fs, hdfsfile[, size]) -> read at most min(2M, size) bytes, returned as a string \n\nIf the size argument is <=0 or omitted, read at most 2M bytes. When EOF is reached, empty string will be returned"},
+	{"read", hdfs_read, METH_VARARGS, "read(fs, hdfsfile[, size]) -> read at most size bytes, returned as a string \n\nIf the size argument is <=0 or omitted, read at most 2M bytes. A single call may return less than size bytes. When EOF is reached, empty string will be returned"},
 	{"pread", hdfs_pread, METH_VARARGS, "pread(fs, hdfsfile, offset[, size]) -> similar to read, read data from given position"},
+	{"readall", hdfs_readall, METH_VARARGS, "readall(fs, hdfsfile[, size]) -> read exactly size bytes, returned as a string \n\nLoop until size bytes are read or EOF is reached. If the size argument is <=0 or omitted, read until EOF"},
+	{"preadall", hdfs_preadall, METH_VARARGS, "preadall(fs, hdfsfile, offset[, size]) -> similar to readall, read data from given position"},
+	{"preadv", (PyCFunction)hdfs_preadv, METH_VARARGS | METH_KEYWORDS, "preadv(fs, hdfsfile, ranges[, threads[, gap]]) -> [memoryview] \n\nRead many (offset, length) ranges of a file at once. Ranges less than gap (64K) bytes apart are read together, up to threads (4) reads run at once. Returns one memoryview per range, in order, all sharing one buffer. A range past EOF gets a shorter view"},
+	{"page_cache", (PyCFunction)hdfs_page_cache, METH_VARARGS | METH_KEYWORDS, "page_cache(size[, page_size]) -> None \n\nCache the pages read by pread, preadall and preadinto on File objects, in a memory budget of size bytes split in pages of page_size (64K) bytes. Pages are keyed by path, modification time, size and offset, reads over 1M bypass the cache. size 0 disables the cache"},
+	{"page_cache_stats", hdfs_page_cache_stats, METH_NOARGS, "page_cache_stats() -> {size, page_size, pages, hits, misses, evictions, hit_rate} \n\nGet the counters of the page cache, None if it is disabled"},
+	{"readinto", hdfs_readinto, METH_VARARGS, "readinto(fs, hdfsfile, buffer) -> bytesread \n\nRead at most len(buffer) bytes directly into a writable buffer (bytearray, memoryview, mmap...). 0 is returned at EOF"},
+	{"preadinto", hdfs_preadinto, METH_VARARGS, "preadinto(fs, hdfsfile, offset, buffer) -> bytesread \n\nSimilar to readinto, read data from given position"},
 	{"seek", hdfs_seek, METH_VARARGS, "seek(fs, hdfsfile, offset) -> True or False \n\nSeek to given offset in open file in read-only mode"},
 	{"tell", hdfs_tell, METH_VARARGS, "tell(fs, hdfsfile) -> int \n\nGet the current offset in the file, in bytes. -1 is returned on error"},
 	{"close", hdfs_close, METH_VARARGS, "close(fs, hdfsfile) -> True or False \n\nClose a hdfs file"},
 	{"disconnect", hdfs_disconnect, METH_VARARGS, "disconnect(fs) -> True or False \n\nDisconnect from hdfs file system"},
-	{"get", hdfs_get, METH_VARARGS, "get(fs, rpath, lpath) -> None \n\nCopy a file from hdfs to local"},
+	{"get", (PyCFunction)hdfs_get, METH_VARARGS | METH_KEYWORDS, "get(fs, rpath, lpath[, threads[, callback]]) -> None \n\nCopy a file from hdfs to local. With threads > 1 the blocks of the file are downloaded in parallel, callback(bytes_done, bytes_total) is called periodically during the copy if given"},
 	{"put", hdfs_put, METH_VARARGS, "put(fs, lpath, rpath) -> None \n\nCopy a file from local to hdfs"},
+	{"disconnect_local", hdfs_disconnect_local, METH_NOARGS, "disconnect_local() -> None \n\nDisconnect the local file system handle cached by get/put and the tree copies, it is connected again when needed. Also done at exit"},
+	{"put_tree", (PyCFunction)hdfs_put_tree, METH_VARARGS | METH_KEYWORDS, "put_tree(fs, lpath, rpath[, threads]) -> [(lpath, rpath, error)] \n\nCopy the content of a local directory to hdfs, creating the directories first and copying up to threads (4) files at once. Symbolic links to files are copied as files, those to directories are skipped. Returns one entry per file, error is None on success or a message, failures do not stop the copy"},
+	{"get_tree", (PyCFunction)hdfs_get_tree, METH_VARARGS | METH_KEYWORDS, "get_tree(fs, rpath, lpath[, threads]) -> [(rpath, lpath, error)] \n\nCopy the content of a hdfs directory to local, see put_tree"},
 	{"delete", hdfs_delete, METH_VARARGS, "delete(fs, path) -> None \n\nDelete a file (directory)"},
 	{"exists", hdfs_exists, METH_VARARGS, "exists(fs, path) -> True or False \n\nChecks if a given path exsits on the hdfs"},
 	{"rename", hdfs_rename, METH_VARARGS, "rename(fs, oldpath, newpath) -> None \n\nRename a file (direcory)"},
 	{"stat", hdfs_stat, METH_VARARGS, "stat(fs, path) -> fileinfo(type, size, lastmodify, lastaccess) \n\n Get information about a path"},
+	{"stat_many", (PyCFunction)hdfs_stat_many, METH_VARARGS | METH_KEYWORDS, "stat_many(fs, paths[, threads]) -> [fileinfo or None] \n\nGet information about many paths at once, looked up by up to threads (16) threads. Returns the stat() tuple of each path in order, None for the missing ones"},
+	{"exists_many", (PyCFunction)hdfs_exists_many, METH_VARARGS | METH_KEYWORDS, "exists_many(fs, paths[, threads]) -> [True or False] \n\nChecks if the given paths exist, see stat_many"},
 	{"mkdir", hdfs_mkdir, METH_VARARGS, "mkdir(fs, path) -> True or False \n\n Make the given path and all non-existent parents into directories"},
 	{"utime", hdfs_utime, METH_VARARGS, "utime(fs, path, modtime, actime) -> True or False \n\nChange file last access and modification times"},
 	{"listdir", hdfs_listdir, METH_VARARGS, "listdir(fs, path) -> [stats] \n\nGet list of files/directories of a given directory-path. Returns a list of dict object containing {kind, name, last_mod, size, replication, block_size, owner, group, permissions, last_access}"},
+	{"cache", (PyCFunction)hdfs_cache, METH_VARARGS | METH_KEYWORDS, "cache(fs, ttl[, max_entries]) -> None \n\nCache the answers of stat, exists and listdir on this connection for ttl seconds, keeping up to max_entries (10000) paths and listings. rename, delete, mkdir, utime, put, put_tree and files opened for writing drop the entries of their path, of the paths below it and of its parent directories. ttl <= 0 disables the cache, disconnect drops it"},
+	{"cache_stats", hdfs_cache_stats, METH_VARARGS, "cache_stats(fs) -> {entries, hits, misses, evictions, invalidations} \n\nGet the counters of the metadata cache of a connection, None if it has none"},
+	{"cache_invalidate", hdfs_cache_invalidate, METH_VARARGS, "cache_invalidate(fs[, path]) -> None \n\nDrop the cached entries of path, of the paths below it and of its parent directories, or all of them, after changes made by other clients"},
+	{"scandir", hdfs_scandir, METH_VARARGS, "scandir(fs, path) -> iterator \n\nIterate over the entries of a directory. The entries have the attributes of the dicts of listdir plus path, and is_dir()/is_file() methods, which are only converted to Python objects when accessed"},
+	{"listdir_columns", (PyCFunction)hdfs_listdir_columns, METH_VARARGS | METH_KEYWORDS, "listdir_columns(fs, path[, fields]) -> {field: Column} \n\nList a directory as one Column per field, name, size, last_mod and replication by default. Numeric fields (kind as a character code) are int64 arrays usable through the buffer protocol, memoryview(col) or numpy.frombuffer(col, 'int64'), with a sum() method. String fields (name, path, owner, group) are stored as col.offsets and col.data. Columns can also be indexed"},
+	{"walk", (PyCFunction)hdfs_walk, METH_VARARGS | METH_KEYWORDS, "walk(fs, root[, threads[, max_depth]]) -> iterator \n\nWalk a directory tree like os.walk, yielding (dirpath, dirnames, filenames) for root and the directories below it, at most max_depth levels down. Up to threads (16) directories are listed at once, so the directories come in no particular order. Unreadable directories below root are skipped"},
+	{"du", (PyCFunction)hdfs_du, METH_VARARGS | METH_KEYWORDS, "du(fs, root[, threads]) -> bytes \n\nTotal size of the files of a directory tree, listed by up to threads (16) threads"},
+	{"count", (PyCFunction)hdfs_count, METH_VARARGS | METH_KEYWORDS, "count(fs, root[, threads]) -> (dirs, files, bytes) \n\nCount the directories (root included), files and bytes of a directory tree, see du"},
+	{"glob", (PyCFunction)hdfs_glob, METH_VARARGS | METH_KEYWORDS, "glob(fs, pattern[, threads]) -> [paths] \n\nFind the paths matching a pattern, as a sorted list of absolute paths. * and ? match any characters of a name, [abc], [a-z] and [!a-z] one character of a set, {a,b} any of the comma-separated alternatives, which may be patterns too. \\ escapes a wildcard. A pattern ending with / only matches directories. Only the directories holding wildcard components are listed, up to threads (16) at once"},
+	{"block_locations", (PyCFunction)hdfs_block_locations, METH_VARARGS | METH_KEYWORDS, "block_locations(fs, path[, start[, length]]) -> [(offset, length, hosts)] \n\nGet the blocks of a file overlapping the byte range [start, start + length), the whole file by default, with the tuple of the hosts storing each block"},
+	{"splits", (PyCFunction)hdfs_splits, METH_VARARGS | METH_KEYWORDS, "splits(fs, path[, target_size]) -> [(offset, length, hosts)] \n\nCut a file into ranges of whole blocks, about target_size bytes each (one block by default), to be read by open_split(). A tail of up to a tenth of a split is merged into the last one. hosts are those of the first block of each range"},
+	{"group_by_host", hdfs_group_by_host, METH_VARARGS, "group_by_host(fs, paths) -> {host: [(path, offset, length)]} \n\nGroup the blocks of the given files by host, to schedule work next to the data. Every block goes to the replica host with the fewest bytes assigned so far, contiguous blocks of a file on a host are merged into one range. Blocks without a known host are grouped under None"},
+	{"iterlines", (PyCFunction)hdfs_iterlines, METH_VARARGS | METH_KEYWORDS, "iterlines(fs, file[, delimiter[, chunk[, batch[, keepends]]]]) -> iterator \n\nIterate over the records of a file, given as a File or a path, split on delimiter (\"\\n\" by default). The file is read chunk bytes (1M) at a time. With batch > 0, lists of up to batch records are yielded. The delimiter is stripped unless keepends is true"},
+	{"open_split", (PyCFunction)hdfs_open_split, METH_VARARGS | METH_KEYWORDS, "open_split(fs, path, start, length[, delimiter[, readahead[, chunk[, batch[, keepends]]]]]) -> iterator \n\nIterate over the records of a file starting in the byte range [start, start + length), as cut by splits(), so that workers reading the splits of a file get each record once. The record cut by start is left to the previous split and the last one is read past the end. A split starting at or past the end of the file has no records. readahead 1M chunks (2) are read by a thread, the other arguments are those of iterlines()"},
 	{"getcwd", hdfs_getcwd, METH_VARARGS, "getcwd(fs) -> path \n\nReturn a string representing the current working directory."},
 	{"chdir", hdfs_chdir, METH_VARARGS, "chdir(fs, path) -> True or False \n\nSet the working directory. The `path' can be a non-exist directory. All relative paths will be resolved relative to it."},
 	{NULL, NULL, 0, NULL}
@@ -827,7 +9896,42 @@ static PyMethodDef HdfsMethods[] =
 PyMODINIT_FUNC
 initpyhdfs(void)
 {
-	(void) Py_InitModule("pyhdfs", HdfsMethods);
+	PyObject *m;
+
+	/* the wrappers drop the GIL around libhdfs calls */
+	PyEval_InitThreads();
+
+	if (PyType_Ready(&HdfsFileType) < 0)
+		return;
+	if (PyType_Ready(&LineIterType) < 0)
+		return;
+	if (PyType_Ready(&RollingFileType) < 0)
+		return;
+	if (PyType_Ready(&PoolType) < 0)
+		return;
+	if (PyType_Ready(&LeaseType) < 0)
+		return;
+	if (PyType_Ready(&DirEntryType) < 0)
+		return;
+	if (PyType_Ready(&ScandirIterType) < 0)
+		return;
+	if (PyType_Ready(&ColumnType) < 0)
+		return;
+	if (PyType_Ready(&WalkIterType) < 0)
+		return;
+
+	m = Py_InitModule("pyhdfs", HdfsMethods);
+	if (m == NULL)
+		return;
+
+	Py_INCREF(&HdfsFileType);
+	PyModule_AddObject(m, "File", (PyObject *)&HdfsFileType);
+	Py_INCREF(&RollingFileType);
+	PyModule_AddObject(m, "RollingFile", (PyObject *)&RollingFileType);
+	Py_INCREF(&PoolType);
+	PyModule_AddObject(m, "Pool", (PyObject *)&PoolType);
+
+	Py_AtExit(local_fs_teardown);
 	
 	/* no core dump file */
 	struct rlimit rlp;
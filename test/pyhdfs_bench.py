@@ -0,0 +1,585 @@
+#!/usr/bin/env python
+"""
+Throughput benchmarks for pyhdfs.
+
+They run against the local file system (pyhdfs.connect(None, 0)), so no
+cluster is needed:
+
+   $ cd test
+   $ python pyhdfs_bench.py [bench ...]
+"""
+import os
+import sys
+import time
+import random
+import fnmatch
+import shutil
+import tempfile
+import threading
+import zlib
+import pyhdfs
+
+MB = 1024 * 1024
+THREADS = [1, 2, 4, 8]
+
+
+def make_file(path, size):
+    block = os.urandom(MB)
+    out = open(path, "wb")
+    while size > 0:
+        out.write(block[:min(size, MB)])
+        size -= MB
+    out.close()
+
+
+def run_threads(n, target, *args):
+    threads = [threading.Thread(target=target, args=(i,) + args)
+               for i in range(n)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return time.time() - start
+
+
+def report(name, nthreads, nbytes, elapsed):
+    print("%-24s threads=%-2d %8.1f MB/s" %
+          (name, nthreads, nbytes / float(MB) / elapsed))
+
+
+def bench_threads(fs, tmpdir):
+    size = 32 * MB
+
+    def reader(i):
+        f = pyhdfs.open(fs, os.path.join(tmpdir, "r%d" % i), "r")
+        while pyhdfs.read(fs, f, MB):
+            pass
+        pyhdfs.close(fs, f)
+
+    def writer(i):
+        data = b"x" * MB
+        f = pyhdfs.open(fs, os.path.join(tmpdir, "w%d" % i), "w")
+        for j in range(size // MB):
+            pyhdfs.write(fs, f, data)
+        pyhdfs.close(fs, f)
+
+    for i in range(max(THREADS)):
+        make_file(os.path.join(tmpdir, "r%d" % i), size)
+    for n in THREADS:
+        report("read", n, n * size, run_threads(n, reader))
+    for n in THREADS:
+        report("write", n, n * size, run_threads(n, writer))
+
+
+def bench_small_io(fs, tmpdir):
+    size = 8 * MB
+    path = os.path.join(tmpdir, "small")
+    record = b"y" * 100
+
+    for buffering in [0, 64 * 1024]:
+        f = pyhdfs.open(fs, path, "w", buffering=buffering)
+        start = time.time()
+        for i in range(size // len(record)):
+            f.write(record)
+        f.close()
+        report("write(100) buf=%d" % buffering, 1, size, time.time() - start)
+
+        f = pyhdfs.open(fs, path, "r", buffering=buffering)
+        start = time.time()
+        while f.read(100):
+            pass
+        f.close()
+        report("read(100) buf=%d" % buffering, 1, size, time.time() - start)
+
+
+def bench_lines(fs, tmpdir):
+    path = os.path.join(tmpdir, "lines")
+    out = open(path, "wb")
+    for i in range(1000000):
+        out.write(b"2026-10-16 12:00:00 INFO request %d served in 3ms\n" % i)
+    out.close()
+
+    def python_split():
+        n = 0
+        tail = b""
+        f = pyhdfs.open(fs, path)
+        while True:
+            chunk = pyhdfs.read(fs, f, MB)
+            if not chunk:
+                break
+            lines = (tail + chunk).split(b"\n")
+            tail = lines.pop()
+            n += len(lines)
+        pyhdfs.close(fs, f)
+        return n + (1 if tail else 0)
+
+    def file_iter():
+        n = 0
+        for line in pyhdfs.open(fs, path):
+            n += 1
+        return n
+
+    def iterlines():
+        n = 0
+        for line in pyhdfs.iterlines(fs, path):
+            n += 1
+        return n
+
+    def iterlines_batch():
+        n = 0
+        for lines in pyhdfs.iterlines(fs, path, batch=1024):
+            n += len(lines)
+        return n
+
+    for name, fn in [("python read+split", python_split),
+                     ("File iteration", file_iter),
+                     ("iterlines", iterlines),
+                     ("iterlines batch=1024", iterlines_batch)]:
+        start = time.time()
+        n = fn()
+        print("%-24s %10.0f lines/s" % (name, n / (time.time() - start)))
+
+
+def bench_random_pread(fs, tmpdir):
+    path = os.path.join(tmpdir, "index")
+    make_file(path, 16 * MB)
+    count = 20000
+    rnd = random.Random(0)
+    # a hot quarter of the pages gets most of the reads
+    offsets = [rnd.randrange(4 * MB if rnd.random() < 0.9 else 16 * MB - 4096)
+               for i in range(count)]
+
+    for name, size in [("pread no cache", 0), ("pread page_cache 8M", 8 * MB)]:
+        pyhdfs.page_cache(size)
+        f = pyhdfs.open(fs, path)
+        start = time.time()
+        for off in offsets:
+            pyhdfs.pread(fs, f, off, 4096)
+        print("%-24s %8.2f us/read" %
+              (name, (time.time() - start) * 1e6 / count))
+        f.close()
+    print(pyhdfs.page_cache_stats())
+    pyhdfs.page_cache(0)
+
+
+def bench_preadv(fs, tmpdir):
+    path = os.path.join(tmpdir, "columns")
+    make_file(path, 64 * MB)
+    rnd = random.Random(0)
+    # a few hundred column chunks scattered over the file
+    ranges = sorted((rnd.randrange(64 * MB - 256 * 1024), rnd.randrange(256 * 1024))
+                    for i in range(256))
+    nbytes = sum(length for off, length in ranges)
+
+    f = pyhdfs.open(fs, path)
+    start = time.time()
+    for off, length in ranges:
+        pyhdfs.pread(fs, f, off, length)
+    print("%-24s %8.1f ms" % ("pread loop", (time.time() - start) * 1e3))
+    for n in THREADS:
+        start = time.time()
+        views = pyhdfs.preadv(fs, f, ranges, threads=n)
+        assert sum(len(v) for v in views) == nbytes
+        print("%-24s %8.1f ms" % ("preadv threads=%d" % n, (time.time() - start) * 1e3))
+    f.close()
+
+
+def bench_readahead(fs, tmpdir):
+    path = os.path.join(tmpdir, "stream")
+    make_file(path, 64 * MB)
+
+    def work(data):
+        # stands in for the parsing a consumer does between reads
+        end = time.time() + len(data) / float(MB) * 0.005
+        while time.time() < end:
+            pass
+
+    for n in [0, 2, 4]:
+        f = pyhdfs.open(fs, path, readahead=n)
+        start = time.time()
+        while True:
+            data = pyhdfs.read(fs, f, MB)
+            if not data:
+                break
+            work(data)
+        report("read readahead=%d" % n, 1, 64 * MB, time.time() - start)
+        if n:
+            print(f.readahead_stats())
+        f.close()
+
+
+def bench_async_writes(fs, tmpdir):
+    path = os.path.join(tmpdir, "out")
+    record = os.urandom(64 * 1024)
+    count = 1024
+
+    for n in [0, 2, 4]:
+        f = pyhdfs.open(fs, path, "w", buffering=MB, async_writes=n)
+        start = time.time()
+        for i in range(count):
+            # stands in for the serializing a producer does between writes
+            end = time.time() + 0.0003
+            while time.time() < end:
+                pass
+            f.write(record)
+        f.close()
+        report("write async_writes=%d" % n, 1, count * len(record),
+               time.time() - start)
+        if n:
+            f = pyhdfs.open(fs, path, "w", async_writes=n)
+            f.write(record * 64)
+            print(f.async_write_stats())
+            f.close()
+
+
+def bench_writev(fs, tmpdir):
+    path = os.path.join(tmpdir, "framed")
+    header = "h" * 16
+    body = bytearray(os.urandom(MB))
+    trailer = "t" * 8
+    count = 256
+
+    f = pyhdfs.open(fs, path, "w")
+    start = time.time()
+    for i in range(count):
+        pyhdfs.write(fs, f, header + str(body) + trailer)
+    f.close()
+    report("write joined", 1, count * MB, time.time() - start)
+
+    f = pyhdfs.open(fs, path, "w")
+    start = time.time()
+    for i in range(count):
+        pyhdfs.writev(fs, f, [header, body, trailer])
+    f.close()
+    report("writev", 1, count * MB, time.time() - start)
+
+
+def bench_rolling(fs, tmpdir):
+    path = os.path.join(tmpdir, "log")
+    record = "x" * 199 + "\n"
+    count = 20000
+
+    f = pyhdfs.open(fs, path, "a")
+    start = time.time()
+    for i in range(count):
+        f.write(record)
+        f.flush()
+    f.close()
+    print("%-24s %10.0f records/s" %
+          ("append, flush each", count / (time.time() - start)))
+
+    r = pyhdfs.rolling(fs, path, max_size=MB, flush_interval=0.1)
+    start = time.time()
+    for i in range(count):
+        r.write(record)
+    r.close()
+    print("%-24s %10.0f records/s" %
+          ("rolling, flush 0.1s", count / (time.time() - start)))
+    print(r.stats())
+
+
+def bench_compression(fs, tmpdir):
+    path = os.path.join(tmpdir, "events.gz")
+    rnd = random.Random(0)
+    text = "".join("event %d user%d %s\n" %
+                   (i, rnd.randrange(1000), "x" * rnd.randrange(80))
+                   for i in range(200000))
+    f = pyhdfs.open(fs, path, "w", compression="gzip")
+    for i in range(32):
+        f.write(text)
+    f.close()
+    nbytes = 32 * len(text)
+
+    def work(data):
+        # stands in for the parsing a consumer does between reads
+        end = time.time() + len(data) / float(MB) * 0.002
+        while time.time() < end:
+            pass
+
+    f = pyhdfs.open(fs, path)
+    d = zlib.decompressobj(16 + zlib.MAX_WBITS)
+    start = time.time()
+    while True:
+        data = pyhdfs.read(fs, f, MB)
+        if not data:
+            break
+        work(d.decompress(data))
+    f.close()
+    report("read + zlib", 1, nbytes, time.time() - start)
+
+    f = pyhdfs.open(fs, path, compression="gzip", readahead=2)
+    start = time.time()
+    while True:
+        data = pyhdfs.read(fs, f, MB)
+        if not data:
+            break
+        work(data)
+    f.close()
+    report("read compression=gzip", 1, nbytes, time.time() - start)
+
+
+def bench_splits(fs, tmpdir):
+    path = os.path.join(tmpdir, "records")
+    out = open(path, "wb")
+    for i in range(80):
+        out.write("".join("record %d %s\n" % (j, "x" * (j % 80))
+                          for j in range(20000 * i, 20000 * (i + 1))))
+    out.close()
+    size = os.path.getsize(path)
+    # one split per block, the file spans a few of them
+    ranges = [(off, length) for off, length, hosts in pyhdfs.splits(fs, path)]
+    assert len(ranges) > 2 and sum(r[1] for r in ranges) == size, ranges
+    nthreads = 4
+
+    def hand_rolled(i, counts):
+        # the skip-to-newline logic workers write on top of pread()
+        f = pyhdfs.open(fs, path)
+        n = 0
+        for start, length in ranges[i::nthreads]:
+            end = start + length
+            pos = start
+            if start > 0:
+                pos = start - 1
+                while True:
+                    data = pyhdfs.pread(fs, f, pos, 64 * 1024)
+                    k = data.find("\n")
+                    if k >= 0 or not data:
+                        pos += k + 1 if k >= 0 else len(data)
+                        break
+                    pos += len(data)
+            tail = ""
+            while pos - len(tail) < end:
+                data = pyhdfs.pread(fs, f, pos, MB)
+                if not data:
+                    if tail:
+                        n += 1
+                    break
+                rec = pos - len(tail)
+                pos += len(data)
+                lines = (tail + data).split("\n")
+                tail = lines.pop()
+                for line in lines:
+                    if rec >= end:
+                        break
+                    n += 1
+                    rec += len(line) + 1
+        f.close()
+        counts[i] = n
+
+    def split_reader(i, counts):
+        n = 0
+        for start, length in ranges[i::nthreads]:
+            for batch in pyhdfs.open_split(fs, path, start, length, batch=1024):
+                n += len(batch)
+        counts[i] = n
+
+    for name, target in [("pread + split", hand_rolled),
+                         ("open_split", split_reader)]:
+        counts = [0] * nthreads
+        elapsed = run_threads(nthreads, target, counts)
+        assert sum(counts) == 1600000, sum(counts)
+        report(name, nthreads, size, elapsed)
+
+
+def bench_get(fs, tmpdir):
+    size = 128 * MB
+    src = os.path.join(tmpdir, "get_src")
+    dst = os.path.join(tmpdir, "get_dst")
+    make_file(src, size)
+
+    for n in THREADS:
+        progress = []
+        start = time.time()
+        pyhdfs.get(fs, src, dst, threads=n,
+                   callback=lambda done, total: progress.append(done))
+        report("get", n, size, time.time() - start)
+        os.unlink(dst)
+
+
+def bench_small_get(fs, tmpdir):
+    count = 2000
+    src = os.path.join(tmpdir, "small_src")
+    dst = os.path.join(tmpdir, "small_dst")
+    make_file(src, 1024)
+
+    def cached():
+        pyhdfs.get(fs, src, dst)
+
+    def reconnect():
+        # what every get() paid before the local fs handle was cached
+        pyhdfs.connect(None, 0)
+        pyhdfs.get(fs, src, dst)
+
+    for name, fn in [("get, cached local fs", cached),
+                     ("get, connect per call", reconnect)]:
+        start = time.time()
+        for i in range(count):
+            fn()
+        print("%-24s %8.1f us/file" %
+              (name, (time.time() - start) * 1e6 / count))
+    pyhdfs.disconnect_local()
+
+
+def bench_stat_many(fs, tmpdir):
+    count = 5000
+    paths = [os.path.join(tmpdir, "stat%d" % i) for i in range(count)]
+    for path in paths[::2]:
+        open(path, "wb").close()
+
+    def loop():
+        return [pyhdfs.stat(fs, path) for path in paths]
+
+    start = time.time()
+    expected = loop()
+    print("%-24s %8.1f us/path" %
+          ("stat() loop", (time.time() - start) * 1e6 / count))
+    for n in THREADS + [16]:
+        start = time.time()
+        assert pyhdfs.stat_many(fs, paths, threads=n) == expected
+        print("%-24s %8.1f us/path" %
+              ("stat_many threads=%d" % n, (time.time() - start) * 1e6 / count))
+
+
+def bench_meta_cache(fs, tmpdir):
+    count = 200
+    paths = [os.path.join(tmpdir, "hot%d" % i) for i in range(count)]
+    for path in paths:
+        open(path, "wb").close()
+
+    def loop():
+        for i in range(20):
+            for path in paths:
+                pyhdfs.stat(fs, path)
+
+    for name, ttl in [("stat() no cache", 0), ("stat() cache", 60)]:
+        pyhdfs.cache(fs, ttl)
+        start = time.time()
+        loop()
+        print("%-24s %8.2f us/stat" %
+              (name, (time.time() - start) * 1e6 / (20 * count)))
+    print(pyhdfs.cache_stats(fs))
+    pyhdfs.cache(fs, 0)
+
+
+def bench_scandir(fs, tmpdir):
+    count = 50000
+    path = os.path.join(tmpdir, "big_dir")
+    os.mkdir(path)
+    for i in range(count):
+        open(os.path.join(path, "part-%06d" % i), "wb").close()
+
+    def listdir():
+        return sum(d["size"] for d in pyhdfs.listdir(fs, path))
+
+    def scandir():
+        return sum(e.size for e in pyhdfs.scandir(fs, path))
+
+    def scandir_names():
+        return len([e.name for e in pyhdfs.scandir(fs, path)])
+
+    def columns():
+        return pyhdfs.listdir_columns(fs, path, ["size"])["size"].sum()
+
+    for name, fn in [("listdir", listdir),
+                     ("scandir, size", scandir),
+                     ("scandir, name", scandir_names),
+                     ("listdir_columns, size", columns)]:
+        start = time.time()
+        fn()
+        print("%-24s %8.2f us/entry" %
+              (name, (time.time() - start) * 1e6 / count))
+
+
+def bench_walk(fs, tmpdir):
+    root = os.path.join(tmpdir, "tree")
+    for i in range(50):
+        for j in range(20):
+            path = os.path.join(root, "d%d" % i, "e%d" % j)
+            os.makedirs(path)
+            for k in range(5):
+                make_file(os.path.join(path, "f%d" % k), 100)
+
+    def python_du(path):
+        total = 0
+        for entry in pyhdfs.listdir(fs, path):
+            if entry["kind"] == "D":
+                total += python_du(os.path.join(path, entry["name"]))
+            else:
+                total += entry["size"]
+        return total
+
+    start = time.time()
+    expected = python_du(root)
+    print("%-24s %8.1f ms" % ("python listdir du", (time.time() - start) * 1e3))
+    for n in THREADS + [16]:
+        start = time.time()
+        assert pyhdfs.du(fs, root, threads=n) == expected
+        print("%-24s %8.1f ms" % ("du threads=%d" % n, (time.time() - start) * 1e3))
+
+
+def bench_glob(fs, tmpdir):
+    root = os.path.join(tmpdir, "logs")
+    for day in range(30):
+        for hour in range(24):
+            path = os.path.join(root, "%02d" % day, "%02d" % hour)
+            os.makedirs(path)
+            for name in ["part-0.gz", "part-1.gz", "_SUCCESS"]:
+                open(os.path.join(path, name), "wb").close()
+    pattern = os.path.join(root, "1?", "*", "part-*.gz")
+
+    def python_glob(path, parts):
+        if not parts:
+            return [path]
+        res = []
+        for entry in pyhdfs.listdir(fs, path):
+            if fnmatch.fnmatchcase(entry["name"], parts[0]):
+                res += python_glob(os.path.join(path, entry["name"]), parts[1:])
+        return res
+
+    start = time.time()
+    expected = sorted(python_glob(root, ["1?", "*", "part-*.gz"]))
+    print("%-24s %8.1f ms" % ("python listdir glob", (time.time() - start) * 1e3))
+    for n in THREADS + [16]:
+        start = time.time()
+        assert pyhdfs.glob(fs, pattern, threads=n) == expected
+        print("%-24s %8.1f ms" % ("glob threads=%d" % n, (time.time() - start) * 1e3))
+
+
+BENCHES = [
+    ("threads", bench_threads),
+    ("small_io", bench_small_io),
+    ("lines", bench_lines),
+    ("random_pread", bench_random_pread),
+    ("preadv", bench_preadv),
+    ("readahead", bench_readahead),
+    ("async_writes", bench_async_writes),
+    ("writev", bench_writev),
+    ("rolling", bench_rolling),
+    ("compression", bench_compression),
+    ("splits", bench_splits),
+    ("get", bench_get),
+    ("small_get", bench_small_get),
+    ("stat_many", bench_stat_many),
+    ("meta_cache", bench_meta_cache),
+    ("scandir", bench_scandir),
+    ("walk", bench_walk),
+    ("glob", bench_glob),
+]
+
+
+def main():
+    names = sys.argv[1:]
+    fs = pyhdfs.connect(None, 0)
+    tmpdir = tempfile.mkdtemp(prefix="pyhdfs_bench")
+    try:
+        for name, bench in BENCHES:
+            if not names or name in names:
+                print("== %s" % name)
+                bench(fs, tmpdir)
+    finally:
+        shutil.rmtree(tmpdir)
+        pyhdfs.disconnect(fs)
+
+if __name__ == "__main__":
+    main()
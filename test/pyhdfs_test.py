@@ -1,11 +1,63 @@
 #!/usr/bin/env python
+import os
+import sys
 import time
+import shutil
+import tempfile
 import pyhdfs
 
 host = "default"
 port = 0
 
+def compression_round_trips():
+    print "compression round trips on the local file system"
+    fs = pyhdfs.connect(None, 0)
+    tmpdir = tempfile.mkdtemp(prefix="pyhdfs_test")
+    data = "".join("line %d %s\n" % (i, "x" * (i % 100)) for i in range(50000))
+    try:
+        for codec, suffix in [("gzip", ".gz"), ("zstd", ".zst"), ("lz4", ".lz4")]:
+            path = os.path.join(tmpdir, "data" + suffix)
+            try:
+                f = pyhdfs.open(fs, path, "w", compression=codec)
+            except ValueError as e:
+                print codec, e
+                continue
+            with f:
+                f.write(data[:1000])
+                f.flush()
+                f.write(data[1000:])
+            with pyhdfs.open(fs, path, compression="auto") as f:
+                print codec, f.read() == data
+            with pyhdfs.open(fs, path, compression=codec, readahead=4) as f:
+                print codec, "".join(f) == data
+    finally:
+        shutil.rmtree(tmpdir)
+        pyhdfs.disconnect(fs)
+
+def local_splits():
+    print "splits of a file of several blocks on the local file system"
+    fs = pyhdfs.connect(None, 0)
+    tmpdir = tempfile.mkdtemp(prefix="pyhdfs_test")
+    path = os.path.join(tmpdir, "big")
+    try:
+        with open(path, "wb") as f:
+            f.truncate(200 * 1024 * 1024 + 123)
+        for target in [None, 64 * 1024 * 1024]:
+            splits = pyhdfs.splits(fs, path, target)
+            print target, [(start, length) for start, length, hosts in splits]
+            print sum(length for start, length, hosts in splits) == \
+                os.path.getsize(path)
+        size = os.path.getsize(path)
+        for start in [size, size + 1024 * 1024]:
+            print start, list(pyhdfs.open_split(fs, path, start, 1024))
+    finally:
+        shutil.rmtree(tmpdir)
+        pyhdfs.disconnect(fs)
+
 def main():
+    compression_round_trips()
+    local_splits()
+
     print "connecting"
     fs = pyhdfs.connect(host, port)
     
@@ -27,9 +79,16 @@ def main():
         if pyhdfs.exists(fs, "/test/foo"):
             print "getting"
             pyhdfs.get(fs, "/test/foo", "/tmp/foo.txt")
+            print "getting with 2 threads"
+            pyhdfs.get(fs, "/test/foo", "/tmp/foo.txt", threads=2,
+                       callback=lambda done, total: sys.stdout.write("%d/%d\n" % (done, total)))
 	    
 	print "putting"
 	pyhdfs.put(fs, "pyhdfs_test.py", "/test")
+
+	print "putting and getting a tree"
+	print pyhdfs.put_tree(fs, ".", "/test/tree")
+	print pyhdfs.get_tree(fs, "/test/tree", "/tmp/pyhdfs_tree")
         
         print "opening /test/foo for reading"
         f = pyhdfs.open(fs, "/test/foo", "r")
@@ -38,6 +97,11 @@ def main():
         s = pyhdfs.read(fs, f, 5)
         print s, len(s)
         
+        print "reading next 4 bytes into a buffer"
+        buf = bytearray(4)
+        n = pyhdfs.readinto(fs, f, buf)
+        print buf[:n], n
+        
         print "reading remaining"
         s = pyhdfs.read(fs, f)
         print s, len(s)
@@ -53,6 +117,24 @@ def main():
         s = pyhdfs.pread(fs, f, 5)
         print s, len(s)
         
+        print "position reading everything from 2"
+        s = pyhdfs.preadall(fs, f, 2)
+        print s, len(s)
+        
+        print "position reading through the page cache"
+        pyhdfs.page_cache(1024 * 1024)
+        print pyhdfs.pread(fs, f, 5, 4), pyhdfs.pread(fs, f, 5, 4)
+        print pyhdfs.page_cache_stats()
+        pyhdfs.page_cache(0)
+        
+        print "position reading from 5 into a buffer"
+        buf = bytearray(4)
+        n = pyhdfs.preadinto(fs, f, 5, buf)
+        print buf[:n], n
+        
+        print "position reading many ranges"
+        print [v.tobytes() for v in pyhdfs.preadv(fs, f, [(5, 4), (0, 2), (100, 4)])]
+        
         print "seeking"
         pyhdfs.seek(fs, f, 1)
         
@@ -62,6 +144,70 @@ def main():
         print "closing file"
         pyhdfs.close(fs, f)
 
+        print "reading lines through the File object"
+        with pyhdfs.open(fs, "/test/foo") as f:
+            print f.readline(), f.tell()
+            f.seek(0)
+            for line in f:
+                print repr(line)
+        print f.closed
+
+        print "reading ahead"
+        with pyhdfs.open(fs, "/test/foo", readahead=2) as f:
+            print repr(pyhdfs.read(fs, f, 4)), repr(f.read())
+            print f.readahead_stats()
+
+        print "writing buffers"
+        with pyhdfs.open(fs, "/test/frames", "w") as f:
+            print pyhdfs.write(fs, f, memoryview("head"))
+            print pyhdfs.writev(fs, f, ["<", bytearray("body"), ">\n"])
+        print repr(pyhdfs.open(fs, "/test/frames").read())
+        pyhdfs.delete(fs, "/test/frames")
+
+        print "appending"
+        with pyhdfs.open(fs, "/test/appended", "w") as f:
+            f.write("first\n")
+        with pyhdfs.open(fs, "/test/appended", "a") as f:
+            print f.mode, f.tell()
+            f.write("second\n")
+        print repr(pyhdfs.open(fs, "/test/appended").read())
+        pyhdfs.delete(fs, "/test/appended")
+
+        print "rolling"
+        with pyhdfs.rolling(fs, "/test/log", max_size=8) as r:
+            r.write("first\n")
+            r.writelines(["second\n", "third\n"])
+            print r.stats()
+        print sorted(pyhdfs.glob(fs, "/test/log*"))
+        for path in pyhdfs.glob(fs, "/test/log*"):
+            pyhdfs.delete(fs, path)
+
+        print "writing behind"
+        with pyhdfs.open(fs, "/test/behind", "w", async_writes=2) as f:
+            pyhdfs.write(fs, f, "hoho\n")
+            f.write("haha\n")
+            f.flush()
+            print f.async_write_stats()
+        print repr(pyhdfs.open(fs, "/test/behind").read())
+        pyhdfs.delete(fs, "/test/behind")
+
+        print "compressing"
+        with pyhdfs.open(fs, "/test/foo.gz", "w", compression="auto") as f:
+            f.write("hoho\nhaha\n")
+        with pyhdfs.open(fs, "/test/foo.gz", compression="auto") as f:
+            print f.readline(), repr(f.read()), f.tell()
+        pyhdfs.delete(fs, "/test/foo.gz")
+        
+        print "iterating records"
+        for rec in pyhdfs.iterlines(fs, "/test/foo", "\0"):
+            print repr(rec)
+
+        print "reading splits"
+        print pyhdfs.splits(fs, "/test/foo")
+        # the splits at and past the end of the file have no records
+        for start in range(0, 28, 7):
+            print start, list(pyhdfs.open_split(fs, "/test/foo", start, 7))
+        
         print "updating file time"
         pyhdfs.utime(fs, "/test/foo", int(time.time()), int(time.time()))        
         
@@ -74,6 +220,28 @@ def main():
 	print "stating dir"
 	print pyhdfs.stat(fs, "/test")
 
+	print "stat and exists many"
+	print pyhdfs.stat_many(fs, ["/test/foo", "/test/nothere", "/test"])
+	print pyhdfs.exists_many(fs, ["/test/foo", "/test/nothere"], threads=2)
+
+	print "caching metadata"
+	pyhdfs.cache(fs, 30)
+	print pyhdfs.stat(fs, "/test/foo"), pyhdfs.exists(fs, "/test/foo")
+	print pyhdfs.cache_stats(fs)
+	pyhdfs.cache(fs, 0)
+
+	print "walking /test"
+	for dirpath, dirnames, filenames in pyhdfs.walk(fs, "/test", max_depth=2):
+	    print dirpath, dirnames, filenames
+	print pyhdfs.du(fs, "/test"), pyhdfs.count(fs, "/test")
+
+	print "globbing /test/f*"
+	print pyhdfs.glob(fs, "/test/{f*,dir}")
+
+	print "block locations"
+	print pyhdfs.block_locations(fs, "/test/foo")
+	print pyhdfs.group_by_host(fs, ["/test/foo", "/test/pyhdfs_test.py"])
+
 	print "mkdir dir /test/foo"
 	print pyhdfs.mkdir(fs, "/test/foo")
 
@@ -86,6 +254,14 @@ def main():
         for i in l:
             print i
         
+        print "scanning directory"
+        for entry in pyhdfs.scandir(fs, "/test"):
+            print entry.name, entry.kind, entry.size, entry.is_dir()
+
+        print "listing directory as columns"
+        columns = pyhdfs.listdir_columns(fs, "/test", ["name", "size"])
+        print list(columns["name"]), columns["size"].sum()
+
         print "current working directory"
         print pyhdfs.getcwd(fs)
         
@@ -98,6 +274,36 @@ def main():
     finally:
         print "disconnecting"
         pyhdfs.disconnect(fs)
+
+    print "pooled connections"
+    pool = pyhdfs.pool(host, port, max=2)
+    with pool.lease() as fs:
+        print pyhdfs.exists(fs, "/test/foo")
+    with pool.lease() as fs:
+        print pyhdfs.exists(fs, "/test/foo")
+    for user in ["hdfs", "nobody", "hdfs"]:
+        with pool.lease(user=user) as fs:
+            print user, pyhdfs.exists(fs, "/test/foo")
+    print pool.stats()
+    pool.close()
+
+    print "evicting a user with two idle connections"
+    pool = pyhdfs.pool(host, port, max=2)
+    first = pool.acquire(user="hdfs")
+    second = pool.acquire(user="hdfs")
+    pool.release(first)
+    pool.release(second)
+    with pool.lease(user="nobody") as fs:
+        print "nobody", pyhdfs.exists(fs, "/test/foo")
+    with pool.lease(user="hdfs") as fs:
+        print "hdfs", pyhdfs.exists(fs, "/test/foo")
+    print pool.stats()
+    pool.close()
+
+    print "connecting as nobody"
+    fs = pyhdfs.connect_as_user(host, port, "nobody", ["nogroup"])
+    print pyhdfs.exists(fs, "/test/foo")
+    pyhdfs.disconnect(fs)
     
 if __name__ == "__main__":
     main()